@@ -42,8 +42,17 @@
 #include <linux/power_supply.h>
 #include <linux/hwmon.h>
 #include <linux/hwmon-sysfs.h>
+#include <linux/thermal.h>
+#include <linux/tick.h>
+#include <linux/kernel_stat.h>
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
+#include <linux/completion.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/configfs.h>
+#include <linux/uaccess.h>
+#include <linux/sched.h>
 #include <linux/platform_device.h>
 #include <linux/acpi.h>
 #include <linux/dmi.h>
@@ -70,6 +79,7 @@ static inline long deci_kelvin_to_millicelsius(long t)
 #include <acpi/video.h>
 
 #include "faustus.h"
+#include "faustus_uapi.h"
 
 MODULE_AUTHOR("Corentin Chary <corentin.chary@gmail.com>, "
 	      "Yong Wang <yong.y.wang@intel.com>");
@@ -84,6 +94,10 @@ static bool report_key_events = 0;
 module_param(report_key_events, bool, 0644);
 MODULE_PARM_DESC(report_key_events, "Forward fan mode key events");
 
+static bool shadow_check = 0;
+module_param(shadow_check, bool, 0644);
+MODULE_PARM_DESC(shadow_check, "Cross-check cached LED and backlight state with the BIOS");
+
 #define ASUS_WMI_MGMT_GUID	"97845ED0-4E6D-11DE-8A39-0800200C9A66"
 
 #define NOTIFY_BRNUP_MIN		0x11
@@ -91,10 +105,13 @@ MODULE_PARM_DESC(report_key_events, "Forward fan mode key events");
 #define NOTIFY_BRNDOWN_MIN		0x20
 #define NOTIFY_BRNDOWN_MAX		0x2e
 #define NOTIFY_FNLOCK_TOGGLE		0x4e
+#define NOTIFY_BATTERY_MODE		0x57
+#define NOTIFY_AC_MODE			0x58
 #define NOTIFY_WNDWSLOCK_TOGGLE		0x4f
 #define NOTIFY_KBD_DOCK_CHANGE		0x75
 #define NOTIFY_KBD_BRTUP		0xc4
 #define NOTIFY_KBD_BRTDWN		0xc5
+#define NOTIFY_ALS			0xc6
 #define NOTIFY_KBD_BRTTOGGLE		0xc7
 #define NOTIFY_KBD_FBM			0x99
 #define NOTIFY_KBD_TTP			0xae
@@ -110,10 +127,24 @@ MODULE_PARM_DESC(report_key_events, "Forward fan mode key events");
 #define ASUS_FAN_SFUN_READ		0x06
 #define ASUS_FAN_SFUN_WRITE		0x07
 
+/* Sensor cache lifetime in ms, exported as hwmon update_interval */
+#define ASUS_HWMON_UPDATE_INTERVAL	1000
+#define ASUS_HWMON_UPDATE_INTERVAL_MAX	60000
+#define ASUS_HWMON_TEMP_LIMIT_MAX	150000	/* millidegree Celsius */
+#define ASUS_HWMON_FAN_LIMIT_MAX	20000	/* RPM */
+
 /* Based on standard hwmon pwmX_enable values */
 #define ASUS_FAN_CTRL_FULLSPEED		0
 #define ASUS_FAN_CTRL_MANUAL		1
 #define ASUS_FAN_CTRL_AUTO		2
+#define ASUS_FAN_CTRL_CURVE		3
+
+#define ASUS_FAN_CURVE_POINTS		8
+#define ASUS_FAN_CURVE_INTERVAL		1000	/* ms, lower bound */
+#define ASUS_FAN_CURVE_TEMP_MAX		150000	/* millidegree Celsius */
+#define ASUS_FAN_CURVE_HYST		3000
+#define ASUS_FAN_CURVE_HYST_MAX		20000
+#define ASUS_FAN_CURVE_RAMP		32	/* pwm per evaluation */
 
 #define ASUS_FAN_BOOST_MODE_NORMAL		0
 #define ASUS_FAN_BOOST_MODE_OVERBOOST		1
@@ -126,6 +157,23 @@ MODULE_PARM_DESC(report_key_events, "Forward fan mode key events");
 #define ASUS_THROTTLE_THERMAL_POLICY_OVERBOOST	1
 #define ASUS_THROTTLE_THERMAL_POLICY_SILENT	2
 
+#define ASUS_PERF_LEVELS_MAX			3
+
+/* Fan boost modes and thermal policies are both numbered 0 - 2 */
+#define ASUS_MODE_COUNT				3
+
+#define ASUS_AUTO_POLICY_LOAD_HIGH	70	/* percent */
+#define ASUS_AUTO_POLICY_LOAD_LOW	20
+#define ASUS_AUTO_POLICY_TEMP_MAX	95000	/* millidegree Celsius */
+#define ASUS_AUTO_POLICY_DWELL		10000	/* ms */
+#define ASUS_AUTO_POLICY_INTERVAL	1000	/* ms */
+
+/* Passive trip of the thermal zone, in millidegree Celsius and ms */
+#define ASUS_THERMAL_PASSIVE_TEMP	90000
+#define ASUS_THERMAL_PASSIVE_HYST	5000
+#define ASUS_THERMAL_PASSIVE_DELAY	1000
+#define ASUS_THERMAL_POLLING_DELAY	5000
+
 #define USB_INTEL_XUSB2PR		0xD0
 #define PCI_DEVICE_ID_INTEL_LYNXPOINT_LP_XHCI	0x9c31
 
@@ -193,6 +241,12 @@ struct asus_wmi_debug {
 	u32 method_id;
 	u32 dev_id;
 	u32 ctrl_param;
+	u32 scan_start;
+	u32 scan_end;
+
+	struct mutex batch_lock;
+	char *batch_out;	/* results of the last batch */
+	size_t batch_len;
 };
 
 struct asus_rfkill {
@@ -207,6 +261,7 @@ struct asus_kbbl_rgb {
 	u8 kbbl_blue;
 	u8 kbbl_mode;
 	u8 kbbl_speed;
+	u8 kbbl_flags;		/* as written, see kbbl_rgb_flags() */
 	u8 kbbl_auraspeed;
 	u8 kbbl_auramode;
 
@@ -220,12 +275,367 @@ struct asus_kbbl_rgb {
 	u8 kbbl_set_auramode;
 };
 
+#define ASUS_KBBL_MAP_POINTS		8
+#define ASUS_KBBL_MAP_INTERVAL		2000	/* ms */
+#define ASUS_KBBL_MAP_INTERVAL_MIN	250	/* ms */
+#define ASUS_KBBL_MAP_INTERVAL_MAX	60000	/* ms */
+
+#define ASUS_FADE_STEP			100	/* ms, shortest step given to the EC */
+#define ASUS_FADE_MAX			10000	/* ms */
+
+#define ASUS_KBD_IDLE_TIMEOUT_MAX	3600	/* s */
+
+/* Reasons for blanking the RGB keyboard */
+#define KBBL_DARK_IDLE			BIT(0)
+#define KBBL_DARK_PROFILE		BIT(1)
+
+enum kbbl_map_source {
+	KBBL_MAP_NONE = 0,
+	KBBL_MAP_TEMP,		/* CPU temperature, degrees Celsius */
+	KBBL_MAP_POLICY,	/* throttle thermal policy or fan boost mode */
+	KBBL_MAP_FAN,		/* CPU fan speed, RPM */
+	KBBL_MAP_MAX = KBBL_MAP_FAN,
+};
+
+struct kbbl_map_point {
+	int value;
+	u8 red;
+	u8 green;
+	u8 blue;
+};
+
+/*
+ * Ties the RGB keyboard color to one telemetry source. Points are sorted by
+ * value and the color is linearly interpolated between neighbours.
+ */
+struct asus_kbbl_map {
+	struct mutex lock;
+	struct delayed_work work;
+	enum kbbl_map_source source;
+	unsigned int interval;	/* ms, polling period for sensor sources */
+	int npoints;
+	struct kbbl_map_point points[ASUS_KBBL_MAP_POINTS];
+	unsigned long fed;	/* jiffies of the last value seen */
+	bool color_valid;
+	u32 color;		/* last written color, 0xRRGGBB */
+	bool shown;		/* mapped color on the keys, under the lease lock */
+	/* colors before the mapped one, also under the lease lock */
+	struct faustus_kbbl_state unshown;
+};
+
+/*
+ * Arbitration between RGB clients. The holder is the /dev/faustus_kbbl file
+ * that took the lease; sysfs, hotkeys, profiles and any other descriptor,
+ * even of the same process, are other clients.
+ */
+struct asus_kbbl_lease {
+	struct mutex lock;
+	struct file *owner;	/* NULL when no lease is held */
+	pid_t tgid;		/* of the holder, shown in kbbl_lease */
+	u32 type;
+	bool queued;		/* a commit is waiting for the lease release */
+	struct faustus_kbbl_state queued_state;
+	bool queued_saved;	/* a persistent one a temporary replaced */
+	struct faustus_kbbl_state saved_state;
+
+	unsigned long contention;	/* lease requests refused */
+	unsigned long rejects;		/* writes refused */
+	unsigned long deferred;		/* commits queued */
+};
+
+/*
+ * Static color transition. Steps are written temporarily, the last one with
+ * the persistence of the commit that started the fade.
+ */
+struct asus_kbbl_fade {
+	struct delayed_work work;
+	unsigned int transition;	/* ms, 0 - switch at once */
+	bool active;
+	unsigned long start;		/* jiffies */
+	int persistent;
+	u8 flags;
+	u8 from[3];
+	u8 to[3];
+};
+
+/*
+ * Keyboard backlight idle-off. Key events only stamp the time; one delayed
+ * work fires at the deadline and re-arms itself if keys came in meanwhile.
+ */
+struct asus_kbd_idle {
+	struct mutex lock;
+	struct input_handler handler;
+	bool registered;
+	struct delayed_work work;
+	struct work_struct wake;
+	unsigned int timeout;	/* s, 0 - disabled */
+	bool rgb_off;
+	unsigned long last;	/* jiffies of the last key event */
+	bool idle;
+	int saved_level;	/* restored if nobody changed the level */
+};
+
+/*
+ * Keyboard backlight level picked from the ambient light environment the
+ * BIOS reports along with the backlight state (0 - dark, 1 - normal,
+ * 2 - light). Evaluated on ALS notifications only.
+ */
+struct asus_kbd_als {
+	struct mutex lock;
+	struct work_struct work;
+	bool enabled;
+	bool sensor_forced;	/* ALS turned on by us, off again on disable */
+	int env;		/* last environment seen, -1 - none */
+	u8 levels[3];
+};
+
+enum asus_profile_field {
+	ASUS_PROFILE_FAN_BOOST_MODE,
+	ASUS_PROFILE_THERMAL_POLICY,
+	ASUS_PROFILE_CHARGE_END,
+	ASUS_PROFILE_KBD,
+	ASUS_PROFILE_KBBL,		/* color, mode and speed together */
+	ASUS_PROFILE_FIELDS,
+};
+
+/* Field results besides 0 (written) and -errno */
+#define ASUS_PROFILE_UNSET		1
+#define ASUS_PROFILE_UNCHANGED		2
+#define ASUS_PROFILE_DEFERRED		3
+
+/*
+ * Named settings under /sys/kernel/config/faustus/, applied together on
+ * activation. Fields set to -1 are left alone.
+ */
+struct asus_profile {
+	struct config_item item;
+	int fan_boost_mode;
+	int throttle_thermal_policy;
+	int charge_control_end_threshold;
+	int kbd_backlight;
+	int kbbl_color;			/* 0xRRGGBB */
+	int kbbl_mode;
+	int kbbl_speed;
+
+	int status[ASUS_PROFILE_FIELDS];	/* of the last activation */
+};
+
+struct asus_profiles {
+	struct mutex lock;		/* serializes activations */
+	struct configfs_subsystem subsys;
+	bool registered;
+	struct asus_profile *active;	/* last activated */
+};
+
 enum fan_type {
 	FAN_TYPE_NONE = 0,
 	FAN_TYPE_AGFN,		/* deprecated on newer platforms */
 	FAN_TYPE_SPEC83,	/* starting in Spec 8.3, use CPU_FAN_CTRL */
 };
 
+struct asus_fan_curve {
+	struct mutex lock;
+	struct delayed_work work;
+	int temp[ASUS_FAN_CURVE_POINTS];	/* millidegree Celsius */
+	u8 pwm[ASUS_FAN_CURVE_POINTS];
+	int hyst;		/* millidegree Celsius */
+	unsigned int ramp;	/* 0 - unlimited */
+	bool temp_valid;
+	long temp_used;		/* temperature the duty was computed for */
+};
+
+/* A hwmon limit and its alarm, as of the last reading */
+struct asus_hwmon_limit {
+	long limit;		/* 0 - disabled */
+	bool alarm;
+};
+
+struct asus_hwmon_cache {
+	bool valid;
+	unsigned long stamp;	/* jiffies of the last BIOS read */
+	int err;
+	long value;
+};
+
+/* Ring size must be a power of two */
+#define ASUS_TELEMETRY_SAMPLES		512
+#define ASUS_TELEMETRY_PERIOD		1000	/* ms */
+#define ASUS_TELEMETRY_PERIOD_MIN	100
+#define ASUS_TELEMETRY_PERIOD_MAX	60000
+#define ASUS_TELEMETRY_IDLE		300000	/* ms without reads before backoff */
+
+struct asus_telemetry {
+	struct mutex lock;
+	struct delayed_work work;
+	struct faustus_telemetry_sample *ring;
+	u64 head;		/* sequence number of the next sample */
+	unsigned int period;	/* configured period in ms, 0 if stopped */
+	unsigned int delay;	/* current period in ms with backoff */
+	unsigned long consumed;	/* jiffies of the last read */
+	int readers;
+	wait_queue_head_t wait;
+	struct miscdevice miscdev;
+};
+
+/* Origin of a fan boost mode or thermal policy change */
+enum asus_mode_source {
+	ASUS_MODE_SRC_HOTKEY,
+	ASUS_MODE_SRC_SYSFS,
+	ASUS_MODE_SRC_DRIVER,
+	ASUS_MODE_SRC_THERMAL,
+	ASUS_MODE_SRC_COUNT,
+};
+
+struct asus_mode_residency {
+	spinlock_t lock;
+	u8 mode;
+	u64 since;			/* ktime_get_ns() of the last update */
+	u64 time[ASUS_MODE_COUNT];	/* ns spent in each mode */
+	unsigned long entries[ASUS_MODE_COUNT][ASUS_MODE_SRC_COUNT];
+};
+
+enum asus_perf_ctrl {
+	ASUS_PERF_FAN_BOOST,
+	ASUS_PERF_THERMAL_POLICY,
+	ASUS_PERF_CTRL_COUNT,
+};
+
+struct asus_perf_cdev {
+	struct asus_wmi *asus;
+	enum asus_perf_ctrl ctrl;
+	struct thermal_cooling_device *cdev;
+	unsigned long state;	/* last set by the thermal framework */
+};
+
+struct asus_auto_policy {
+	struct mutex lock;
+	struct delayed_work work;
+	bool available;
+	bool enabled;
+
+	unsigned int load_high;		/* percent */
+	unsigned int load_low;
+	int temp_max;			/* millidegree Celsius */
+	unsigned int dwell;		/* ms */
+	unsigned int interval;		/* ms */
+	bool idle_default;
+
+	unsigned int load;		/* averaged load in percent */
+	u64 idle_us;			/* previous idle and wall time sums */
+	u64 wall_us;
+	unsigned long changed;		/* jiffies of the last transition */
+	unsigned long up;
+	unsigned long down;
+};
+
+struct asus_boost {
+	struct mutex lock;
+	struct list_head leases;
+	struct delayed_work expiry;	/* runs at the earliest expiry */
+	bool available;
+	bool active;		/* a lease is in effect */
+	int baseline;		/* level to restore after the last lease */
+	struct miscdevice miscdev;
+};
+
+enum asus_power_source {
+	ASUS_POWER_BATTERY,
+	ASUS_POWER_AC,
+	ASUS_POWER_COUNT,
+};
+
+/* Settings for one power source, -1 leaves a setting alone */
+struct asus_power_profile {
+	int mode;	/* fan_boost_mode or throttle_thermal_policy value */
+	int kbd;	/* keyboard backlight level */
+	int rgb;	/* 0 - RGB keyboard blanked, 1 - shown */
+};
+
+struct asus_power_profiles {
+	struct mutex lock;
+	struct work_struct work;
+	bool available;
+	bool enabled;
+	int source;		/* enum asus_power_source */
+	struct asus_power_profile profile[ASUS_POWER_COUNT];
+
+	unsigned long writes;	/* settings changed */
+	unsigned long skipped;	/* settings already matching */
+};
+
+enum asus_led_id {
+	ASUS_LED_TPD,
+	ASUS_LED_KBD,
+	ASUS_LED_WLAN,
+	ASUS_LED_LIGHTBAR,
+	ASUS_LED_COUNT,
+};
+
+/*
+ * LED, backlight and device values kept by the driver instead of being read
+ * back from the BIOS on every get. A value is valid until the firmware may
+ * have changed it on its own (resume, hotkeys it acts on, radio switches).
+ */
+enum asus_shadow_id {
+	ASUS_SHADOW_TPD_LED,
+	ASUS_SHADOW_KBD_LED,
+	ASUS_SHADOW_WLAN_LED,
+	ASUS_SHADOW_LIGHTBAR_LED,
+	ASUS_SHADOW_BRIGHTNESS,
+	ASUS_SHADOW_BL_POWER,
+	/* Devices of the plain sysfs attributes, values in dev_wk[] */
+	ASUS_SHADOW_TOUCHPAD,
+	ASUS_SHADOW_CAMERA,
+	ASUS_SHADOW_CARDR,
+	ASUS_SHADOW_LID_RESUME,
+	ASUS_SHADOW_ALS_ENABLE,
+	ASUS_SHADOW_FNLOCK,
+	ASUS_SHADOW_COUNT,
+};
+
+/* Latest brightness requested for a LED and what reached the BIOS */
+struct asus_led_slot {
+	bool queued;
+	u32 pending;		/* ctrl_param to write */
+	u32 applied;		/* last ctrl_param written */
+	bool applied_valid;
+
+	unsigned long writes;		/* WMI writes done */
+	unsigned long coalesced;	/* values replaced before the write */
+	unsigned long skipped;		/* values equal to the applied one */
+};
+
+/*
+ * Locking, outermost first. A sleeping lock is only taken while holding
+ * locks above it; the right column is what each one really nests:
+ *
+ *   profiles.lock         ctl_lock, kbd_idle.lock, kbbl_lease.lock
+ *   power_profiles.lock   boost.lock, kbd_idle.lock, kbbl_lease.lock
+ *   auto_policy.lock      ctl_lock
+ *   boost.lock            ctl_lock
+ *   kbd_als.lock          kbd_idle.lock
+ *   kbd_idle.lock         kbbl_lease.lock, input handler (un)registration
+ *   ctl_lock              kbbl_map.lock (modes and Fn-lock)
+ *   fan_lock              fan_curve.lock, hwmon_lock (fan_pwm_mode, agfn_pwm)
+ *   fan_curve.lock        hwmon_lock
+ *   hwmon_lock            telemetry.lock (period against the limits)
+ *   kbbl_map.lock         kbbl_lease.lock
+ *   kbbl_lease.lock       nothing (RGB state and writes)
+ *   telemetry.lock        nothing, the sampler reads before taking it
+ *   debug.batch_lock      nothing, only the result buffer
+ *   rfkill_lock           nothing (WLAN rfkill writes against hotplug)
+ *   hotplug_lock          PCI rescan, never nested with rfkill_lock
+ *
+ * Any of the above may be held across a WMI call, which takes
+ * asus_wmi_submit_lock innermost and only for one ACPI evaluation.
+ * Spinlocks (state_seq, led_lock, the residency, DSTS flight and breaker
+ * locks) are never held across a WMI call. led_lock nests state_seq to
+ * publish the keyboard level, the others are leaves.
+ *
+ * The notify handler only takes state locks and never waits for the hotplug
+ * work, and asus_rfkill_hotplug() takes no state lock, so the two can run
+ * in any order.
+ */
 struct asus_wmi {
 	int dsts_id;
 	int spec;
@@ -242,12 +652,22 @@ struct asus_wmi {
 	int tpd_led_wk;
 	struct led_classdev kbd_led;
 	int kbd_led_wk;
+	int kbd_led_level;		/* level last queued, under led_lock */
+	unsigned int kbd_led_transition;	/* ms for a fade from 0 to max */
+	struct delayed_work kbd_led_fade;
+	struct asus_kbd_idle kbd_idle;
+	struct asus_kbd_als kbd_als;
 	struct led_classdev lightbar_led;
 	int lightbar_led_wk;
 	struct workqueue_struct *led_workqueue;
-	struct work_struct tpd_led_work;
-	struct work_struct wlan_led_work;
-	struct work_struct lightbar_led_work;
+	struct work_struct led_work;
+	spinlock_t led_lock;
+	struct asus_led_slot led_slots[ASUS_LED_COUNT];
+	unsigned long shadow_valid;	/* BIT(asus_shadow_id) */
+	unsigned long shadow_present;	/* BIT(asus_shadow_id), probed once */
+	int bl_brightness_wk;
+	int bl_power_wk;
+	int dev_wk[ASUS_SHADOW_COUNT];
 
 	struct asus_rfkill wlan;
 	struct asus_rfkill bluetooth;
@@ -257,39 +677,86 @@ struct asus_wmi {
 	struct asus_rfkill uwb;
 
 	enum fan_type fan_type;
+	struct mutex fan_lock;
 	int fan_pwm_mode;
 	int agfn_pwm;
+	struct asus_fan_curve fan_curve;
+
+	struct mutex hwmon_lock;
+	unsigned int hwmon_interval;
+	struct asus_hwmon_cache hwmon_temp;
+	struct asus_hwmon_cache hwmon_fan[2];
+	struct asus_hwmon_limit hwmon_temp_max;
+	struct asus_hwmon_limit hwmon_temp_crit;
+	struct asus_hwmon_limit hwmon_fan_min[2];
+	struct device *hwmon_dev;
+
+	struct asus_telemetry telemetry;
 
 	bool fan_boost_mode_available;
 	u8 fan_boost_mode_mask;
 	u8 fan_boost_mode;
+	struct asus_mode_residency fan_boost_mode_residency;
 
 	bool throttle_thermal_policy_available;
 	u8 throttle_thermal_policy_mode;
+	struct asus_mode_residency throttle_thermal_policy_residency;
+
+	struct asus_perf_cdev perf_cdev[ASUS_PERF_CTRL_COUNT];
+	struct thermal_zone_device *thermal_zone;
+	struct asus_auto_policy auto_policy;
+	struct asus_boost boost;
+	struct asus_power_profiles power_profiles;
+	struct asus_profiles profiles;
+	struct miscdevice ctl_miscdev;
+	bool ctl_available;
 
 	// The RSOC controls the maximum charging percentage.
 	bool battery_rsoc_available;
 
 	bool kbbl_rgb_available;
 	struct asus_kbbl_rgb kbbl_rgb;
+	struct asus_kbbl_map kbbl_map;
+	struct asus_kbbl_lease kbbl_lease;
+	struct asus_kbbl_fade kbbl_fade;
+	unsigned int kbbl_dark;		/* KBBL_DARK_* reasons to blank */
+	struct asus_kbbl_rgb kbbl_dark_saved;
+	struct miscdevice kbbl_miscdev;
 
 	struct hotplug_slot hotplug_slot;
 	struct mutex hotplug_lock;
-	struct mutex wmi_lock;
+	struct mutex rfkill_lock;
 	struct workqueue_struct *hotplug_workqueue;
 	struct work_struct hotplug_work;
 
 	bool fnlock_locked;
+	bool fnlock_available;
 	bool wndwslock_locked;
 
 	struct asus_wmi_debug debug;
 
+	/*
+	 * fan_boost_mode, throttle_thermal_policy_mode, fnlock_locked,
+	 * kbd_led_wk and the current kbbl_rgb colors are published under
+	 * state_seq, see asus_state_read(). ctl_lock serializes mode and
+	 * Fn-lock changes.
+	 */
+	seqlock_t state_seq;
+	struct mutex ctl_lock;
+
 	struct asus_wmi_driver *driver;
 };
 
 /* WMI ************************************************************************/
 
-static int asus_wmi_evaluate_method5(u32 method_id,
+/*
+ * The BIOS methods behind the management GUID are not reentrant. Held for
+ * exactly one evaluation, nothing else is taken under it.
+ */
+static DEFINE_MUTEX(asus_wmi_submit_lock);
+
+/* Called with asus_wmi_submit_lock held */
+static int __asus_wmi_evaluate_method5(u32 method_id,
 		u32 arg0, u32 arg1, u32 arg2, u32 arg4, u32 arg5, u32 *retval)
 {
 	struct bios_args args = {
@@ -305,6 +772,8 @@ static int asus_wmi_evaluate_method5(u32 method_id,
 	union acpi_object *obj;
 	u32 tmp = 0;
 
+	lockdep_assert_held(&asus_wmi_submit_lock);
+
 	status = wmi_evaluate_method(ASUS_WMI_MGMT_GUID, 0, method_id,
 				     &input, &output);
 
@@ -318,6 +787,12 @@ static int asus_wmi_evaluate_method5(u32 method_id,
 	if (retval)
 		*retval = tmp;
 
+	/* Anything but an integer is garbage for a device call */
+	if (obj && obj->type != ACPI_TYPE_INTEGER) {
+		kfree(obj);
+		return -EPROTO;
+	}
+
 	kfree(obj);
 
 	if (tmp == ASUS_WMI_UNSUPPORTED_METHOD)
@@ -326,6 +801,20 @@ static int asus_wmi_evaluate_method5(u32 method_id,
 	return 0;
 }
 
+static int asus_wmi_evaluate_method5(u32 method_id,
+		u32 arg0, u32 arg1, u32 arg2, u32 arg4, u32 arg5, u32 *retval)
+{
+	int err;
+
+	mutex_lock(&asus_wmi_submit_lock);
+	err = __asus_wmi_evaluate_method5(method_id, arg0, arg1, arg2, arg4,
+					  arg5, retval);
+	mutex_unlock(&asus_wmi_submit_lock);
+
+	/* Other methods may answer with a buffer, like they always could */
+	return err == -EPROTO ? 0 : err;
+}
+
 static int asus_wmi_evaluate_method3(u32 method_id,
 		u32 arg0, u32 arg1, u32 arg2, u32 *retval)
 {
@@ -366,16 +855,415 @@ static int asus_wmi_evaluate_method_agfn(const struct acpi_buffer args)
 	return retval;
 }
 
+/*
+ * Device status and set calls are timed against a budget. After a few slow
+ * or failed calls in a row (ACPI errors, garbage replies, or the unsupported
+ * answer from a method that worked before) the breaker of the device opens:
+ * status queries get the last answer and writes are queued, last one wins. Once every
+ * retry period one call goes to the BIOS again (half-open) and closes the
+ * breaker when it is fine, replaying the queued write. A queued write
+ * returns -EINPROGRESS, the value has not reached the BIOS yet.
+ */
+#define ASUS_WMI_BUDGET_READ_US		50000
+#define ASUS_WMI_BUDGET_WRITE_US	100000
+#define ASUS_WMI_BREAKER_STRIKES	3
+#define ASUS_WMI_BREAKER_RETRY		(5 * HZ)
+#define ASUS_WMI_BREAKERS		48
+
+/* Closed breakers are recycled, least recently used first */
+struct asus_wmi_breaker {
+	bool used;
+	u32 dev_id;
+	unsigned int users;		/* calls running */
+	unsigned long last_used;	/* jiffies */
+	bool answered;			/* a call succeeded once */
+	unsigned int strikes;		/* slow or failed calls in a row */
+	bool open;
+	bool probing;			/* half-open call running */
+	unsigned long retry_at;		/* jiffies */
+	bool cached_valid;
+	u32 cached;			/* last status read */
+	int cached_err;
+	bool write_queued;
+	u32 write_param;
+
+	unsigned long calls;
+	unsigned long slow;
+	unsigned long failed;
+	unsigned long trips;
+	unsigned long served;		/* reads answered from cache */
+	unsigned long deferred;		/* writes queued */
+	u32 max_us;
+};
+
+static DEFINE_SPINLOCK(asus_wmi_breaker_lock);
+static struct asus_wmi_breaker asus_wmi_breakers[ASUS_WMI_BREAKERS];
+
+static void asus_wmi_breaker_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(asus_wmi_breaker_work, asus_wmi_breaker_work_fn);
+
+static bool asus_wmi_breaker_idle(struct asus_wmi_breaker *b)
+{
+	return !b->users && !b->open && !b->strikes && !b->write_queued;
+}
+
+/*
+ * Called with the breaker lock held, takes a reference dropped by
+ * asus_wmi_breaker_put(). NULL when every slot has a tripping breaker.
+ */
+static struct asus_wmi_breaker *asus_wmi_breaker_get(u32 dev_id)
+{
+	struct asus_wmi_breaker *free = NULL;
+	int i;
+
+	lockdep_assert_held(&asus_wmi_breaker_lock);
+
+	for (i = 0; i < ASUS_WMI_BREAKERS; i++) {
+		struct asus_wmi_breaker *b = &asus_wmi_breakers[i];
+
+		if (b->used && b->dev_id == dev_id) {
+			free = b;
+			goto out;
+		}
+		if (!b->used) {
+			if (!free || free->used)
+				free = b;
+		} else if (asus_wmi_breaker_idle(b) &&
+			   (!free || (free->used &&
+				      time_before(b->last_used,
+						  free->last_used)))) {
+			free = b;
+		}
+	}
+
+	if (!free) {
+		pr_warn_ratelimited("No WMI breaker left for device %#x\n",
+				    dev_id);
+		return NULL;
+	}
+
+	memset(free, 0, sizeof(*free));
+	free->used = true;
+	free->dev_id = dev_id;
+out:
+	free->users++;
+	free->last_used = jiffies;
+	return free;
+}
+
+/* Called with the breaker lock held */
+static void asus_wmi_breaker_put(struct asus_wmi_breaker *b)
+{
+	lockdep_assert_held(&asus_wmi_breaker_lock);
+
+	b->users--;
+}
+
+/* Called with the breaker lock held, answers a call the breaker stopped */
+static int asus_wmi_breaker_short(struct asus_wmi_breaker *b, bool write,
+				  u32 ctrl_param, u32 *result)
+{
+	lockdep_assert_held(&asus_wmi_breaker_lock);
+
+	if (write) {
+		b->write_queued = true;
+		b->write_param = ctrl_param;
+		b->deferred++;
+		schedule_delayed_work(&asus_wmi_breaker_work,
+				      max_t(long, b->retry_at - jiffies, 0));
+		return -EINPROGRESS;
+	}
+
+	if (!b->cached_valid)
+		return -EBUSY;
+
+	b->served++;
+	*result = b->cached;
+	return b->cached_err;
+}
+
+/*
+ * Called with the breaker lock held. Returns true if a queued write has to
+ * be replayed now that the breaker closed.
+ */
+static bool asus_wmi_breaker_record(struct asus_wmi_breaker *b, bool write,
+				    bool replay, u32 ctrl_param, int err,
+				    u32 result, s64 us)
+{
+	s64 budget = write ? ASUS_WMI_BUDGET_WRITE_US : ASUS_WMI_BUDGET_READ_US;
+	bool slow = us > budget;
+	bool failed;
+
+	lockdep_assert_held(&asus_wmi_breaker_lock);
+
+	/* Absent devices answer unsupported from the start, that is no fault */
+	failed = err == -EIO || err == -EPROTO ||
+		 (err == -ENODEV && b->answered);
+
+	b->calls++;
+	b->probing = false;
+	if (us > b->max_us)
+		b->max_us = min_t(s64, us, U32_MAX);
+
+	if (!err)
+		b->answered = true;
+	if (!err || (err == -ENODEV && !failed)) {
+		b->cached_valid = !write;
+		b->cached = result;
+		b->cached_err = err;
+	}
+
+	if (failed || slow) {
+		if (failed)
+			b->failed++;
+		else
+			b->slow++;
+
+		if (replay && !b->write_queued) {
+			b->write_queued = true;
+			b->write_param = ctrl_param;
+		}
+
+		if (++b->strikes < ASUS_WMI_BREAKER_STRIKES && !b->open)
+			return false;
+
+		if (!b->open) {
+			b->open = true;
+			b->trips++;
+			pr_warn("WMI calls for device %#x are failing, using cached state\n",
+				b->dev_id);
+		}
+		b->retry_at = jiffies + ASUS_WMI_BREAKER_RETRY;
+		if (b->write_queued)
+			schedule_delayed_work(&asus_wmi_breaker_work,
+					      ASUS_WMI_BREAKER_RETRY);
+		return false;
+	}
+
+	b->strikes = 0;
+	if (write)
+		b->write_queued = false;	/* superseded */
+
+	if (!b->open)
+		return false;
+
+	b->open = false;
+	pr_info("WMI calls for device %#x recovered\n", b->dev_id);
+
+	return b->write_queued;
+}
+
+static int __asus_wmi_call_dev(u32 method_id, u32 dev_id, u32 ctrl_param,
+			       u32 *retval, bool replay)
+{
+	bool write = method_id == ASUS_WMI_METHODID_DEVS;
+	struct asus_wmi_breaker *b;
+	bool flush = false;
+	u32 result = 0;
+	ktime_t start;
+	s64 us;
+	int err;
+
+	spin_lock(&asus_wmi_breaker_lock);
+	b = asus_wmi_breaker_get(dev_id);
+	if (b && b->open) {
+		if (b->probing || time_before(jiffies, b->retry_at)) {
+			err = asus_wmi_breaker_short(b, write, ctrl_param,
+						     &result);
+			asus_wmi_breaker_put(b);
+			spin_unlock(&asus_wmi_breaker_lock);
+			goto out;
+		}
+		b->probing = true;
+	}
+	spin_unlock(&asus_wmi_breaker_lock);
+
+	/* Only the BIOS time counts against the budget, not the queueing */
+	mutex_lock(&asus_wmi_submit_lock);
+	start = ktime_get();
+	err = __asus_wmi_evaluate_method5(method_id, dev_id, ctrl_param, 0, 0,
+					  0, &result);
+	us = ktime_us_delta(ktime_get(), start);
+	mutex_unlock(&asus_wmi_submit_lock);
+
+	if (b) {
+		spin_lock(&asus_wmi_breaker_lock);
+		flush = asus_wmi_breaker_record(b, write, replay, ctrl_param,
+						err, result, us);
+		if (flush) {
+			ctrl_param = b->write_param;
+			b->write_queued = false;
+		}
+		asus_wmi_breaker_put(b);
+		spin_unlock(&asus_wmi_breaker_lock);
+	}
+
+	if (flush)
+		__asus_wmi_call_dev(ASUS_WMI_METHODID_DEVS, dev_id, ctrl_param,
+				    NULL, true);
+out:
+	if (retval && !err)
+		*retval = result;
+	return err;
+}
+
+static int asus_wmi_call_dev(u32 method_id, u32 dev_id, u32 ctrl_param,
+			     u32 *retval)
+{
+	return __asus_wmi_call_dev(method_id, dev_id, ctrl_param, retval,
+				   false);
+}
+
+/* Half-open retries for devices with a queued write and no other traffic */
+static void asus_wmi_breaker_work_fn(struct work_struct *work)
+{
+	unsigned long next = 0;
+	u32 dev_id, ctrl_param;
+	bool pending;
+	int i;
+
+	for (i = 0; i < ASUS_WMI_BREAKERS; i++) {
+		struct asus_wmi_breaker *b = &asus_wmi_breakers[i];
+
+		spin_lock(&asus_wmi_breaker_lock);
+		pending = b->used && b->open && b->write_queued && !b->probing;
+		if (pending && time_before(jiffies, b->retry_at)) {
+			if (!next || time_before(b->retry_at, next))
+				next = b->retry_at;
+			pending = false;
+		}
+		if (pending) {
+			dev_id = b->dev_id;
+			ctrl_param = b->write_param;
+			b->write_queued = false;
+		}
+		spin_unlock(&asus_wmi_breaker_lock);
+
+		if (pending)
+			__asus_wmi_call_dev(ASUS_WMI_METHODID_DEVS, dev_id,
+					    ctrl_param, NULL, true);
+	}
+
+	if (next)
+		schedule_delayed_work(&asus_wmi_breaker_work,
+				      max_t(long, next - jiffies, 0));
+}
+
+/*
+ * Status queries for a device that arrive while an identical one is being
+ * evaluated wait for its result instead of making their own BIOS call.
+ * Each waiter gets the result in its own node, so the call it joined may
+ * return as soon as the result is handed out.
+ */
+struct asus_wmi_flight {
+	struct list_head list;
+	u32 method_id;
+	u32 dev_id;
+	bool stale;		/* a write to dev_id started meanwhile */
+	struct list_head waiters;
+};
+
+struct asus_wmi_flight_waiter {
+	struct list_head list;
+	struct completion done;
+	int err;
+	u32 retval;
+};
+
+static DEFINE_SPINLOCK(asus_wmi_flight_lock);
+static LIST_HEAD(asus_wmi_flights);
+static unsigned long asus_wmi_flight_calls;	/* status calls evaluated */
+static unsigned long asus_wmi_flight_joined;	/* calls saved */
+
 static int asus_wmi_get_devstate(struct asus_wmi *asus, u32 dev_id, u32 *retval)
 {
-	return asus_wmi_evaluate_method(asus->dsts_id, dev_id, 0, retval);
+	struct asus_wmi_flight_waiter *waiter, *tmp;
+	struct asus_wmi_flight_waiter self;
+	struct asus_wmi_flight flight;
+	struct asus_wmi_flight *f;
+	u32 result = 0;
+	int err;
+
+	spin_lock(&asus_wmi_flight_lock);
+	list_for_each_entry(f, &asus_wmi_flights, list) {
+		if (f->method_id != asus->dsts_id || f->dev_id != dev_id ||
+		    f->stale)
+			continue;
+
+		init_completion(&self.done);
+		list_add_tail(&self.list, &f->waiters);
+		asus_wmi_flight_joined++;
+		spin_unlock(&asus_wmi_flight_lock);
+
+		wait_for_completion(&self.done);
+		if (retval)
+			*retval = self.retval;
+		return self.err;
+	}
+
+	flight.method_id = asus->dsts_id;
+	flight.dev_id = dev_id;
+	flight.stale = false;
+	INIT_LIST_HEAD(&flight.waiters);
+	list_add(&flight.list, &asus_wmi_flights);
+	asus_wmi_flight_calls++;
+	spin_unlock(&asus_wmi_flight_lock);
+
+	err = asus_wmi_call_dev(asus->dsts_id, dev_id, 0, &result);
+
+	spin_lock(&asus_wmi_flight_lock);
+	list_del(&flight.list);
+	list_for_each_entry_safe(waiter, tmp, &flight.waiters, list) {
+		waiter->err = err;
+		waiter->retval = result;
+		complete(&waiter->done);
+	}
+	spin_unlock(&asus_wmi_flight_lock);
+
+	if (retval)
+		*retval = result;
+	return err;
+}
+
+/*
+ * A status call already running may have sampled the device before this
+ * write, so it stops taking new waiters.
+ */
+static void asus_wmi_flight_forget(u32 dev_id)
+{
+	struct asus_wmi_flight *f;
+
+	spin_lock(&asus_wmi_flight_lock);
+	list_for_each_entry(f, &asus_wmi_flights, list) {
+		if (f->dev_id == dev_id)
+			f->stale = true;
+	}
+	spin_unlock(&asus_wmi_flight_lock);
+}
+
+/*
+ * Returns -EINPROGRESS if the write was queued behind an open breaker, there
+ * is no result then and *retval is left alone.
+ */
+static int __asus_wmi_set_devstate(u32 dev_id, u32 ctrl_param,
+				   u32 *retval)
+{
+	asus_wmi_flight_forget(dev_id);
+
+	return asus_wmi_call_dev(ASUS_WMI_METHODID_DEVS, dev_id, ctrl_param,
+				 retval);
 }
 
+/*
+ * A queued write is replayed once the breaker closes, callers that neither
+ * cache the written value nor check the result take it as done.
+ */
 static int asus_wmi_set_devstate(u32 dev_id, u32 ctrl_param,
 				 u32 *retval)
 {
-	return asus_wmi_evaluate_method(ASUS_WMI_METHODID_DEVS, dev_id,
-					ctrl_param, retval);
+	int err = __asus_wmi_set_devstate(dev_id, ctrl_param, retval);
+
+	return err == -EINPROGRESS ? 0 : err;
 }
 
 /* Helper for special devices with magic return codes */
@@ -414,6 +1302,66 @@ static bool asus_wmi_dev_is_present(struct asus_wmi *asus, u32 dev_id)
 	return status == 0 && (retval & ASUS_WMI_DSTS_PRESENCE_BIT);
 }
 
+/* Control state **************************************************************/
+
+/*
+ * Writers of the published fields hold ctl_lock (modes, Fn-lock) or the RGB
+ * lease lock (colors); the keyboard level may be set from atomic context and
+ * only relies on the seqlock.
+ */
+#define asus_state_publish(asus, field, value)				\
+	do {								\
+		unsigned long __flags;					\
+									\
+		write_seqlock_irqsave(&(asus)->state_seq, __flags);	\
+		(field) = (value);					\
+		write_sequnlock_irqrestore(&(asus)->state_seq, __flags); \
+	} while (0)
+
+struct asus_state {
+	u8 fan_boost_mode;
+	u8 throttle_thermal_policy_mode;
+	bool fnlock_locked;
+	int kbd_led_wk;
+	u8 red;
+	u8 green;
+	u8 blue;
+	u8 mode;
+	u8 speed;
+	u8 flags;
+};
+
+/*
+ * Flags of the colors shown: those of the last write, 2a (everything
+ * enabled) before the first one. Writes with flags 0 keep them.
+ */
+static u8 kbbl_rgb_flags(const struct asus_kbbl_rgb *rgb)
+{
+	return rgb->kbbl_flags ? : 0x2a;
+}
+
+/* Consistent copy of the published fields, without taking locks */
+static void asus_state_read(struct asus_wmi *asus, struct asus_state *state)
+{
+	const struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&asus->state_seq);
+		state->fan_boost_mode = asus->fan_boost_mode;
+		state->throttle_thermal_policy_mode =
+			asus->throttle_thermal_policy_mode;
+		state->fnlock_locked = asus->fnlock_locked;
+		state->kbd_led_wk = asus->kbd_led_wk;
+		state->red = rgb->kbbl_red;
+		state->green = rgb->kbbl_green;
+		state->blue = rgb->kbbl_blue;
+		state->mode = rgb->kbbl_mode;
+		state->speed = rgb->kbbl_speed;
+		state->flags = kbbl_rgb_flags(rgb);
+	} while (read_seqretry(&asus->state_seq, seq));
+}
+
 /* Input **********************************************************************/
 
 static int asus_wmi_input_init(struct asus_wmi *asus)
@@ -494,30 +1442,42 @@ static void lid_flip_tablet_mode_get_state(struct asus_wmi *asus)
 /* The battery maximum charging percentage */
 static int charge_end_threshold;
 
-static ssize_t charge_control_end_threshold_store(struct device *dev,
-						  struct device_attribute *attr,
-						  const char *buf, size_t count)
+/* -EINPROGRESS if the write waits behind an open breaker */
+static int charge_end_threshold_write(int value)
 {
-	int value, ret, rv;
+	int ret, rv;
 
-	ret = kstrtouint(buf, 10, &value);
+	ret = __asus_wmi_set_devstate(ASUS_WMI_DEVID_RSOC, value, &rv);
 	if (ret)
 		return ret;
 
-	if (value < 0 || value > 100)
-		return -EINVAL;
-
-	ret = asus_wmi_set_devstate(ASUS_WMI_DEVID_RSOC, value, &rv);
-	if (ret)
-		return ret;
-
-	if (rv != 1)
-		return -EIO;
+	if (rv != 1)
+		return -EIO;
 
 	/* There isn't any method in the DSDT to read the threshold, so we
 	 * save the threshold.
 	 */
 	charge_end_threshold = value;
+	return 0;
+}
+
+static ssize_t charge_control_end_threshold_store(struct device *dev,
+						  struct device_attribute *attr,
+						  const char *buf, size_t count)
+{
+	int value, ret;
+
+	ret = kstrtouint(buf, 10, &value);
+	if (ret)
+		return ret;
+
+	if (value < 0 || value > 100)
+		return -EINVAL;
+
+	ret = charge_end_threshold_write(value);
+	if (ret && ret != -EINPROGRESS)
+		return ret;
+
 	return count;
 }
 
@@ -595,21 +1555,216 @@ static void asus_wmi_battery_exit(struct asus_wmi *asus)
 
 /* LEDs ***********************************************************************/
 
+static const u32 asus_led_dev_ids[ASUS_LED_COUNT] = {
+	[ASUS_LED_TPD] = ASUS_WMI_DEVID_TOUCHPAD_LED,
+	[ASUS_LED_KBD] = ASUS_WMI_DEVID_KBD_BACKLIGHT,
+	[ASUS_LED_WLAN] = ASUS_WMI_DEVID_WIRELESS_LED,
+	[ASUS_LED_LIGHTBAR] = ASUS_WMI_DEVID_LIGHTBAR,
+};
+
+static const enum asus_shadow_id asus_led_shadow_ids[ASUS_LED_COUNT] = {
+	[ASUS_LED_TPD] = ASUS_SHADOW_TPD_LED,
+	[ASUS_LED_KBD] = ASUS_SHADOW_KBD_LED,
+	[ASUS_LED_WLAN] = ASUS_SHADOW_WLAN_LED,
+	[ASUS_LED_LIGHTBAR] = ASUS_SHADOW_LIGHTBAR_LED,
+};
+
 /*
- * These functions actually update the LED's, and are called from a
- * workqueue. By doing this as separate work rather than when the LED
- * subsystem asks, we avoid messing with the Asus ACPI stuff during a
- * potentially bad time, such as a timer interrupt.
+ * The LEDs are actually updated from a single work item. By doing this as
+ * separate work rather than when the LED subsystem asks, we avoid messing
+ * with the Asus ACPI stuff during a potentially bad time, such as a timer
+ * interrupt. Only the latest value of each LED is written and values equal
+ * to what the BIOS already has are dropped, so fast triggers do not turn
+ * into a WMI call per transition.
  */
-static void tpd_led_update(struct work_struct *work)
+static void asus_led_work(struct work_struct *work)
 {
-	int ctrl_param;
-	struct asus_wmi *asus;
+	struct asus_wmi *asus = container_of(work, struct asus_wmi, led_work);
+	struct asus_led_slot *slot;
+	unsigned long flags;
+	u32 ctrl_param;
+	bool skip;
+	int err;
+	int i;
+
+	for (i = 0; i < ASUS_LED_COUNT; i++) {
+		slot = &asus->led_slots[i];
+
+		spin_lock_irqsave(&asus->led_lock, flags);
+		if (!slot->queued) {
+			spin_unlock_irqrestore(&asus->led_lock, flags);
+			continue;
+		}
+
+		ctrl_param = slot->pending;
+		slot->queued = false;
+		skip = slot->applied_valid && slot->applied == ctrl_param;
+		if (skip)
+			slot->skipped++;
+		spin_unlock_irqrestore(&asus->led_lock, flags);
+
+		if (skip)
+			continue;
+
+		err = __asus_wmi_set_devstate(asus_led_dev_ids[i], ctrl_param,
+					      NULL);
+
+		spin_lock_irqsave(&asus->led_lock, flags);
+		slot->applied = ctrl_param;
+		slot->applied_valid = !err;
+		slot->writes++;
+		spin_unlock_irqrestore(&asus->led_lock, flags);
+
+		/*
+		 * The setter already cached the level, read it back instead,
+		 * also while the write waits behind an open breaker.
+		 */
+		if (err)
+			clear_bit(asus_led_shadow_ids[i], &asus->shadow_valid);
+	}
+}
+
+/* Called with led_lock held, the caller queues led_work */
+static void __asus_led_queue(struct asus_wmi *asus, enum asus_led_id id,
+			     u32 ctrl_param)
+{
+	struct asus_led_slot *slot = &asus->led_slots[id];
+
+	lockdep_assert_held(&asus->led_lock);
+
+	if (slot->queued)
+		slot->coalesced++;
+	slot->pending = ctrl_param;
+	slot->queued = true;
+}
+
+/* May be called from atomic context */
+static void asus_led_queue(struct asus_wmi *asus, enum asus_led_id id,
+			   u32 ctrl_param)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&asus->led_lock, flags);
+	__asus_led_queue(asus, id, ctrl_param);
+	spin_unlock_irqrestore(&asus->led_lock, flags);
+
+	queue_work(asus->led_workqueue, &asus->led_work);
+}
+
+/* The firmware may have changed the LEDs behind our back, e.g. on resume */
+static void asus_led_invalidate(struct asus_wmi *asus)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&asus->led_lock, flags);
+	for (i = 0; i < ASUS_LED_COUNT; i++)
+		asus->led_slots[i].applied_valid = false;
+	spin_unlock_irqrestore(&asus->led_lock, flags);
+}
+
+/* Store a value read from the BIOS, checking it against a valid shadow */
+static int asus_shadow_update(struct asus_wmi *asus, enum asus_shadow_id id,
+			      int *shadow, int value, bool valid)
+{
+	if (valid && value != READ_ONCE(*shadow))
+		pr_warn_ratelimited("Cached state %d is %d, BIOS reports %d\n",
+				    id, READ_ONCE(*shadow), value);
+
+	WRITE_ONCE(*shadow, value);
+	set_bit(id, &asus->shadow_valid);
+	return value;
+}
 
-	asus = container_of(work, struct asus_wmi, tpd_led_work);
+/*
+ * Return the cached value of a LED or backlight, reading it from the BIOS
+ * only when it may be stale. With shadow_check the BIOS is always read and
+ * a mismatch with a valid cached value is reported.
+ */
+static int asus_shadow_get(struct asus_wmi *asus, enum asus_shadow_id id,
+			   int *shadow, int (*read)(struct asus_wmi *asus))
+{
+	bool valid = test_bit(id, &asus->shadow_valid);
+	int value;
+
+	if (valid && !shadow_check)
+		return READ_ONCE(*shadow);
+
+	value = read(asus);
+	if (value < 0)
+		return value;
+
+	return asus_shadow_update(asus, id, shadow, value, valid);
+}
+
+/* As asus_shadow_get() for a dev_id read with get_devstate_simple() */
+static int asus_shadow_get_devstate(struct asus_wmi *asus,
+				    enum asus_shadow_id id, u32 dev_id)
+{
+	bool valid = test_bit(id, &asus->shadow_valid);
+	int value;
+
+	if (valid && !shadow_check)
+		return READ_ONCE(asus->dev_wk[id]);
+
+	value = asus_wmi_get_devstate_simple(asus, dev_id);
+	if (value < 0)
+		return value;
+
+	set_bit(id, &asus->shadow_present);
+	return asus_shadow_update(asus, id, &asus->dev_wk[id], value, valid);
+}
+
+/* May be called from atomic context */
+static void asus_shadow_set(struct asus_wmi *asus, enum asus_shadow_id id,
+			    int *shadow, int value)
+{
+	WRITE_ONCE(*shadow, value);
+	set_bit(id, &asus->shadow_valid);
+}
+
+static void asus_shadow_invalidate(struct asus_wmi *asus)
+{
+	WRITE_ONCE(asus->shadow_valid, 0);
+}
+
+/* Hotkeys the firmware acts on by itself before notifying */
+static unsigned long asus_shadow_key_mask(int code)
+{
+	switch (code) {
+	case ASUS_WMI_BRN_UP:
+	case ASUS_WMI_BRN_DOWN:
+		return BIT(ASUS_SHADOW_BRIGHTNESS) | BIT(ASUS_SHADOW_BL_POWER);
+	case NOTIFY_KBD_BRTUP:
+	case NOTIFY_KBD_BRTDWN:
+	case NOTIFY_KBD_BRTTOGGLE:
+		return BIT(ASUS_SHADOW_KBD_LED);
+	case NOTIFY_FNLOCK_TOGGLE:
+		return BIT(ASUS_SHADOW_FNLOCK);
+	case 0x5D:	/* wireless console */
+	case 0x5E:
+	case 0x5F:
+	case 0x88:	/* radio toggle */
+		return BIT(ASUS_SHADOW_WLAN_LED);
+	case 0x60:	/* touchpad on */
+	case 0x6B:	/* touchpad toggle */
+		return BIT(ASUS_SHADOW_TOUCHPAD) | BIT(ASUS_SHADOW_TPD_LED);
+	case 0x7A:	/* ambient light sensor toggle */
+		return BIT(ASUS_SHADOW_ALS_ENABLE);
+	case 0x82:	/* camera */
+		return BIT(ASUS_SHADOW_CAMERA);
+	default:
+		return 0;
+	}
+}
+
+static void asus_shadow_invalidate_key(struct asus_wmi *asus, int code)
+{
+	unsigned long mask = asus_shadow_key_mask(code);
+	int id;
 
-	ctrl_param = asus->tpd_led_wk;
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_TOUCHPAD_LED, ctrl_param, NULL);
+	for_each_set_bit(id, &mask, ASUS_SHADOW_COUNT)
+		clear_bit(id, &asus->shadow_valid);
 }
 
 static void tpd_led_set(struct led_classdev *led_cdev,
@@ -619,8 +1774,8 @@ static void tpd_led_set(struct led_classdev *led_cdev,
 
 	asus = container_of(led_cdev, struct asus_wmi, tpd_led);
 
-	asus->tpd_led_wk = !!value;
-	queue_work(asus->led_workqueue, &asus->tpd_led_work);
+	asus_shadow_set(asus, ASUS_SHADOW_TPD_LED, &asus->tpd_led_wk, !!value);
+	asus_led_queue(asus, ASUS_LED_TPD, asus->tpd_led_wk);
 }
 
 static int read_tpd_led_state(struct asus_wmi *asus)
@@ -634,15 +1789,67 @@ static enum led_brightness tpd_led_get(struct led_classdev *led_cdev)
 
 	asus = container_of(led_cdev, struct asus_wmi, tpd_led);
 
-	return read_tpd_led_state(asus);
+	return asus_shadow_get(asus, ASUS_SHADOW_TPD_LED, &asus->tpd_led_wk,
+			       read_tpd_led_state);
 }
 
 static void kbd_led_update(struct asus_wmi *asus)
 {
-	int ctrl_param = 0;
+	unsigned long flags;
+	int level;
+
+	/* What is written becomes the BIOS state again, e.g. on resume */
+	set_bit(ASUS_SHADOW_KBD_LED, &asus->shadow_valid);
+
+	/* Level and queued value change together, racing a fade step */
+	spin_lock_irqsave(&asus->led_lock, flags);
+	level = READ_ONCE(asus->kbd_led_wk);
+	asus->kbd_led_level = level;
+	__asus_led_queue(asus, ASUS_LED_KBD, 0x80 | (level & 0x7F));
+	spin_unlock_irqrestore(&asus->led_lock, flags);
+
+	queue_work(asus->led_workqueue, &asus->led_work);
+}
+
+/*
+ * Walk the written level towards kbd_led_wk one step at a time. A new target
+ * set mid-fade is picked up by the next step.
+ */
+static void kbd_led_fade_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, kbd_led_fade);
+	unsigned int transition = READ_ONCE(asus->kbd_led_transition);
+	int target = READ_ONCE(asus->kbd_led_wk);
+	unsigned long flags;
+	unsigned int step;
+	int level;
+
+	spin_lock_irqsave(&asus->led_lock, flags);
+	level = asus->kbd_led_level;
+	if (level == target) {
+		spin_unlock_irqrestore(&asus->led_lock, flags);
+		return;
+	}
+
+	if (!transition)
+		level = target;
+	else
+		level += level < target ? 1 : -1;
+
+	asus->kbd_led_level = level;
+	__asus_led_queue(asus, ASUS_LED_KBD, 0x80 | (level & 0x7F));
+	spin_unlock_irqrestore(&asus->led_lock, flags);
+
+	queue_work(asus->led_workqueue, &asus->led_work);
+
+	if (level == target)
+		return;
 
-	ctrl_param = 0x80 | (asus->kbd_led_wk & 0x7F);
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_KBD_BACKLIGHT, ctrl_param, NULL);
+	step = max_t(unsigned int, ASUS_FADE_STEP,
+		     transition / asus->kbd_led.max_brightness);
+	queue_delayed_work(asus->led_workqueue, &asus->kbd_led_fade,
+			   msecs_to_jiffies(step));
 }
 
 static int kbd_led_read(struct asus_wmi *asus, int *level, int *env)
@@ -668,20 +1875,42 @@ static int kbd_led_read(struct asus_wmi *asus, int *level, int *env)
 	if (level)
 		*level = retval & 0x7F;
 	if (env)
-		*env = (retval >> 8) & 0x7F;
+		*env = (retval >> 8) & 0x7;
 	return 0;
 }
 
+static int kbd_led_read_level(struct asus_wmi *asus)
+{
+	int retval, value;
+
+	retval = kbd_led_read(asus, &value, NULL);
+	if (retval < 0)
+		return retval;
+
+	return value;
+}
+
 static void do_kbd_led_set(struct led_classdev *led_cdev, int value)
 {
 	struct asus_wmi *asus;
+	unsigned long flags;
 	int max_level;
 
 	asus = container_of(led_cdev, struct asus_wmi, kbd_led);
 	max_level = asus->kbd_led.max_brightness;
 
-	asus->kbd_led_wk = clamp_val(value, 0, max_level);
-	kbd_led_update(asus);
+	/* Under led_lock so that a level read back cannot overwrite it */
+	spin_lock_irqsave(&asus->led_lock, flags);
+	asus_state_publish(asus, asus->kbd_led_wk,
+			   clamp_val(value, 0, max_level));
+	spin_unlock_irqrestore(&asus->led_lock, flags);
+
+	if (READ_ONCE(asus->kbd_led_transition)) {
+		set_bit(ASUS_SHADOW_KBD_LED, &asus->shadow_valid);
+		queue_delayed_work(asus->led_workqueue, &asus->kbd_led_fade, 0);
+	} else {
+		kbd_led_update(asus);
+	}
 }
 
 static void kbd_led_set(struct led_classdev *led_cdev,
@@ -702,163 +1931,683 @@ static void kbd_led_set_by_kbd(struct asus_wmi *asus, enum led_brightness value)
 	led_classdev_notify_brightness_hw_changed(led_cdev, asus->kbd_led_wk);
 }
 
-static enum led_brightness kbd_led_get(struct led_classdev *led_cdev)
+/*
+ * As asus_shadow_get(), but the level read back is published like a set one.
+ * While a new level is fading in or waiting for led_work the BIOS still has
+ * an older one, kbd_led_wk is answered then and the read is dropped.
+ */
+static int kbd_led_get_level(struct asus_wmi *asus)
 {
-	struct asus_wmi *asus;
-	int retval, value;
+	struct asus_led_slot *slot = &asus->led_slots[ASUS_LED_KBD];
+	bool valid = test_bit(ASUS_SHADOW_KBD_LED, &asus->shadow_valid);
+	unsigned long flags;
+	int value;
 
-	asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+	if (valid && !shadow_check)
+		return READ_ONCE(asus->kbd_led_wk);
 
-	retval = kbd_led_read(asus, &value, NULL);
-	if (retval < 0)
-		return retval;
+	value = kbd_led_read_level(asus);
+	if (value < 0)
+		return value;
+
+	spin_lock_irqsave(&asus->led_lock, flags);
+	if (asus->kbd_led_wk != asus->kbd_led_level || slot->queued ||
+	    (slot->applied_valid &&
+	     (slot->applied & 0x7F) != asus->kbd_led_level)) {
+		value = asus->kbd_led_wk;
+		goto out;
+	}
 
+	if (valid && value != asus->kbd_led_wk)
+		pr_warn_ratelimited("Cached state %d is %d, BIOS reports %d\n",
+				    ASUS_SHADOW_KBD_LED, asus->kbd_led_wk,
+				    value);
+
+	asus_state_publish(asus, asus->kbd_led_wk, value);
+	asus->kbd_led_level = value;
+	if (slot->applied_valid)
+		slot->applied = 0x80 | value;
+	set_bit(ASUS_SHADOW_KBD_LED, &asus->shadow_valid);
+out:
+	spin_unlock_irqrestore(&asus->led_lock, flags);
 	return value;
 }
 
-static int wlan_led_unknown_state(struct asus_wmi *asus)
+static enum led_brightness kbd_led_get(struct led_classdev *led_cdev)
 {
-	u32 result;
+	struct asus_wmi *asus;
 
-	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_WIRELESS_LED, &result);
+	asus = container_of(led_cdev, struct asus_wmi, kbd_led);
 
-	return result & ASUS_WMI_DSTS_UNKNOWN_BIT;
+	return kbd_led_get_level(asus);
 }
 
-static void wlan_led_update(struct work_struct *work)
+static ssize_t kbd_led_transition_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
 {
-	int ctrl_param;
-	struct asus_wmi *asus;
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
 
-	asus = container_of(work, struct asus_wmi, wlan_led_work);
-
-	ctrl_param = asus->wlan_led_wk;
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_WIRELESS_LED, ctrl_param, NULL);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", asus->kbd_led_transition);
 }
 
-static void wlan_led_set(struct led_classdev *led_cdev,
-			 enum led_brightness value)
+static ssize_t kbd_led_transition_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
 {
-	struct asus_wmi *asus;
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+	unsigned int value;
+	int err;
 
-	asus = container_of(led_cdev, struct asus_wmi, wlan_led);
+	err = kstrtouint(buf, 10, &value);
+	if (err < 0)
+		return err;
+
+	if (value > ASUS_FADE_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(asus->kbd_led_transition, value);
 
-	asus->wlan_led_wk = !!value;
-	queue_work(asus->led_workqueue, &asus->wlan_led_work);
+	return count;
 }
 
-static enum led_brightness wlan_led_get(struct led_classdev *led_cdev)
+/* Time in ms for a fade over the whole range, 0 - no fade */
+static DEVICE_ATTR(transition, 0644, kbd_led_transition_show,
+		   kbd_led_transition_store);
+
+static bool kbbl_rgb_set_dark(struct asus_wmi *asus, unsigned int reason,
+			      bool dark);
+
+static void asus_kbd_idle_work(struct work_struct *work)
 {
-	struct asus_wmi *asus;
-	u32 result;
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, kbd_idle.work);
+	struct asus_kbd_idle *idle = &asus->kbd_idle;
+	unsigned long deadline;
 
-	asus = container_of(led_cdev, struct asus_wmi, wlan_led);
-	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_WIRELESS_LED, &result);
+	mutex_lock(&idle->lock);
+	if (!idle->timeout || idle->idle)
+		goto out;
 
-	return result & ASUS_WMI_DSTS_BRIGHTNESS_MASK;
+	deadline = READ_ONCE(idle->last) + idle->timeout * HZ;
+	if (time_before(jiffies, deadline)) {
+		queue_delayed_work(system_wq, &idle->work, deadline - jiffies);
+		goto out;
+	}
+
+	idle->idle = true;
+	idle->saved_level = asus->kbd_led_wk;
+	if (idle->saved_level)
+		do_kbd_led_set(&asus->kbd_led, 0);
+	if (idle->rgb_off)
+		kbbl_rgb_set_dark(asus, KBBL_DARK_IDLE, true);
+out:
+	mutex_unlock(&idle->lock);
 }
 
-static void lightbar_led_update(struct work_struct *work)
+static void asus_kbd_idle_wake(struct work_struct *work)
 {
-	struct asus_wmi *asus;
-	int ctrl_param;
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     kbd_idle.wake);
+	struct asus_kbd_idle *idle = &asus->kbd_idle;
 
-	asus = container_of(work, struct asus_wmi, lightbar_led_work);
+	mutex_lock(&idle->lock);
+	if (!idle->idle)
+		goto out;
 
-	ctrl_param = asus->lightbar_led_wk;
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_LIGHTBAR, ctrl_param, NULL);
+	idle->idle = false;
+	/* A level set while idle wins over the saved one */
+	if (!asus->kbd_led_wk && idle->saved_level)
+		do_kbd_led_set(&asus->kbd_led, idle->saved_level);
+	kbbl_rgb_set_dark(asus, KBBL_DARK_IDLE, false);
+
+	if (idle->timeout)
+		queue_delayed_work(system_wq, &idle->work, idle->timeout * HZ);
+out:
+	mutex_unlock(&idle->lock);
 }
 
-static void lightbar_led_set(struct led_classdev *led_cdev,
-			     enum led_brightness value)
+static void asus_kbd_idle_event(struct input_handle *handle, unsigned int type,
+				unsigned int code, int value)
 {
-	struct asus_wmi *asus;
+	struct asus_wmi *asus = container_of(handle->handler, struct asus_wmi,
+					     kbd_idle.handler);
 
-	asus = container_of(led_cdev, struct asus_wmi, lightbar_led);
+	if (type != EV_KEY)
+		return;
 
-	asus->lightbar_led_wk = !!value;
-	queue_work(asus->led_workqueue, &asus->lightbar_led_work);
+	WRITE_ONCE(asus->kbd_idle.last, jiffies);
+	if (READ_ONCE(asus->kbd_idle.idle))
+		schedule_work(&asus->kbd_idle.wake);
 }
 
-static enum led_brightness lightbar_led_get(struct led_classdev *led_cdev)
+static int asus_kbd_idle_connect(struct input_handler *handler,
+				 struct input_dev *dev,
+				 const struct input_device_id *id)
 {
-	struct asus_wmi *asus;
-	u32 result;
+	struct asus_wmi *asus = container_of(handler, struct asus_wmi,
+					     kbd_idle.handler);
+	struct input_handle *handle;
+	int err;
 
-	asus = container_of(led_cdev, struct asus_wmi, lightbar_led);
-	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_LIGHTBAR, &result);
+	/* Our own hotkeys do not count as typing */
+	if (dev == asus->inputdev)
+		return -ENODEV;
 
-	return result & ASUS_WMI_DSTS_LIGHTBAR_MASK;
-}
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
 
-static void asus_wmi_led_exit(struct asus_wmi *asus)
-{
-	led_classdev_unregister(&asus->kbd_led);
-	led_classdev_unregister(&asus->tpd_led);
-	led_classdev_unregister(&asus->wlan_led);
-	led_classdev_unregister(&asus->lightbar_led);
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "faustus_kbd_idle";
 
-	if (asus->led_workqueue)
-		destroy_workqueue(asus->led_workqueue);
+	err = input_register_handle(handle);
+	if (err)
+		goto error;
+
+	err = input_open_device(handle);
+	if (err)
+		goto error_unregister;
+
+	return 0;
+
+error_unregister:
+	input_unregister_handle(handle);
+error:
+	kfree(handle);
+	return err;
 }
 
-static int asus_wmi_led_init(struct asus_wmi *asus)
+static void asus_kbd_idle_disconnect(struct input_handle *handle)
 {
-	int rv = 0, led_val;
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
 
-	asus->led_workqueue = create_singlethread_workqueue("led_workqueue");
-	if (!asus->led_workqueue)
-		return -ENOMEM;
+/* Keyboards only, not mice, power buttons or the hotkey device */
+static const struct input_device_id asus_kbd_idle_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(KEY_A)] = BIT_MASK(KEY_A) },
+	},
+	{ },
+};
 
-	if (read_tpd_led_state(asus) >= 0) {
-		INIT_WORK(&asus->tpd_led_work, tpd_led_update);
+/*
+ * The input handler is only registered while a timeout is set, so input
+ * devices are not held open for nothing. Called with the idle lock held.
+ */
+static int asus_kbd_idle_enable(struct asus_wmi *asus, bool enable)
+{
+	struct asus_kbd_idle *idle = &asus->kbd_idle;
+	int err;
 
-		asus->tpd_led.name = "asus::touchpad";
-		asus->tpd_led.brightness_set = tpd_led_set;
-		asus->tpd_led.brightness_get = tpd_led_get;
-		asus->tpd_led.max_brightness = 1;
+	lockdep_assert_held(&idle->lock);
 
-		rv = led_classdev_register(&asus->platform_device->dev,
-					   &asus->tpd_led);
-		if (rv)
-			goto error;
+	if (enable && !idle->registered) {
+		idle->handler.event = asus_kbd_idle_event;
+		idle->handler.connect = asus_kbd_idle_connect;
+		idle->handler.disconnect = asus_kbd_idle_disconnect;
+		idle->handler.name = "faustus_kbd_idle";
+		idle->handler.id_table = asus_kbd_idle_ids;
+
+		err = input_register_handler(&idle->handler);
+		if (err)
+			return err;
+		idle->registered = true;
+	} else if (!enable && idle->registered) {
+		input_unregister_handler(&idle->handler);
+		idle->registered = false;
 	}
 
-	if (!kbd_led_read(asus, &led_val, NULL)) {
-		asus->kbd_led_wk = led_val;
-		asus->kbd_led.name = "asus::kbd_backlight";
-		asus->kbd_led.flags = LED_BRIGHT_HW_CHANGED;
-		asus->kbd_led.brightness_set = kbd_led_set;
-		asus->kbd_led.brightness_get = kbd_led_get;
-		asus->kbd_led.max_brightness = 3;
+	return 0;
+}
 
-		rv = led_classdev_register(&asus->platform_device->dev,
-					   &asus->kbd_led);
-		if (rv)
-			goto error;
-	}
+static ssize_t kbd_led_idle_timeout_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
 
-	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_WIRELESS_LED)
-			&& (asus->driver->quirks->wapf > 0)) {
-		INIT_WORK(&asus->wlan_led_work, wlan_led_update);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", asus->kbd_idle.timeout);
+}
 
-		asus->wlan_led.name = "asus::wlan";
-		asus->wlan_led.brightness_set = wlan_led_set;
-		if (!wlan_led_unknown_state(asus))
-			asus->wlan_led.brightness_get = wlan_led_get;
-		asus->wlan_led.flags = LED_CORE_SUSPENDRESUME;
-		asus->wlan_led.max_brightness = 1;
-		asus->wlan_led.default_trigger = "asus-wlan";
+static ssize_t kbd_led_idle_timeout_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+	struct asus_kbd_idle *idle = &asus->kbd_idle;
+	unsigned int value;
+	int err;
 
-		rv = led_classdev_register(&asus->platform_device->dev,
+	err = kstrtouint(buf, 10, &value);
+	if (err < 0)
+		return err;
+
+	if (value > ASUS_KBD_IDLE_TIMEOUT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&idle->lock);
+	err = asus_kbd_idle_enable(asus, value);
+	if (!err) {
+		idle->timeout = value;
+		idle->last = jiffies;
+		if (value)
+			mod_delayed_work(system_wq, &idle->work, value * HZ);
+		else if (idle->idle)
+			schedule_work(&idle->wake);
+	}
+	mutex_unlock(&idle->lock);
+
+	return err ? err : count;
+}
+
+static ssize_t kbd_led_idle_rgb_off_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", asus->kbd_idle.rgb_off);
+}
+
+static ssize_t kbd_led_idle_rgb_off_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+	bool value;
+	int err;
+
+	err = kstrtobool(buf, &value);
+	if (err < 0)
+		return err;
+
+	mutex_lock(&asus->kbd_idle.lock);
+	asus->kbd_idle.rgb_off = value;
+	mutex_unlock(&asus->kbd_idle.lock);
+
+	return count;
+}
+
+/* Seconds without key events before the backlight is turned off, 0 - never */
+static DEVICE_ATTR(idle_timeout, 0644, kbd_led_idle_timeout_show,
+		   kbd_led_idle_timeout_store);
+
+/* Also blank the RGB keyboard while idle */
+static DEVICE_ATTR(idle_rgb_off, 0644, kbd_led_idle_rgb_off_show,
+		   kbd_led_idle_rgb_off_store);
+
+static void asus_kbd_idle_init(struct asus_wmi *asus)
+{
+	mutex_init(&asus->kbd_idle.lock);
+	INIT_DELAYED_WORK(&asus->kbd_idle.work, asus_kbd_idle_work);
+	INIT_WORK(&asus->kbd_idle.wake, asus_kbd_idle_wake);
+}
+
+static void asus_kbd_idle_exit(struct asus_wmi *asus)
+{
+	struct asus_kbd_idle *idle = &asus->kbd_idle;
+
+	mutex_lock(&idle->lock);
+	idle->timeout = 0;
+	asus_kbd_idle_enable(asus, false);
+	mutex_unlock(&idle->lock);
+
+	cancel_delayed_work_sync(&idle->work);
+	cancel_work_sync(&idle->wake);
+}
+
+/*
+ * Set a level picked by a driver policy. While the keyboard is idle the level
+ * is kept for the next key press. Returns true if the level changed.
+ */
+static bool asus_kbd_led_set_policy(struct asus_wmi *asus, int level)
+{
+	struct asus_kbd_idle *idle = &asus->kbd_idle;
+	bool changed = false;
+
+	mutex_lock(&idle->lock);
+	if (idle->idle) {
+		idle->saved_level = level;
+	} else if (level != asus->kbd_led_wk) {
+		do_kbd_led_set(&asus->kbd_led, level);
+		changed = true;
+	}
+	mutex_unlock(&idle->lock);
+
+	return changed;
+}
+
+static void asus_kbd_als_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     kbd_als.work);
+	struct asus_kbd_als *als = &asus->kbd_als;
+	int env;
+
+	if (kbd_led_read(asus, NULL, &env))
+		return;
+	env = min(env, 2);
+
+	mutex_lock(&als->lock);
+	if (!als->enabled || env == als->env)
+		goto out;
+
+	als->env = env;
+	asus_kbd_led_set_policy(asus, als->levels[env]);
+out:
+	mutex_unlock(&als->lock);
+}
+
+/* Called with the ALS lock held */
+static void asus_kbd_als_enable(struct asus_wmi *asus, bool enable)
+{
+	struct asus_kbd_als *als = &asus->kbd_als;
+	int err;
+
+	lockdep_assert_held(&als->lock);
+
+	if (enable == als->enabled)
+		return;
+
+	if (enable) {
+		/* Notifications only come while the sensor is on */
+		if (!asus_shadow_get_devstate(asus, ASUS_SHADOW_ALS_ENABLE,
+					      ASUS_WMI_DEVID_ALS_ENABLE)) {
+			err = __asus_wmi_set_devstate(ASUS_WMI_DEVID_ALS_ENABLE,
+						      1, NULL);
+			if (!err)
+				asus_shadow_set(asus, ASUS_SHADOW_ALS_ENABLE,
+					&asus->dev_wk[ASUS_SHADOW_ALS_ENABLE],
+					1);
+			else
+				clear_bit(ASUS_SHADOW_ALS_ENABLE,
+					  &asus->shadow_valid);
+			als->sensor_forced = !err || err == -EINPROGRESS;
+		}
+		als->env = -1;
+		schedule_work(&als->work);
+	} else if (als->sensor_forced) {
+		asus_wmi_set_devstate(ASUS_WMI_DEVID_ALS_ENABLE, 0, NULL);
+		clear_bit(ASUS_SHADOW_ALS_ENABLE, &asus->shadow_valid);
+		als->sensor_forced = false;
+	}
+
+	WRITE_ONCE(als->enabled, enable);
+}
+
+static ssize_t kbd_led_als_auto_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", asus->kbd_als.enabled);
+}
+
+static ssize_t kbd_led_als_auto_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+	bool value;
+	int err;
+
+	err = kstrtobool(buf, &value);
+	if (err < 0)
+		return err;
+
+	mutex_lock(&asus->kbd_als.lock);
+	asus_kbd_als_enable(asus, value);
+	mutex_unlock(&asus->kbd_als.lock);
+
+	return count;
+}
+
+static ssize_t kbd_led_als_levels_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+	u8 *levels = asus->kbd_als.levels;
+
+	return scnprintf(buf, PAGE_SIZE, "%u %u %u\n",
+			 levels[0], levels[1], levels[2]);
+}
+
+static ssize_t kbd_led_als_levels_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(led_cdev, struct asus_wmi, kbd_led);
+	struct asus_kbd_als *als = &asus->kbd_als;
+	unsigned int levels[3];
+	int i;
+
+	if (sscanf(buf, "%u %u %u", &levels[0], &levels[1], &levels[2]) != 3)
+		return -EINVAL;
+
+	for (i = 0; i < 3; i++)
+		if (levels[i] > led_cdev->max_brightness)
+			return -EINVAL;
+
+	mutex_lock(&als->lock);
+	for (i = 0; i < 3; i++)
+		als->levels[i] = levels[i];
+	/* Apply the new table to the current environment */
+	als->env = -1;
+	if (als->enabled)
+		schedule_work(&als->work);
+	mutex_unlock(&als->lock);
+
+	return count;
+}
+
+/* Follow the ambient light sensor */
+static DEVICE_ATTR(als_auto, 0644, kbd_led_als_auto_show,
+		   kbd_led_als_auto_store);
+
+/* Levels for a dark, normal and light environment */
+static DEVICE_ATTR(als_levels, 0644, kbd_led_als_levels_show,
+		   kbd_led_als_levels_store);
+
+static void asus_kbd_als_init(struct asus_wmi *asus)
+{
+	struct asus_kbd_als *als = &asus->kbd_als;
+
+	mutex_init(&als->lock);
+	INIT_WORK(&als->work, asus_kbd_als_work);
+	als->env = -1;
+	als->levels[0] = 3;
+	als->levels[1] = 1;
+	als->levels[2] = 0;
+}
+
+static void asus_kbd_als_exit(struct asus_wmi *asus)
+{
+	mutex_lock(&asus->kbd_als.lock);
+	asus_kbd_als_enable(asus, false);
+	mutex_unlock(&asus->kbd_als.lock);
+
+	cancel_work_sync(&asus->kbd_als.work);
+}
+
+static struct attribute *kbd_led_attrs[] = {
+	&dev_attr_transition.attr,
+	&dev_attr_idle_timeout.attr,
+	&dev_attr_idle_rgb_off.attr,
+	&dev_attr_als_auto.attr,
+	&dev_attr_als_levels.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(kbd_led);
+
+static int wlan_led_unknown_state(struct asus_wmi *asus)
+{
+	u32 result;
+
+	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_WIRELESS_LED, &result);
+
+	return result & ASUS_WMI_DSTS_UNKNOWN_BIT;
+}
+
+static void wlan_led_set(struct led_classdev *led_cdev,
+			 enum led_brightness value)
+{
+	struct asus_wmi *asus;
+
+	asus = container_of(led_cdev, struct asus_wmi, wlan_led);
+
+	asus_shadow_set(asus, ASUS_SHADOW_WLAN_LED, &asus->wlan_led_wk,
+			!!value);
+	asus_led_queue(asus, ASUS_LED_WLAN, asus->wlan_led_wk);
+}
+
+static int wlan_led_read(struct asus_wmi *asus)
+{
+	u32 result;
+	int err;
+
+	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_WIRELESS_LED, &result);
+	if (err < 0)
+		return err;
+
+	return result & ASUS_WMI_DSTS_BRIGHTNESS_MASK;
+}
+
+static enum led_brightness wlan_led_get(struct led_classdev *led_cdev)
+{
+	struct asus_wmi *asus;
+
+	asus = container_of(led_cdev, struct asus_wmi, wlan_led);
+
+	return asus_shadow_get(asus, ASUS_SHADOW_WLAN_LED, &asus->wlan_led_wk,
+			       wlan_led_read);
+}
+
+static void lightbar_led_set(struct led_classdev *led_cdev,
+			     enum led_brightness value)
+{
+	struct asus_wmi *asus;
+
+	asus = container_of(led_cdev, struct asus_wmi, lightbar_led);
+
+	asus_shadow_set(asus, ASUS_SHADOW_LIGHTBAR_LED, &asus->lightbar_led_wk,
+			!!value);
+	asus_led_queue(asus, ASUS_LED_LIGHTBAR, asus->lightbar_led_wk);
+}
+
+static int lightbar_led_read(struct asus_wmi *asus)
+{
+	u32 result;
+	int err;
+
+	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_LIGHTBAR, &result);
+	if (err < 0)
+		return err;
+
+	return result & ASUS_WMI_DSTS_LIGHTBAR_MASK;
+}
+
+static enum led_brightness lightbar_led_get(struct led_classdev *led_cdev)
+{
+	struct asus_wmi *asus;
+
+	asus = container_of(led_cdev, struct asus_wmi, lightbar_led);
+
+	return asus_shadow_get(asus, ASUS_SHADOW_LIGHTBAR_LED,
+			       &asus->lightbar_led_wk, lightbar_led_read);
+}
+
+static void asus_wmi_led_exit(struct asus_wmi *asus)
+{
+	if (asus->led_workqueue) {
+		asus_kbd_als_exit(asus);
+		asus_kbd_idle_exit(asus);
+	}
+	led_classdev_unregister(&asus->kbd_led);
+	led_classdev_unregister(&asus->tpd_led);
+	led_classdev_unregister(&asus->wlan_led);
+	led_classdev_unregister(&asus->lightbar_led);
+
+	if (asus->led_workqueue) {
+		cancel_delayed_work_sync(&asus->kbd_led_fade);
+		destroy_workqueue(asus->led_workqueue);
+	}
+}
+
+static int asus_wmi_led_init(struct asus_wmi *asus)
+{
+	int rv = 0, led_val;
+
+	asus->led_workqueue = create_singlethread_workqueue("led_workqueue");
+	if (!asus->led_workqueue)
+		return -ENOMEM;
+
+	spin_lock_init(&asus->led_lock);
+	INIT_WORK(&asus->led_work, asus_led_work);
+	INIT_DELAYED_WORK(&asus->kbd_led_fade, kbd_led_fade_work);
+	asus_kbd_idle_init(asus);
+	asus_kbd_als_init(asus);
+
+	if (read_tpd_led_state(asus) >= 0) {
+		asus->tpd_led.name = "asus::touchpad";
+		asus->tpd_led.brightness_set = tpd_led_set;
+		asus->tpd_led.brightness_get = tpd_led_get;
+		asus->tpd_led.max_brightness = 1;
+
+		rv = led_classdev_register(&asus->platform_device->dev,
+					   &asus->tpd_led);
+		if (rv)
+			goto error;
+	}
+
+	if (!kbd_led_read(asus, &led_val, NULL)) {
+		asus->kbd_led_wk = led_val;
+		asus->kbd_led_level = led_val;
+		asus->kbd_led.name = "asus::kbd_backlight";
+		asus->kbd_led.flags = LED_BRIGHT_HW_CHANGED;
+		asus->kbd_led.brightness_set = kbd_led_set;
+		asus->kbd_led.brightness_get = kbd_led_get;
+		asus->kbd_led.max_brightness = 3;
+		asus->kbd_led.groups = kbd_led_groups;
+
+		rv = led_classdev_register(&asus->platform_device->dev,
+					   &asus->kbd_led);
+		if (rv)
+			goto error;
+	}
+
+	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_WIRELESS_LED)
+			&& (asus->driver->quirks->wapf > 0)) {
+		asus->wlan_led.name = "asus::wlan";
+		asus->wlan_led.brightness_set = wlan_led_set;
+		if (!wlan_led_unknown_state(asus))
+			asus->wlan_led.brightness_get = wlan_led_get;
+		asus->wlan_led.flags = LED_CORE_SUSPENDRESUME;
+		asus->wlan_led.max_brightness = 1;
+		asus->wlan_led.default_trigger = "asus-wlan";
+
+		rv = led_classdev_register(&asus->platform_device->dev,
 					   &asus->wlan_led);
 		if (rv)
 			goto error;
 	}
 
 	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_LIGHTBAR)) {
-		INIT_WORK(&asus->lightbar_led_work, lightbar_led_update);
-
 		asus->lightbar_led.name = "asus::lightbar";
 		asus->lightbar_led.brightness_set = lightbar_led_set;
 		asus->lightbar_led.brightness_get = lightbar_led_get;
@@ -898,12 +2647,33 @@ static ssize_t store_u8(u8 *value, const char *buf, int count)
 	return count;
 }
 
+/* Pending fields are only locked away from others by an exclusive lease */
+static ssize_t kbbl_store_u8(struct asus_wmi *asus, u8 *value,
+			     const char *buf, int count)
+{
+	struct asus_kbbl_lease *lease = &asus->kbbl_lease;
+	ssize_t ret;
+
+	mutex_lock(&lease->lock);
+	if (lease->owner && lease->type == FAUSTUS_KBBL_LEASE_EXCLUSIVE) {
+		lease->rejects++;
+		ret = -EBUSY;
+	} else {
+		ret = store_u8(value, buf, count);
+	}
+	mutex_unlock(&lease->lock);
+
+	return ret;
+}
+
 static ssize_t kbbl_red_show(struct device *dev, struct device_attribute *attr,
 		char *buf)
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_state state;
 
-	return show_u8(asus->kbbl_rgb.kbbl_red, buf);
+	asus_state_read(asus, &state);
+	return show_u8(state.red, buf);
 }
 
 static ssize_t kbbl_red_store(struct device *dev, struct device_attribute *attr,
@@ -911,15 +2681,17 @@ static ssize_t kbbl_red_store(struct device *dev, struct device_attribute *attr,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_red, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_red, buf, count);
 }
 
 static ssize_t kbbl_green_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_state state;
 
-	return show_u8(asus->kbbl_rgb.kbbl_green, buf);
+	asus_state_read(asus, &state);
+	return show_u8(state.green, buf);
 }
 
 static ssize_t kbbl_green_store(struct device *dev,
@@ -927,15 +2699,17 @@ static ssize_t kbbl_green_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_green, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_green, buf, count);
 }
 
 static ssize_t kbbl_blue_show(struct device *dev, struct device_attribute *attr,
 		char *buf)
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_state state;
 
-	return show_u8(asus->kbbl_rgb.kbbl_blue, buf);
+	asus_state_read(asus, &state);
+	return show_u8(state.blue, buf);
 }
 
 static ssize_t kbbl_blue_store(struct device *dev,
@@ -943,15 +2717,17 @@ static ssize_t kbbl_blue_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_blue, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_blue, buf, count);
 }
 
 static ssize_t kbbl_mode_show(struct device *dev, struct device_attribute *attr,
 		char *buf)
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_state state;
 
-	return show_u8(asus->kbbl_rgb.kbbl_mode, buf);
+	asus_state_read(asus, &state);
+	return show_u8(state.mode, buf);
 }
 
 static ssize_t kbbl_mode_store(struct device *dev,
@@ -959,7 +2735,7 @@ static ssize_t kbbl_mode_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_mode, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_mode, buf, count);
 }
 
 static ssize_t kbbl_auramode_show(struct device *dev, struct device_attribute *attr,
@@ -975,7 +2751,7 @@ static ssize_t kbbl_auramode_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_auramode, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_auramode, buf, count);
 }
 
 static ssize_t kbbl_auraspeed_show(struct device *dev, struct device_attribute *attr,
@@ -991,15 +2767,17 @@ static ssize_t kbbl_auraspeed_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_auraspeed, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_auraspeed, buf, count);
 }
 
 static ssize_t kbbl_speed_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_state state;
 
-	return show_u8(asus->kbbl_rgb.kbbl_speed, buf);
+	asus_state_read(asus, &state);
+	return show_u8(state.speed, buf);
 }
 
 static ssize_t kbbl_speed_store(struct device *dev,
@@ -1007,7 +2785,7 @@ static ssize_t kbbl_speed_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_speed, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_speed, buf, count);
 }
 
 static ssize_t kbbl_flags_show(struct device *dev,
@@ -1023,7 +2801,7 @@ static ssize_t kbbl_flags_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_flags, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_flags, buf, count);
 }
 
 static ssize_t kbbl_set_show(struct device *dev,
@@ -1033,16 +2811,20 @@ static ssize_t kbbl_set_show(struct device *dev,
 			"Write to configure RGB keyboard backlight\n");
 }
 
-static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
+static int kbbl_rgb_apply(struct asus_wmi *asus, u8 red, u8 green, u8 blue,
+			  u8 mode, u8 speed, u8 flags, int persistent)
 {
+	unsigned long irqflags;
 	int err;
 	u32 retval;
 	u8 speed_byte;
 	u8 mode_byte;
-	u8 speed;
-	u8 mode;
 
-	speed = asus->kbbl_rgb.kbbl_set_speed;
+	lockdep_assert_held(&asus->kbbl_lease.lock);
+
+	if (!flags)
+		flags = kbbl_rgb_flags(&asus->kbbl_rgb);
+
 	switch (speed) {
 	case 0:
 	default:
@@ -1057,7 +2839,6 @@ static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
 		break;
 	}
 
-	mode = asus->kbbl_rgb.kbbl_set_mode;
 	switch (mode) {
 	case 0:
 	default:
@@ -1079,9 +2860,9 @@ static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
 		ASUS_WMI_DEVID_KBD_RGB,
 		(persistent ? 0xb4 : 0xb3) |
 		(mode_byte << 8) |
-		(asus->kbbl_rgb.kbbl_set_red << 16) |
-		(asus->kbbl_rgb.kbbl_set_green << 24),
-		(asus->kbbl_rgb.kbbl_set_blue) |
+		(red << 16) |
+		(green << 24),
+		(blue) |
 		(speed_byte << 8), &retval);
 	if (err) {
 		pr_warn("RGB keyboard device 1, write error: %d\n", err);
@@ -1097,7 +2878,7 @@ static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
 	err = asus_wmi_evaluate_method3(ASUS_WMI_METHODID_DEVS,
 		ASUS_WMI_DEVID_KBD_RGB2,
 		(0xbd) |
-		(asus->kbbl_rgb.kbbl_set_flags << 16) |
+		(flags << 16) |
 		(persistent ? 0x0100 : 0x0000), 0, &retval);
 	if (err) {
 		pr_warn("RGB keyboard device 2, write error: %d\n", err);
@@ -1110,1251 +2891,4944 @@ static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
 		return -EIO;
 	}
 
-	asus->kbbl_rgb.kbbl_red = asus->kbbl_rgb.kbbl_set_red;
-	asus->kbbl_rgb.kbbl_green = asus->kbbl_rgb.kbbl_set_green;
-	asus->kbbl_rgb.kbbl_blue = asus->kbbl_rgb.kbbl_set_blue;
+	write_seqlock_irqsave(&asus->state_seq, irqflags);
+	asus->kbbl_rgb.kbbl_red = red;
+	asus->kbbl_rgb.kbbl_green = green;
+	asus->kbbl_rgb.kbbl_blue = blue;
 	asus->kbbl_rgb.kbbl_mode = mode;
 	asus->kbbl_rgb.kbbl_speed = speed;
-	asus->kbbl_rgb.kbbl_auraspeed = asus->kbbl_rgb.kbbl_set_auraspeed;
-	//asus->kbbl_rgb.kbbl_auramode = asus->kbbl_rgb.kbbl_set_auramode;
-	asus->kbbl_rgb.kbbl_auramode = (asus->kbbl_rgb.kbbl_set_auramode <= 3)?
-		asus->kbbl_rgb.kbbl_set_auramode : 0;
+	asus->kbbl_rgb.kbbl_flags = flags;
+	write_sequnlock_irqrestore(&asus->state_seq, irqflags);
 
 	return 0;
 }
 
-static ssize_t kbbl_set_store(struct device *dev,
-		struct device_attribute *attr, const char *buf, size_t count)
+static u8 kbbl_lerp(u8 from, u8 to, int pos, int span)
 {
-	u8 value;
-	struct asus_wmi *asus;
-	int result;
+	return from + ((int)to - from) * pos / span;
+}
 
-	asus = dev_get_drvdata(dev);
-	result = store_u8(&value, buf, count);
-	if (result < 0)
-		return result;
+static void kbbl_fade_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, kbbl_fade.work);
+	struct asus_kbbl_fade *fade = &asus->kbbl_fade;
+	unsigned long span, elapsed;
+	u8 color[3];
+	bool done;
+	int i, err;
 
-	if (value == 1)
-		kbbl_rgb_write(asus, 1);
-	else if (value == 2)
-		kbbl_rgb_write(asus, 0);
+	mutex_lock(&asus->kbbl_lease.lock);
+	if (!fade->active)
+		goto out;
 
-	return count;
+	span = msecs_to_jiffies(fade->transition);
+	elapsed = jiffies - fade->start;
+	done = elapsed >= span;
+
+	for (i = 0; i < 3; i++)
+		color[i] = done ? fade->to[i] :
+			   kbbl_lerp(fade->from[i], fade->to[i], elapsed, span);
+
+	err = kbbl_rgb_apply(asus, color[0], color[1], color[2], 0,
+			     asus->kbbl_rgb.kbbl_speed, fade->flags,
+			     done ? fade->persistent : 0);
+
+	/* A failed step ends the fade where it is */
+	fade->active = !done && !err;
+	if (fade->active)
+		queue_delayed_work(system_wq, &fade->work,
+				   msecs_to_jiffies(ASUS_FADE_STEP));
+out:
+	mutex_unlock(&asus->kbbl_lease.lock);
 }
 
-/* RGB values: 00 .. ff */
-static DEVICE_ATTR_RW(kbbl_red);
-static DEVICE_ATTR_RW(kbbl_green);
-static DEVICE_ATTR_RW(kbbl_blue);
-
 /*
- * Color modes: 0 - static color, 1 - breathing, 2 - color cycle, 3 - strobing
+ * Start a fade to a static color, from the color shown right now so that a
+ * new target mid-fade carries on smoothly. Other modes animate by themselves
+ * and are switched at once.
  */
-static DEVICE_ATTR_RW(kbbl_mode);
+static bool kbbl_fade_start(struct asus_wmi *asus,
+			    const struct faustus_kbbl_state *to)
+{
+	struct asus_kbbl_fade *fade = &asus->kbbl_fade;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
 
-/* Speed for modes 1 and 2: 0 - slow, 1 - medium, 2 - fast */
-static DEVICE_ATTR_RW(kbbl_speed);
+	fade->active = false;
+	if (!fade->transition || rgb->kbbl_mode || to->mode)
+		return false;
 
-/*
- * Enable: 02 - on boot (until module load) | 08 - awake | 20 - sleep
- * (2a or ff to enable everything)
- *
- * Logically 80 would be shutdown, but no visible effects of this option
- * were observed so far
- */
-static DEVICE_ATTR_RW(kbbl_flags);
+	fade->from[0] = rgb->kbbl_red;
+	fade->from[1] = rgb->kbbl_green;
+	fade->from[2] = rgb->kbbl_blue;
+	fade->to[0] = to->red;
+	fade->to[1] = to->green;
+	fade->to[2] = to->blue;
+	fade->persistent = to->persistent;
+	fade->flags = to->flags ? : kbbl_rgb_flags(rgb);
+	fade->start = jiffies;
+	fade->active = true;
+	mod_delayed_work(system_wq, &fade->work, 0);
 
-/* Write data: 1 - permanently, 2 - temporarily (reset after reboot) */
-static DEVICE_ATTR_RW(kbbl_set);
+	return true;
+}
 
-/* Speed for aura hotkeys color change */
-static DEVICE_ATTR_RW(kbbl_auraspeed);
+/* Show a new state, fading when enabled. Called with the lease lock held. */
+static int kbbl_rgb_set_state(struct asus_wmi *asus,
+			      const struct faustus_kbbl_state *state)
+{
+	int err;
 
-/* Set mode switching for aura hotkeys: 0 - color cycle, 1 - color mode selection, 
- * 2 - speed for modes, 3 - white balance */
-static DEVICE_ATTR_RW(kbbl_auramode);
+	lockdep_assert_held(&asus->kbbl_lease.lock);
 
-static struct attribute *rgbkb_sysfs_attributes[] = {
-	&dev_attr_kbbl_red.attr,
-	&dev_attr_kbbl_green.attr,
-	&dev_attr_kbbl_blue.attr,
-	&dev_attr_kbbl_mode.attr,
-	&dev_attr_kbbl_speed.attr,
-	&dev_attr_kbbl_flags.attr,
-	&dev_attr_kbbl_set.attr,
-	&dev_attr_kbbl_auraspeed.attr,
-	&dev_attr_kbbl_auramode.attr,
-	NULL,
-};
+	asus->kbbl_dark = 0;
 
-static const struct attribute_group kbbl_attribute_group = {
-	.name = "kbbl",
-	.attrs = rgbkb_sysfs_attributes
-};
+	if (!kbbl_fade_start(asus, state)) {
+		err = kbbl_rgb_apply(asus, state->red, state->green,
+				     state->blue, state->mode, state->speed,
+				     state->flags, state->persistent);
+		if (err)
+			return err;
+	}
+	asus->kbbl_map.shown = false;
 
-static int kbbl_rgb_init(struct asus_wmi *asus)
+	return 0;
+}
+
+/*
+ * Called with kbbl_lease.lock held, for a client other than the lease
+ * holder. Under a priority lease a copy of the state is queued for the
+ * release and -EINPROGRESS returned; the last commit wins, except that a
+ * persistent one is still stored before a later temporary one is shown.
+ */
+static int kbbl_rgb_submit(struct asus_wmi *asus,
+			   const struct faustus_kbbl_state *state)
 {
-	int err;
+	struct asus_kbbl_lease *lease = &asus->kbbl_lease;
 
-	err = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_KBD_RGB);
-	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		else
-			return err;
+	lockdep_assert_held(&lease->lock);
+
+	if (!lease->owner)
+		return kbbl_rgb_set_state(asus, state);
+
+	if (lease->type == FAUSTUS_KBBL_LEASE_EXCLUSIVE) {
+		lease->rejects++;
+		return -EBUSY;
 	}
 
-	err = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_KBD_RGB2);
-	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		else
-			return err;
+	lease->deferred++;
+	if (state->persistent) {
+		lease->queued_saved = false;
+	} else if (lease->queued && lease->queued_state.persistent) {
+		lease->saved_state = lease->queued_state;
+		lease->queued_saved = true;
 	}
+	lease->queued_state = *state;
+	lease->queued = true;
 
-	asus->kbbl_rgb_available = true;
-	return sysfs_create_group(&asus->platform_device->dev.kobj,
-			&kbbl_attribute_group);
+	return -EINPROGRESS;
 }
 
-static void kbbl_rgb_exit(struct asus_wmi *asus)
+/* Commit the pending kbbl_set_* fields on behalf of a sysfs writer */
+static int kbbl_rgb_commit(struct asus_wmi *asus, int persistent)
 {
-	if (asus->kbbl_rgb_available) {
-		sysfs_remove_group(&asus->platform_device->dev.kobj,
-				&kbbl_attribute_group);
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	struct faustus_kbbl_state state;
+	int err;
+
+	mutex_lock(&asus->kbbl_lease.lock);
+	state = (struct faustus_kbbl_state) {
+		.red = rgb->kbbl_set_red,
+		.green = rgb->kbbl_set_green,
+		.blue = rgb->kbbl_set_blue,
+		.mode = rgb->kbbl_set_mode,
+		.speed = rgb->kbbl_set_speed,
+		.flags = rgb->kbbl_set_flags,
+		.persistent = persistent,
+	};
+	err = kbbl_rgb_submit(asus, &state);
+	if (!err || err == -EINPROGRESS) {
+		rgb->kbbl_auraspeed = rgb->kbbl_set_auraspeed;
+		rgb->kbbl_auramode = (rgb->kbbl_set_auramode <= 3) ?
+			rgb->kbbl_set_auramode : 0;
 	}
+	mutex_unlock(&asus->kbbl_lease.lock);
+
+	return err;
 }
 
-/* RF *************************************************************************/
+static ssize_t kbbl_set_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	u8 value;
+	struct asus_wmi *asus;
+	int result;
+
+	asus = dev_get_drvdata(dev);
+	result = store_u8(&value, buf, count);
+	if (result < 0)
+		return result;
+
+	if (value == 1)
+		result = kbbl_rgb_commit(asus, 1);
+	else if (value == 2)
+		result = kbbl_rgb_commit(asus, 0);
+
+	if (result == -EBUSY)
+		return result;
+
+	return count;
+}
 
 /*
- * PCI hotplug (for wlan rfkill)
+ * Blank the RGB keyboard while any reason (KBBL_DARK_*) asks for it and show
+ * the previous colors again afterwards, both temporarily. A lease holder
+ * keeps its colors, and any RGB write while dark replaces what would be
+ * restored. Returns true if the EC was written.
  */
-static bool asus_wlan_rfkill_blocked(struct asus_wmi *asus)
+static bool kbbl_rgb_set_dark(struct asus_wmi *asus, unsigned int reason,
+			      bool dark)
 {
-	int result = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_WLAN);
+	struct asus_kbbl_rgb *saved = &asus->kbbl_dark_saved;
+	unsigned int mask;
+	bool written = false;
 
-	if (result < 0)
+	if (!asus->kbbl_rgb_available)
 		return false;
-	return !result;
+
+	mutex_lock(&asus->kbbl_lease.lock);
+	mask = dark ? asus->kbbl_dark | reason : asus->kbbl_dark & ~reason;
+	if (!mask == !asus->kbbl_dark) {
+		asus->kbbl_dark = mask;
+		goto out;
+	}
+	if (mask && asus->kbbl_lease.owner)
+		goto out;
+
+	asus->kbbl_fade.active = false;
+	if (mask) {
+		*saved = asus->kbbl_rgb;
+		if (!kbbl_rgb_apply(asus, 0, 0, 0, 0, saved->kbbl_speed,
+				    kbbl_rgb_flags(saved), 0))
+			asus->kbbl_dark = mask;
+	} else {
+		asus->kbbl_dark = 0;
+		kbbl_rgb_apply(asus, saved->kbbl_red, saved->kbbl_green,
+			       saved->kbbl_blue, saved->kbbl_mode,
+			       saved->kbbl_speed, kbbl_rgb_flags(saved), 0);
+	}
+	written = true;
+out:
+	mutex_unlock(&asus->kbbl_lease.lock);
+	return written;
 }
 
-static void asus_rfkill_hotplug(struct asus_wmi *asus)
+static ssize_t kbbl_transition_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct pci_dev *dev;
-	struct pci_bus *bus;
-	bool blocked;
-	bool absent;
-	u32 l;
-
-	mutex_lock(&asus->wmi_lock);
-	blocked = asus_wlan_rfkill_blocked(asus);
-	mutex_unlock(&asus->wmi_lock);
-
-	mutex_lock(&asus->hotplug_lock);
-	pci_lock_rescan_remove();
+	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	if (asus->wlan.rfkill)
-		rfkill_set_sw_state(asus->wlan.rfkill, blocked);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", asus->kbbl_fade.transition);
+}
 
-	if (asus->hotplug_slot.ops) {
-		bus = pci_find_bus(0, 1);
-		if (!bus) {
-			pr_warn("Unable to find PCI bus 1?\n");
-			goto out_unlock;
-		}
+static ssize_t kbbl_transition_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	unsigned int value;
+	int err;
 
-		if (pci_bus_read_config_dword(bus, 0, PCI_VENDOR_ID, &l)) {
-			pr_err("Unable to read PCI config space?\n");
-			goto out_unlock;
-		}
-		absent = (l == 0xffffffff);
+	err = kstrtouint(buf, 10, &value);
+	if (err < 0)
+		return err;
 
-		if (blocked != absent) {
-			pr_warn("BIOS says wireless lan is %s, "
-				"but the pci device is %s\n",
-				blocked ? "blocked" : "unblocked",
-				absent ? "absent" : "present");
-			pr_warn("skipped wireless hotplug as probably "
-				"inappropriate for this model\n");
-			goto out_unlock;
-		}
+	if (value > ASUS_FADE_MAX)
+		return -EINVAL;
 
-		if (!blocked) {
-			dev = pci_get_slot(bus, 0);
-			if (dev) {
-				/* Device already present */
-				pci_dev_put(dev);
-				goto out_unlock;
-			}
-			dev = pci_scan_single_device(bus, 0);
-			if (dev) {
-				pci_bus_assign_resources(bus);
-				pci_bus_add_device(dev);
-			}
-		} else {
-			dev = pci_get_slot(bus, 0);
-			if (dev) {
-				pci_stop_and_remove_bus_device(dev);
-				pci_dev_put(dev);
-			}
-		}
-	}
+	mutex_lock(&asus->kbbl_lease.lock);
+	asus->kbbl_fade.transition = value;
+	mutex_unlock(&asus->kbbl_lease.lock);
 
-out_unlock:
-	pci_unlock_rescan_remove();
-	mutex_unlock(&asus->hotplug_lock);
+	return count;
 }
 
-static void asus_rfkill_notify(acpi_handle handle, u32 event, void *data)
+static ssize_t kbbl_lease_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct asus_wmi *asus = data;
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_lease *lease = &asus->kbbl_lease;
+	ssize_t len;
 
-	if (event != ACPI_NOTIFY_BUS_CHECK)
-		return;
+	mutex_lock(&lease->lock);
+	len = scnprintf(buf, PAGE_SIZE,
+			"type %u\nowner %d\ncontention %lu\nrejects %lu\ndeferred %lu\n",
+			lease->owner ? lease->type : FAUSTUS_KBBL_LEASE_NONE,
+			lease->owner ? lease->tgid : 0, lease->contention,
+			lease->rejects, lease->deferred);
+	mutex_unlock(&lease->lock);
 
-	/*
-	 * We can't call directly asus_rfkill_hotplug because most
-	 * of the time WMBC is still being executed and not reetrant.
-	 * There is currently no way to tell ACPICA that  we want this
-	 * method to be serialized, we schedule a asus_rfkill_hotplug
-	 * call later, in a safer context.
-	 */
-	queue_work(asus->hotplug_workqueue, &asus->hotplug_work);
+	return len;
 }
 
-static int asus_register_rfkill_notifier(struct asus_wmi *asus, char *node)
-{
-	acpi_status status;
-	acpi_handle handle;
+/* RGB keyboard backlight telemetry mapping **********************************/
 
-	status = acpi_get_handle(NULL, node, &handle);
-	if (ACPI_FAILURE(status))
-		return -ENODEV;
+static int asus_hwmon_read_temp(struct asus_wmi *asus, long *temp);
+static int asus_hwmon_read_fan(struct asus_wmi *asus, int fan, int *rpm);
 
-	status = acpi_install_notify_handler(handle, ACPI_SYSTEM_NOTIFY,
-					     asus_rfkill_notify, asus);
-	if (ACPI_FAILURE(status))
-		pr_warn("Failed to register notify on %s\n", node);
+static u32 kbbl_map_color(struct asus_kbbl_map *map, int value)
+{
+	const struct kbbl_map_point *lo = &map->points[0];
+	const struct kbbl_map_point *hi;
+	int pos, span;
+	int i;
 
-	return 0;
+	if (value <= lo->value)
+		return (lo->red << 16) | (lo->green << 8) | lo->blue;
+
+	for (i = 1; i < map->npoints; i++) {
+		hi = &map->points[i];
+		if (value < hi->value) {
+			pos = value - lo->value;
+			span = hi->value - lo->value;
+			return (kbbl_lerp(lo->red, hi->red, pos, span) << 16) |
+			       (kbbl_lerp(lo->green, hi->green, pos, span) << 8) |
+			       kbbl_lerp(lo->blue, hi->blue, pos, span);
+		}
+		lo = hi;
+	}
+
+	return (lo->red << 16) | (lo->green << 8) | lo->blue;
 }
 
-static void asus_unregister_rfkill_notifier(struct asus_wmi *asus, char *node)
+/*
+ * Called with every telemetry value the driver reads anyway (hwmon, mode
+ * writes). Only a change of the mapped color reaches the EC, and it is
+ * written temporarily so the stored user setting is left alone.
+ */
+static void kbbl_map_feed(struct asus_wmi *asus, enum kbbl_map_source source,
+			  int value)
 {
-	acpi_status status = AE_OK;
-	acpi_handle handle;
+	struct asus_kbbl_map *map = &asus->kbbl_map;
+	u8 flags;
+	u32 color;
 
-	status = acpi_get_handle(NULL, node, &handle);
-	if (ACPI_FAILURE(status))
+	if (!asus->kbbl_rgb_available || READ_ONCE(map->source) != source)
 		return;
 
-	status = acpi_remove_notify_handler(handle, ACPI_SYSTEM_NOTIFY,
-					    asus_rfkill_notify);
-	if (ACPI_FAILURE(status))
-		pr_err("Error removing rfkill notify handler %s\n", node);
+	mutex_lock(&map->lock);
+	if (map->source != source || !map->npoints)
+		goto out;
+
+	map->fed = jiffies;
+	color = kbbl_map_color(map, value);
+	if (map->color_valid && map->color == color)
+		goto out;
+
+	/* A lease holder owns the colors, the map resumes on release */
+	mutex_lock(&asus->kbbl_lease.lock);
+	flags = kbbl_rgb_flags(&asus->kbbl_rgb);
+	if (!asus->kbbl_lease.owner)
+		asus->kbbl_fade.active = false;
+	if (!asus->kbbl_lease.owner && !asus->kbbl_dark &&
+	    !map->shown)
+		map->unshown = (struct faustus_kbbl_state) {
+			.red = asus->kbbl_rgb.kbbl_red,
+			.green = asus->kbbl_rgb.kbbl_green,
+			.blue = asus->kbbl_rgb.kbbl_blue,
+			.mode = asus->kbbl_rgb.kbbl_mode,
+			.speed = asus->kbbl_rgb.kbbl_speed,
+			.flags = flags,
+		};
+	if (!asus->kbbl_lease.owner && !asus->kbbl_dark &&
+	    !kbbl_rgb_apply(asus, color >> 16, (color >> 8) & 0xff,
+			    color & 0xff, 0, asus->kbbl_rgb.kbbl_speed,
+			    flags, 0)) {
+		map->color = color;
+		map->color_valid = true;
+		map->shown = true;
+	}
+	mutex_unlock(&asus->kbbl_lease.lock);
+out:
+	mutex_unlock(&map->lock);
 }
 
-static int asus_get_adapter_status(struct hotplug_slot *hotplug_slot,
-				   u8 *value)
+static void kbbl_map_work(struct work_struct *work)
 {
-	struct asus_wmi *asus = container_of(hotplug_slot,
-					     struct asus_wmi, hotplug_slot);
-	int result = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_WLAN);
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, kbbl_map.work);
+	struct asus_kbbl_map *map = &asus->kbbl_map;
+	enum kbbl_map_source source;
+	unsigned long interval, next, fed;
+	long temp;
+	int rpm;
 
-	if (result < 0)
-		return result;
+	/* Not held over the read, which feeds the map under the same lock */
+	mutex_lock(&map->lock);
+	source = map->source;
+	interval = msecs_to_jiffies(map->interval);
+	fed = map->fed;
+	mutex_unlock(&map->lock);
 
-	*value = !!result;
-	return 0;
-}
+	/* A recent hwmon read already fed the map, don't read it again */
+	next = interval;
+	if (time_before(jiffies, fed + interval))
+		next = fed + interval - jiffies;
+	else if (source == KBBL_MAP_TEMP)
+		asus_hwmon_read_temp(asus, &temp);
+	else if (source == KBBL_MAP_FAN)
+		asus_hwmon_read_fan(asus, 0, &rpm);
 
-static const struct hotplug_slot_ops asus_hotplug_slot_ops = {
-	.get_adapter_status = asus_get_adapter_status,
-	.get_power_status = asus_get_adapter_status,
-};
+	if (source == KBBL_MAP_TEMP || source == KBBL_MAP_FAN)
+		queue_delayed_work(system_wq, &map->work, next);
+}
 
-static void asus_hotplug_work(struct work_struct *work)
+/*
+ * Mapping stopped: put back the colors shown before it, temporarily, so
+ * kbbl_red/green/blue and the aura hotkeys no longer see the mapped color.
+ * Fields staged by sysfs but not committed stay pending. A lease holder or
+ * a dark keyboard keeps the mapped color until the next restart.
+ */
+static void kbbl_map_unshow(struct asus_wmi *asus)
 {
-	struct asus_wmi *asus;
+	struct faustus_kbbl_state *state = &asus->kbbl_map.unshown;
 
-	asus = container_of(work, struct asus_wmi, hotplug_work);
-	asus_rfkill_hotplug(asus);
+	mutex_lock(&asus->kbbl_lease.lock);
+	if (asus->kbbl_map.shown && !asus->kbbl_lease.owner &&
+	    !asus->kbbl_dark &&
+	    !kbbl_rgb_apply(asus, state->red, state->green, state->blue,
+			    state->mode, state->speed, state->flags, 0))
+		asus->kbbl_map.shown = false;
+	mutex_unlock(&asus->kbbl_lease.lock);
 }
 
-static int asus_setup_pci_hotplug(struct asus_wmi *asus)
+static void kbbl_map_restart(struct asus_wmi *asus)
 {
-	int ret = -ENOMEM;
-	struct pci_bus *bus = pci_find_bus(0, 1);
+	struct asus_kbbl_map *map = &asus->kbbl_map;
+	u8 mode;
 
-	if (!bus) {
-		pr_err("Unable to find wifi PCI bus\n");
-		return -ENODEV;
-	}
+	cancel_delayed_work_sync(&map->work);
 
-	asus->hotplug_workqueue =
-	    create_singlethread_workqueue("hotplug_workqueue");
-	if (!asus->hotplug_workqueue)
-		goto error_workqueue;
+	mutex_lock(&map->lock);
+	map->color_valid = false;
+	map->fed = jiffies - msecs_to_jiffies(map->interval);
+	mutex_unlock(&map->lock);
 
-	INIT_WORK(&asus->hotplug_work, asus_hotplug_work);
+	if (!map->npoints || map->source == KBBL_MAP_NONE) {
+		kbbl_map_unshow(asus);
+		return;
+	}
+
+	switch (map->source) {
+	case KBBL_MAP_TEMP:
+	case KBBL_MAP_FAN:
+		queue_delayed_work(system_wq, &map->work, 0);
+		break;
+	case KBBL_MAP_POLICY:
+		if (asus->throttle_thermal_policy_available)
+			mode = asus->throttle_thermal_policy_mode;
+		else
+			mode = asus->fan_boost_mode;
+		kbbl_map_feed(asus, KBBL_MAP_POLICY, mode);
+		break;
+	default:
+		break;
+	}
+}
+
+static ssize_t kbbl_map_source_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", asus->kbbl_map.source);
+}
+
+static ssize_t kbbl_map_source_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	u8 value;
+	int err;
+
+	err = kstrtou8(buf, 10, &value);
+	if (err < 0)
+		return err;
+
+	if (value > KBBL_MAP_MAX)
+		return -EINVAL;
+
+	mutex_lock(&asus->kbbl_map.lock);
+	WRITE_ONCE(asus->kbbl_map.source, value);
+	mutex_unlock(&asus->kbbl_map.lock);
+	kbbl_map_restart(asus);
+
+	return count;
+}
+
+static ssize_t kbbl_map_gradient_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_map *map = &asus->kbbl_map;
+	ssize_t len = 0;
+	int i;
+
+	mutex_lock(&map->lock);
+	for (i = 0; i < map->npoints; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%d:%02x%02x%02x",
+				 i ? " " : "", map->points[i].value,
+				 map->points[i].red, map->points[i].green,
+				 map->points[i].blue);
+	mutex_unlock(&map->lock);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+/* Format: "<value>:<rrggbb> ..." with values in ascending order */
+static ssize_t kbbl_map_gradient_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_map *map = &asus->kbbl_map;
+	struct kbbl_map_point points[ASUS_KBBL_MAP_POINTS];
+	char *str, *cur, *tok;
+	unsigned int color;
+	int npoints = 0;
+	int err = 0;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	cur = str;
+	while ((tok = strsep(&cur, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+
+		if (npoints == ASUS_KBBL_MAP_POINTS ||
+		    sscanf(tok, "%d:%x", &points[npoints].value, &color) != 2 ||
+		    color > 0xffffff ||
+		    (npoints && points[npoints].value <=
+				points[npoints - 1].value)) {
+			err = -EINVAL;
+			break;
+		}
+
+		points[npoints].red = color >> 16;
+		points[npoints].green = color >> 8;
+		points[npoints].blue = color;
+		npoints++;
+	}
+	kfree(str);
+
+	if (err)
+		return err;
+
+	mutex_lock(&map->lock);
+	memcpy(map->points, points, sizeof(points[0]) * npoints);
+	map->npoints = npoints;
+	mutex_unlock(&map->lock);
+
+	kbbl_map_restart(asus);
+
+	return count;
+}
+
+static ssize_t kbbl_map_interval_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", asus->kbbl_map.interval);
+}
+
+static ssize_t kbbl_map_interval_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err < 0)
+		return err;
+
+	if (value < ASUS_KBBL_MAP_INTERVAL_MIN ||
+	    value > ASUS_KBBL_MAP_INTERVAL_MAX)
+		return -EINVAL;
+
+	mutex_lock(&asus->kbbl_map.lock);
+	asus->kbbl_map.interval = value;
+	mutex_unlock(&asus->kbbl_map.lock);
+	kbbl_map_restart(asus);
+
+	return count;
+}
+
+/* RGB lease device ***********************************************************/
+
+static int kbbl_lease_acquire(struct asus_wmi *asus, struct file *file,
+			      u32 type)
+{
+	struct asus_kbbl_lease *lease = &asus->kbbl_lease;
+	int err = 0;
+
+	mutex_lock(&lease->lock);
+	if (lease->owner && lease->owner != file) {
+		lease->contention++;
+		err = -EBUSY;
+	} else {
+		lease->owner = file;
+		lease->tgid = task_tgid_nr(current);
+		lease->type = type;
+		/* A fade started by someone else must not paint over the holder */
+		asus->kbbl_fade.active = false;
+	}
+	mutex_unlock(&lease->lock);
+
+	return err;
+}
+
+static void kbbl_lease_release(struct asus_wmi *asus, struct file *file)
+{
+	struct asus_kbbl_lease *lease = &asus->kbbl_lease;
+	bool released = false;
+
+	mutex_lock(&lease->lock);
+	if (lease->owner == file) {
+		lease->owner = NULL;
+		released = true;
+
+		/* Replay the commits the other clients made meanwhile */
+		if (lease->queued_saved) {
+			struct faustus_kbbl_state *saved = &lease->saved_state;
+
+			lease->queued_saved = false;
+			kbbl_rgb_apply(asus, saved->red, saved->green,
+				       saved->blue, saved->mode, saved->speed,
+				       saved->flags, saved->persistent);
+		}
+		if (lease->queued) {
+			lease->queued = false;
+			kbbl_rgb_set_state(asus, &lease->queued_state);
+		}
+	}
+	mutex_unlock(&lease->lock);
+
+	if (released)
+		kbbl_map_restart(asus);
+}
+
+static int kbbl_dev_open(struct inode *inode, struct file *file)
+{
+	struct asus_wmi *asus = container_of(file->private_data,
+					     struct asus_wmi, kbbl_miscdev);
+
+	file->private_data = asus;
+	return nonseekable_open(inode, file);
+}
+
+static int kbbl_dev_release(struct inode *inode, struct file *file)
+{
+	kbbl_lease_release(file->private_data, file);
+	return 0;
+}
+
+static void kbbl_state_get(struct asus_wmi *asus,
+			   struct faustus_kbbl_state *state)
+{
+	struct asus_state current_state;
+
+	asus_state_read(asus, &current_state);
+	state->red = current_state.red;
+	state->green = current_state.green;
+	state->blue = current_state.blue;
+	state->mode = current_state.mode;
+	state->speed = current_state.speed;
+	state->flags = current_state.flags;
+}
+
+static ssize_t kbbl_dev_read(struct file *file, char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	struct asus_wmi *asus = file->private_data;
+	struct faustus_kbbl_state state = { 0 };
+
+	if (count < sizeof(state))
+		return -EINVAL;
+
+	kbbl_state_get(asus, &state);
+
+	if (copy_to_user(buf, &state, sizeof(state)))
+		return -EFAULT;
+
+	return sizeof(state);
+}
+
+/* Apply a state record for the holder of file, refused if another holds it */
+static int kbbl_state_set(struct asus_wmi *asus, struct file *file,
+			  const struct faustus_kbbl_state *state)
+{
+	struct asus_kbbl_lease *lease = &asus->kbbl_lease;
+	int err;
+
+	mutex_lock(&lease->lock);
+	if (lease->owner && lease->owner != file) {
+		lease->rejects++;
+		err = -EBUSY;
+	} else {
+		asus->kbbl_fade.active = false;
+		asus->kbbl_dark = 0;
+		err = kbbl_rgb_apply(asus, state->red, state->green,
+				     state->blue, state->mode, state->speed,
+				     state->flags, state->persistent);
+		if (!err)
+			asus->kbbl_map.shown = false;
+	}
+	mutex_unlock(&lease->lock);
+
+	return err;
+}
+
+static ssize_t kbbl_dev_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct asus_wmi *asus = file->private_data;
+	struct faustus_kbbl_state state;
+	int err;
+
+	if (count != sizeof(state))
+		return -EINVAL;
+
+	if (copy_from_user(&state, buf, sizeof(state)))
+		return -EFAULT;
+
+	err = kbbl_state_set(asus, file, &state);
+
+	return err ? err : count;
+}
+
+static long kbbl_dev_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct asus_wmi *asus = file->private_data;
+	u32 type;
+
+	switch (cmd) {
+	case FAUSTUS_KBBL_IOC_LEASE:
+		if (get_user(type, (u32 __user *)arg))
+			return -EFAULT;
+
+		switch (type) {
+		case FAUSTUS_KBBL_LEASE_NONE:
+			kbbl_lease_release(asus, file);
+			return 0;
+		case FAUSTUS_KBBL_LEASE_PRIORITY:
+		case FAUSTUS_KBBL_LEASE_EXCLUSIVE:
+			return kbbl_lease_acquire(asus, file, type);
+		default:
+			return -EINVAL;
+		}
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations kbbl_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = kbbl_dev_open,
+	.release = kbbl_dev_release,
+	.read = kbbl_dev_read,
+	.write = kbbl_dev_write,
+	.unlocked_ioctl = kbbl_dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+/* RGB values: 00 .. ff */
+static DEVICE_ATTR_RW(kbbl_red);
+static DEVICE_ATTR_RW(kbbl_green);
+static DEVICE_ATTR_RW(kbbl_blue);
+
+/*
+ * Color modes: 0 - static color, 1 - breathing, 2 - color cycle, 3 - strobing
+ */
+static DEVICE_ATTR_RW(kbbl_mode);
+
+/* Speed for modes 1 and 2: 0 - slow, 1 - medium, 2 - fast */
+static DEVICE_ATTR_RW(kbbl_speed);
+
+/*
+ * Enable: 02 - on boot (until module load) | 08 - awake | 20 - sleep
+ * (2a or ff to enable everything)
+ *
+ * Logically 80 would be shutdown, but no visible effects of this option
+ * were observed so far
+ */
+static DEVICE_ATTR_RW(kbbl_flags);
+
+/* Write data: 1 - permanently, 2 - temporarily (reset after reboot) */
+static DEVICE_ATTR_RW(kbbl_set);
+
+/* Speed for aura hotkeys color change */
+static DEVICE_ATTR_RW(kbbl_auraspeed);
+
+/* Set mode switching for aura hotkeys: 0 - color cycle, 1 - color mode selection, 
+ * 2 - speed for modes, 3 - white balance */
+static DEVICE_ATTR_RW(kbbl_auramode);
+
+/*
+ * Telemetry color mapping: 0 - off, 1 - CPU temperature (C),
+ * 2 - thermal policy / fan boost mode, 3 - CPU fan (RPM)
+ */
+static DEVICE_ATTR_RW(kbbl_map_source);
+
+/* Gradient points "<value>:<rrggbb>", up to 8, ascending values */
+static DEVICE_ATTR_RW(kbbl_map_gradient);
+
+/* Polling period in ms for the temperature and fan sources */
+static DEVICE_ATTR_RW(kbbl_map_interval);
+
+/* Fade time in ms between static colors, 0 - switch at once */
+static DEVICE_ATTR_RW(kbbl_transition);
+
+/* Lease state and contention counters of /dev/faustus_kbbl */
+static DEVICE_ATTR_RO(kbbl_lease);
+
+static struct attribute *rgbkb_sysfs_attributes[] = {
+	&dev_attr_kbbl_red.attr,
+	&dev_attr_kbbl_green.attr,
+	&dev_attr_kbbl_blue.attr,
+	&dev_attr_kbbl_mode.attr,
+	&dev_attr_kbbl_speed.attr,
+	&dev_attr_kbbl_flags.attr,
+	&dev_attr_kbbl_set.attr,
+	&dev_attr_kbbl_auraspeed.attr,
+	&dev_attr_kbbl_auramode.attr,
+	&dev_attr_kbbl_map_source.attr,
+	&dev_attr_kbbl_map_gradient.attr,
+	&dev_attr_kbbl_map_interval.attr,
+	&dev_attr_kbbl_transition.attr,
+	&dev_attr_kbbl_lease.attr,
+	NULL,
+};
+
+static const struct attribute_group kbbl_attribute_group = {
+	.name = "kbbl",
+	.attrs = rgbkb_sysfs_attributes
+};
+
+static int kbbl_rgb_init(struct asus_wmi *asus)
+{
+	int err;
+
+	err = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_KBD_RGB);
+	if (err) {
+		if (err == -ENODEV)
+			return 0;
+		else
+			return err;
+	}
+
+	err = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_KBD_RGB2);
+	if (err) {
+		if (err == -ENODEV)
+			return 0;
+		else
+			return err;
+	}
+
+	mutex_init(&asus->kbbl_map.lock);
+	INIT_DELAYED_WORK(&asus->kbbl_map.work, kbbl_map_work);
+	asus->kbbl_map.interval = ASUS_KBBL_MAP_INTERVAL;
+	mutex_init(&asus->kbbl_lease.lock);
+	INIT_DELAYED_WORK(&asus->kbbl_fade.work, kbbl_fade_work);
+
+	asus->kbbl_miscdev.minor = MISC_DYNAMIC_MINOR;
+	asus->kbbl_miscdev.name = "faustus_kbbl";
+	asus->kbbl_miscdev.fops = &kbbl_dev_fops;
+	asus->kbbl_miscdev.parent = &asus->platform_device->dev;
+	err = misc_register(&asus->kbbl_miscdev);
+	if (err)
+		return err;
+
+	asus->kbbl_rgb_available = true;
+	err = sysfs_create_group(&asus->platform_device->dev.kobj,
+			&kbbl_attribute_group);
+	if (err) {
+		asus->kbbl_rgb_available = false;
+		misc_deregister(&asus->kbbl_miscdev);
+	}
+
+	return err;
+}
+
+static void kbbl_rgb_exit(struct asus_wmi *asus)
+{
+	if (asus->kbbl_rgb_available) {
+		sysfs_remove_group(&asus->platform_device->dev.kobj,
+				&kbbl_attribute_group);
+		misc_deregister(&asus->kbbl_miscdev);
+		asus->kbbl_map.source = KBBL_MAP_NONE;
+		cancel_delayed_work_sync(&asus->kbbl_map.work);
+		cancel_delayed_work_sync(&asus->kbbl_fade.work);
+	}
+}
+
+/* RF *************************************************************************/
+
+/*
+ * PCI hotplug (for wlan rfkill)
+ */
+static bool asus_wlan_rfkill_blocked(struct asus_wmi *asus)
+{
+	int result = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_WLAN);
+
+	if (result < 0)
+		return false;
+	return !result;
+}
+
+static void asus_rfkill_hotplug(struct asus_wmi *asus)
+{
+	struct pci_dev *dev;
+	struct pci_bus *bus;
+	bool blocked;
+	bool absent;
+	u32 l;
+
+	mutex_lock(&asus->rfkill_lock);
+	blocked = asus_wlan_rfkill_blocked(asus);
+	mutex_unlock(&asus->rfkill_lock);
+
+	mutex_lock(&asus->hotplug_lock);
+	pci_lock_rescan_remove();
+
+	if (asus->wlan.rfkill)
+		rfkill_set_sw_state(asus->wlan.rfkill, blocked);
+
+	if (asus->hotplug_slot.ops) {
+		bus = pci_find_bus(0, 1);
+		if (!bus) {
+			pr_warn("Unable to find PCI bus 1?\n");
+			goto out_unlock;
+		}
+
+		if (pci_bus_read_config_dword(bus, 0, PCI_VENDOR_ID, &l)) {
+			pr_err("Unable to read PCI config space?\n");
+			goto out_unlock;
+		}
+		absent = (l == 0xffffffff);
+
+		if (blocked != absent) {
+			pr_warn("BIOS says wireless lan is %s, "
+				"but the pci device is %s\n",
+				blocked ? "blocked" : "unblocked",
+				absent ? "absent" : "present");
+			pr_warn("skipped wireless hotplug as probably "
+				"inappropriate for this model\n");
+			goto out_unlock;
+		}
+
+		if (!blocked) {
+			dev = pci_get_slot(bus, 0);
+			if (dev) {
+				/* Device already present */
+				pci_dev_put(dev);
+				goto out_unlock;
+			}
+			dev = pci_scan_single_device(bus, 0);
+			if (dev) {
+				pci_bus_assign_resources(bus);
+				pci_bus_add_device(dev);
+			}
+		} else {
+			dev = pci_get_slot(bus, 0);
+			if (dev) {
+				pci_stop_and_remove_bus_device(dev);
+				pci_dev_put(dev);
+			}
+		}
+	}
+
+out_unlock:
+	pci_unlock_rescan_remove();
+	mutex_unlock(&asus->hotplug_lock);
+}
+
+static void asus_rfkill_notify(acpi_handle handle, u32 event, void *data)
+{
+	struct asus_wmi *asus = data;
+
+	if (event != ACPI_NOTIFY_BUS_CHECK)
+		return;
+
+	/*
+	 * We can't call directly asus_rfkill_hotplug because most
+	 * of the time WMBC is still being executed and not reetrant.
+	 * There is currently no way to tell ACPICA that  we want this
+	 * method to be serialized, we schedule a asus_rfkill_hotplug
+	 * call later, in a safer context.
+	 */
+	queue_work(asus->hotplug_workqueue, &asus->hotplug_work);
+}
+
+static int asus_register_rfkill_notifier(struct asus_wmi *asus, char *node)
+{
+	acpi_status status;
+	acpi_handle handle;
+
+	status = acpi_get_handle(NULL, node, &handle);
+	if (ACPI_FAILURE(status))
+		return -ENODEV;
+
+	status = acpi_install_notify_handler(handle, ACPI_SYSTEM_NOTIFY,
+					     asus_rfkill_notify, asus);
+	if (ACPI_FAILURE(status))
+		pr_warn("Failed to register notify on %s\n", node);
+
+	return 0;
+}
+
+static void asus_unregister_rfkill_notifier(struct asus_wmi *asus, char *node)
+{
+	acpi_status status = AE_OK;
+	acpi_handle handle;
+
+	status = acpi_get_handle(NULL, node, &handle);
+	if (ACPI_FAILURE(status))
+		return;
+
+	status = acpi_remove_notify_handler(handle, ACPI_SYSTEM_NOTIFY,
+					    asus_rfkill_notify);
+	if (ACPI_FAILURE(status))
+		pr_err("Error removing rfkill notify handler %s\n", node);
+}
+
+static int asus_get_adapter_status(struct hotplug_slot *hotplug_slot,
+				   u8 *value)
+{
+	struct asus_wmi *asus = container_of(hotplug_slot,
+					     struct asus_wmi, hotplug_slot);
+	int result = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_WLAN);
+
+	if (result < 0)
+		return result;
+
+	*value = !!result;
+	return 0;
+}
+
+static const struct hotplug_slot_ops asus_hotplug_slot_ops = {
+	.get_adapter_status = asus_get_adapter_status,
+	.get_power_status = asus_get_adapter_status,
+};
+
+static void asus_hotplug_work(struct work_struct *work)
+{
+	struct asus_wmi *asus;
+
+	asus = container_of(work, struct asus_wmi, hotplug_work);
+	asus_rfkill_hotplug(asus);
+}
+
+static int asus_setup_pci_hotplug(struct asus_wmi *asus)
+{
+	int ret = -ENOMEM;
+	struct pci_bus *bus = pci_find_bus(0, 1);
+
+	if (!bus) {
+		pr_err("Unable to find wifi PCI bus\n");
+		return -ENODEV;
+	}
+
+	asus->hotplug_workqueue =
+	    create_singlethread_workqueue("hotplug_workqueue");
+	if (!asus->hotplug_workqueue)
+		goto error_workqueue;
+
+	INIT_WORK(&asus->hotplug_work, asus_hotplug_work);
 
 	asus->hotplug_slot.ops = &asus_hotplug_slot_ops;
 
-	ret = pci_hp_register(&asus->hotplug_slot, bus, 0, "asus-wifi");
-	if (ret) {
-		pr_err("Unable to register hotplug slot - %d\n", ret);
-		goto error_register;
+	ret = pci_hp_register(&asus->hotplug_slot, bus, 0, "asus-wifi");
+	if (ret) {
+		pr_err("Unable to register hotplug slot - %d\n", ret);
+		goto error_register;
+	}
+
+	return 0;
+
+error_register:
+	asus->hotplug_slot.ops = NULL;
+	destroy_workqueue(asus->hotplug_workqueue);
+error_workqueue:
+	return ret;
+}
+
+/*
+ * Rfkill devices
+ */
+static int asus_rfkill_set(void *data, bool blocked)
+{
+	struct asus_rfkill *priv = data;
+	u32 ctrl_param = !blocked;
+	u32 dev_id = priv->dev_id;
+
+	/*
+	 * If the user bit is set, BIOS can't set and record the wlan status,
+	 * it will report the value read from id ASUS_WMI_DEVID_WLAN_LED
+	 * while we query the wlan status through WMI(ASUS_WMI_DEVID_WLAN).
+	 * So, we have to record wlan status in id ASUS_WMI_DEVID_WLAN_LED
+	 * while setting the wlan status through WMI.
+	 * This is also the behavior that windows app will do.
+	 */
+	if ((dev_id == ASUS_WMI_DEVID_WLAN) &&
+	     priv->asus->driver->wlan_ctrl_by_user)
+		dev_id = ASUS_WMI_DEVID_WLAN_LED;
+
+	/* The BIOS drives the wireless LED from the radio state */
+	if (priv->dev_id == ASUS_WMI_DEVID_WLAN)
+		clear_bit(ASUS_SHADOW_WLAN_LED, &priv->asus->shadow_valid);
+
+	return asus_wmi_set_devstate(dev_id, ctrl_param, NULL);
+}
+
+static void asus_rfkill_query(struct rfkill *rfkill, void *data)
+{
+	struct asus_rfkill *priv = data;
+	int result;
+
+	result = asus_wmi_get_devstate_simple(priv->asus, priv->dev_id);
+
+	if (result < 0)
+		return;
+
+	rfkill_set_sw_state(priv->rfkill, !result);
+}
+
+static int asus_rfkill_wlan_set(void *data, bool blocked)
+{
+	struct asus_rfkill *priv = data;
+	struct asus_wmi *asus = priv->asus;
+	int ret;
+
+	/*
+	 * This handler is enabled only if hotplug is enabled.
+	 * In this case, the asus_wmi_set_devstate() will
+	 * trigger a wmi notification and we need to wait
+	 * this call to finish before being able to call
+	 * any wmi method
+	 */
+	mutex_lock(&asus->rfkill_lock);
+	ret = asus_rfkill_set(data, blocked);
+	mutex_unlock(&asus->rfkill_lock);
+	return ret;
+}
+
+static const struct rfkill_ops asus_rfkill_wlan_ops = {
+	.set_block = asus_rfkill_wlan_set,
+	.query = asus_rfkill_query,
+};
+
+static const struct rfkill_ops asus_rfkill_ops = {
+	.set_block = asus_rfkill_set,
+	.query = asus_rfkill_query,
+};
+
+static int asus_new_rfkill(struct asus_wmi *asus,
+			   struct asus_rfkill *arfkill,
+			   const char *name, enum rfkill_type type, int dev_id)
+{
+	int result = asus_wmi_get_devstate_simple(asus, dev_id);
+	struct rfkill **rfkill = &arfkill->rfkill;
+
+	if (result < 0)
+		return result;
+
+	arfkill->dev_id = dev_id;
+	arfkill->asus = asus;
+
+	if (dev_id == ASUS_WMI_DEVID_WLAN &&
+	    asus->driver->quirks->hotplug_wireless)
+		*rfkill = rfkill_alloc(name, &asus->platform_device->dev, type,
+				       &asus_rfkill_wlan_ops, arfkill);
+	else
+		*rfkill = rfkill_alloc(name, &asus->platform_device->dev, type,
+				       &asus_rfkill_ops, arfkill);
+
+	if (!*rfkill)
+		return -EINVAL;
+
+	if ((dev_id == ASUS_WMI_DEVID_WLAN) &&
+			(asus->driver->quirks->wapf > 0))
+		rfkill_set_led_trigger_name(*rfkill, "asus-wlan");
+
+	rfkill_init_sw_state(*rfkill, !result);
+	result = rfkill_register(*rfkill);
+	if (result) {
+		rfkill_destroy(*rfkill);
+		*rfkill = NULL;
+		return result;
+	}
+	return 0;
+}
+
+static void asus_wmi_rfkill_exit(struct asus_wmi *asus)
+{
+	if (asus->driver->wlan_ctrl_by_user && ashs_present())
+		return;
+
+	asus_unregister_rfkill_notifier(asus, "\\_SB.PCI0.P0P5");
+	asus_unregister_rfkill_notifier(asus, "\\_SB.PCI0.P0P6");
+	asus_unregister_rfkill_notifier(asus, "\\_SB.PCI0.P0P7");
+	if (asus->wlan.rfkill) {
+		rfkill_unregister(asus->wlan.rfkill);
+		rfkill_destroy(asus->wlan.rfkill);
+		asus->wlan.rfkill = NULL;
+	}
+	/*
+	 * Refresh pci hotplug in case the rfkill state was changed after
+	 * asus_unregister_rfkill_notifier()
+	 */
+	asus_rfkill_hotplug(asus);
+	if (asus->hotplug_slot.ops)
+		pci_hp_deregister(&asus->hotplug_slot);
+	if (asus->hotplug_workqueue)
+		destroy_workqueue(asus->hotplug_workqueue);
+
+	if (asus->bluetooth.rfkill) {
+		rfkill_unregister(asus->bluetooth.rfkill);
+		rfkill_destroy(asus->bluetooth.rfkill);
+		asus->bluetooth.rfkill = NULL;
+	}
+	if (asus->wimax.rfkill) {
+		rfkill_unregister(asus->wimax.rfkill);
+		rfkill_destroy(asus->wimax.rfkill);
+		asus->wimax.rfkill = NULL;
+	}
+	if (asus->wwan3g.rfkill) {
+		rfkill_unregister(asus->wwan3g.rfkill);
+		rfkill_destroy(asus->wwan3g.rfkill);
+		asus->wwan3g.rfkill = NULL;
+	}
+	if (asus->gps.rfkill) {
+		rfkill_unregister(asus->gps.rfkill);
+		rfkill_destroy(asus->gps.rfkill);
+		asus->gps.rfkill = NULL;
+	}
+	if (asus->uwb.rfkill) {
+		rfkill_unregister(asus->uwb.rfkill);
+		rfkill_destroy(asus->uwb.rfkill);
+		asus->uwb.rfkill = NULL;
+	}
+}
+
+static int asus_wmi_rfkill_init(struct asus_wmi *asus)
+{
+	int result = 0;
+
+	mutex_init(&asus->hotplug_lock);
+	mutex_init(&asus->rfkill_lock);
+
+	result = asus_new_rfkill(asus, &asus->wlan, "asus-wlan",
+				 RFKILL_TYPE_WLAN, ASUS_WMI_DEVID_WLAN);
+
+	if (result && result != -ENODEV)
+		goto exit;
+
+	result = asus_new_rfkill(asus, &asus->bluetooth,
+				 "asus-bluetooth", RFKILL_TYPE_BLUETOOTH,
+				 ASUS_WMI_DEVID_BLUETOOTH);
+
+	if (result && result != -ENODEV)
+		goto exit;
+
+	result = asus_new_rfkill(asus, &asus->wimax, "asus-wimax",
+				 RFKILL_TYPE_WIMAX, ASUS_WMI_DEVID_WIMAX);
+
+	if (result && result != -ENODEV)
+		goto exit;
+
+	result = asus_new_rfkill(asus, &asus->wwan3g, "asus-wwan3g",
+				 RFKILL_TYPE_WWAN, ASUS_WMI_DEVID_WWAN3G);
+
+	if (result && result != -ENODEV)
+		goto exit;
+
+	result = asus_new_rfkill(asus, &asus->gps, "asus-gps",
+				 RFKILL_TYPE_GPS, ASUS_WMI_DEVID_GPS);
+
+	if (result && result != -ENODEV)
+		goto exit;
+
+	result = asus_new_rfkill(asus, &asus->uwb, "asus-uwb",
+				 RFKILL_TYPE_UWB, ASUS_WMI_DEVID_UWB);
+
+	if (result && result != -ENODEV)
+		goto exit;
+
+	if (!asus->driver->quirks->hotplug_wireless)
+		goto exit;
+
+	result = asus_setup_pci_hotplug(asus);
+	/*
+	 * If we get -EBUSY then something else is handling the PCI hotplug -
+	 * don't fail in this case
+	 */
+	if (result == -EBUSY)
+		result = 0;
+
+	asus_register_rfkill_notifier(asus, "\\_SB.PCI0.P0P5");
+	asus_register_rfkill_notifier(asus, "\\_SB.PCI0.P0P6");
+	asus_register_rfkill_notifier(asus, "\\_SB.PCI0.P0P7");
+	/*
+	 * Refresh pci hotplug in case the rfkill state was changed during
+	 * setup.
+	 */
+	asus_rfkill_hotplug(asus);
+
+exit:
+	if (result && result != -ENODEV)
+		asus_wmi_rfkill_exit(asus);
+
+	if (result == -ENODEV)
+		result = 0;
+
+	return result;
+}
+
+/* Quirks *********************************************************************/
+
+static void asus_wmi_set_xusb2pr(struct asus_wmi *asus)
+{
+	struct pci_dev *xhci_pdev;
+	u32 orig_ports_available;
+	u32 ports_available = asus->driver->quirks->xusb2pr;
+
+	xhci_pdev = pci_get_device(PCI_VENDOR_ID_INTEL,
+			PCI_DEVICE_ID_INTEL_LYNXPOINT_LP_XHCI,
+			NULL);
+
+	if (!xhci_pdev)
+		return;
+
+	pci_read_config_dword(xhci_pdev, USB_INTEL_XUSB2PR,
+				&orig_ports_available);
+
+	pci_write_config_dword(xhci_pdev, USB_INTEL_XUSB2PR,
+				cpu_to_le32(ports_available));
+
+	pr_info("set USB_INTEL_XUSB2PR old: 0x%04x, new: 0x%04x\n",
+			orig_ports_available, ports_available);
+}
+
+/*
+ * Some devices dont support or have borcken get_als method
+ * but still support set method.
+ */
+static void asus_wmi_set_als(void)
+{
+	asus_wmi_set_devstate(ASUS_WMI_DEVID_ALS_ENABLE, 1, NULL);
+}
+
+/* Hwmon device ***************************************************************/
+
+static int asus_agfn_fan_speed_read(struct asus_wmi *asus, int fan,
+					  int *speed)
+{
+	struct agfn_fan_args args = {
+		.agfn.len = sizeof(args),
+		.agfn.mfun = ASUS_FAN_MFUN,
+		.agfn.sfun = ASUS_FAN_SFUN_READ,
+		.fan = fan,
+		.speed = 0,
+	};
+	struct acpi_buffer input = { (acpi_size) sizeof(args), &args };
+	int status;
+
+	if (fan != 1)
+		return -EINVAL;
+
+	status = asus_wmi_evaluate_method_agfn(input);
+
+	if (status || args.agfn.err)
+		return -ENXIO;
+
+	if (speed)
+		*speed = args.speed;
+
+	return 0;
+}
+
+/* Called with fan_lock held */
+static int asus_agfn_fan_speed_write(struct asus_wmi *asus, int fan,
+				     int *speed)
+{
+	struct agfn_fan_args args = {
+		.agfn.len = sizeof(args),
+		.agfn.mfun = ASUS_FAN_MFUN,
+		.agfn.sfun = ASUS_FAN_SFUN_WRITE,
+		.fan = fan,
+		.speed = speed ?  *speed : 0,
+	};
+	struct acpi_buffer input = { (acpi_size) sizeof(args), &args };
+	int status;
+
+	lockdep_assert_held(&asus->fan_lock);
+
+	/* 1: for setting 1st fan's speed 0: setting auto mode */
+	if (fan != 1 && fan != 0)
+		return -EINVAL;
+
+	status = asus_wmi_evaluate_method_agfn(input);
+
+	if (status || args.agfn.err)
+		return -ENXIO;
+
+	if (speed && fan == 1)
+		WRITE_ONCE(asus->agfn_pwm, *speed);
+
+	return 0;
+}
+
+/*
+ * Check if we can read the speed of one fan. If true we assume we can also
+ * control it.
+ */
+static bool asus_wmi_has_agfn_fan(struct asus_wmi *asus)
+{
+	int status;
+	int speed;
+	u32 value;
+
+	status = asus_agfn_fan_speed_read(asus, 1, &speed);
+	if (status != 0)
+		return false;
+
+	status = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_CTRL, &value);
+	if (status != 0)
+		return false;
+
+	/*
+	 * We need to find a better way, probably using sfun,
+	 * bits or spec ...
+	 * Currently we disable it if:
+	 * - ASUS_WMI_UNSUPPORTED_METHOD is returned
+	 * - reverved bits are non-zero
+	 * - sfun and presence bit are not set
+	 */
+	return !(value == ASUS_WMI_UNSUPPORTED_METHOD || value & 0xFFF80000
+		 || (!asus->sfun && !(value & ASUS_WMI_DSTS_PRESENCE_BIT)));
+}
+
+/* Called with fan_lock held */
+static int asus_fan_set_auto(struct asus_wmi *asus)
+{
+	int status;
+	u32 retval;
+
+	lockdep_assert_held(&asus->fan_lock);
+
+	switch (asus->fan_type) {
+	case FAN_TYPE_SPEC83:
+		status = __asus_wmi_set_devstate(ASUS_WMI_DEVID_CPU_FAN_CTRL,
+						 0, &retval);
+		if (status == -EINPROGRESS)
+			break;		/* replayed by the breaker */
+		if (status)
+			return status;
+
+		if (retval != 1)
+			return -EIO;
+		break;
+
+	case FAN_TYPE_AGFN:
+		status = asus_agfn_fan_speed_write(asus, 0, NULL);
+		if (status)
+			return -ENXIO;
+		break;
+
+	default:
+		return -ENXIO;
+	}
+
+
+	return 0;
+}
+
+/*
+ * Sensor reads go through a per-channel cache, so any number of readers cost
+ * at most one BIOS call per channel and update_interval.
+ */
+static int asus_hwmon_cached(struct asus_wmi *asus,
+			     struct asus_hwmon_cache *cache,
+			     int (*read)(struct asus_wmi *asus, int channel,
+					 long *value),
+			     int channel, long *value)
+{
+	unsigned long interval;
+	int err;
+
+	mutex_lock(&asus->hwmon_lock);
+	interval = msecs_to_jiffies(asus->hwmon_interval);
+	if (!cache->valid || time_after_eq(jiffies, cache->stamp + interval)) {
+		cache->err = read(asus, channel, &cache->value);
+		cache->stamp = jiffies;
+		cache->valid = true;
+	}
+
+	err = cache->err;
+	if (!err)
+		*value = cache->value;
+	mutex_unlock(&asus->hwmon_lock);
+
+	return err;
+}
+
+static void asus_hwmon_invalidate(struct asus_wmi *asus)
+{
+	int i;
+
+	mutex_lock(&asus->hwmon_lock);
+	asus->hwmon_temp.valid = false;
+	for (i = 0; i < ARRAY_SIZE(asus->hwmon_fan); i++)
+		asus->hwmon_fan[i].valid = false;
+	mutex_unlock(&asus->hwmon_lock);
+}
+
+/*
+ * Fan curve for AGFN fans (pwm1_enable = 3). The CPU temperature is mapped to
+ * a duty cycle by interpolating between pwm1_auto_point[1-8]_{temp,pwm}. The
+ * fan only slows down once the temperature dropped by pwm1_auto_temp_hyst and
+ * the duty moves by at most pwm1_auto_ramp_step per evaluation.
+ */
+static int asus_fan_curve_target(struct asus_fan_curve *curve, long temp)
+{
+	int i;
+
+	if (temp <= curve->temp[0])
+		return curve->pwm[0];
+
+	for (i = 1; i < ASUS_FAN_CURVE_POINTS; i++) {
+		if (temp >= curve->temp[i])
+			continue;
+
+		return curve->pwm[i - 1] +
+		       (curve->pwm[i] - curve->pwm[i - 1]) *
+		       (temp - curve->temp[i - 1]) /
+		       (curve->temp[i] - curve->temp[i - 1]);
+	}
+
+	return curve->pwm[ASUS_FAN_CURVE_POINTS - 1];
+}
+
+static void asus_fan_curve_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, fan_curve.work);
+	struct asus_fan_curve *curve = &asus->fan_curve;
+	unsigned int interval;
+	long temp;
+	int target;
+	int err;
+
+	/* Before the locks, the reading also feeds the RGB map */
+	err = asus_hwmon_read_temp(asus, &temp);
+
+	mutex_lock(&asus->fan_lock);
+	mutex_lock(&curve->lock);
+	if (asus->fan_pwm_mode != ASUS_FAN_CTRL_CURVE)
+		goto out;
+
+	if (err)
+		goto fallback;
+
+	if (!curve->temp_valid || temp > curve->temp_used ||
+	    temp <= curve->temp_used - curve->hyst) {
+		curve->temp_used = temp;
+		curve->temp_valid = true;
+	}
+
+	target = asus_fan_curve_target(curve, curve->temp_used);
+	if (curve->ramp && asus->agfn_pwm >= 0)
+		target = clamp_t(int, target, asus->agfn_pwm - curve->ramp,
+				 asus->agfn_pwm + curve->ramp);
+
+	if (target != asus->agfn_pwm) {
+		err = asus_agfn_fan_speed_write(asus, 1, &target);
+		if (err)
+			goto fallback;
+	}
+
+	/* Temperature reads are cached for update_interval anyway */
+	interval = max_t(unsigned int, asus->hwmon_interval,
+			 ASUS_FAN_CURVE_INTERVAL);
+	queue_delayed_work(system_wq, &curve->work, msecs_to_jiffies(interval));
+	goto out;
+
+fallback:
+	pr_warn("Fan curve failed, switching to auto mode: %d\n", err);
+	asus_fan_set_auto(asus);
+	asus->fan_pwm_mode = ASUS_FAN_CTRL_AUTO;
+	asus_hwmon_invalidate(asus);
+out:
+	mutex_unlock(&curve->lock);
+	mutex_unlock(&asus->fan_lock);
+}
+
+static void asus_fan_curve_start(struct asus_wmi *asus)
+{
+	mutex_lock(&asus->fan_lock);
+	mutex_lock(&asus->fan_curve.lock);
+	asus->fan_pwm_mode = ASUS_FAN_CTRL_CURVE;
+	asus->fan_curve.temp_valid = false;
+	mutex_unlock(&asus->fan_curve.lock);
+	mutex_unlock(&asus->fan_lock);
+
+	asus_hwmon_invalidate(asus);
+	mod_delayed_work(system_wq, &asus->fan_curve.work, 0);
+}
+
+static void asus_fan_curve_init(struct asus_wmi *asus)
+{
+	struct asus_fan_curve *curve = &asus->fan_curve;
+	int i;
+
+	mutex_init(&curve->lock);
+	INIT_DELAYED_WORK(&curve->work, asus_fan_curve_work);
+
+	/* 40 to 75 degrees, a conservative ramp up to full speed */
+	for (i = 0; i < ASUS_FAN_CURVE_POINTS; i++) {
+		curve->temp[i] = 40000 + i * 5000;
+		curve->pwm[i] = 64 + i * 191 / (ASUS_FAN_CURVE_POINTS - 1);
+	}
+	curve->hyst = ASUS_FAN_CURVE_HYST;
+	curve->ramp = ASUS_FAN_CURVE_RAMP;
+}
+
+static int asus_hwmon_pwm_read(struct asus_wmi *asus, long *pwm)
+{
+	int err;
+	int value;
+
+	/* If we already set a value then just return it */
+	value = READ_ONCE(asus->agfn_pwm);
+	if (value >= 0) {
+		*pwm = value;
+		return 0;
+	}
+
+	/*
+	 * If we haven't set already set a value through the AGFN interface,
+	 * we read a current value through the (now-deprecated) FAN_CTRL device.
+	 */
+	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_CTRL, &value);
+	if (err < 0)
+		return err;
+
+	value &= 0xFF;
+
+	if (value == 1) /* Low Speed */
+		value = 85;
+	else if (value == 2)
+		value = 170;
+	else if (value == 3)
+		value = 255;
+	else if (value) {
+		pr_err("Unknown fan speed %#x\n", value);
+		value = -1;
+	}
+
+	*pwm = value;
+	return 0;
+}
+
+static int asus_hwmon_pwm_write(struct asus_wmi *asus, long pwm)
+{
+	int value = clamp_val(pwm, 0, 255);
+	int state;
+
+	/* The curve work takes fan_lock, stop it before */
+	cancel_delayed_work_sync(&asus->fan_curve.work);
+
+	mutex_lock(&asus->fan_lock);
+	state = asus_agfn_fan_speed_write(asus, 1, &value);
+	if (state) {
+		pr_warn("Setting fan speed failed: %d\n", state);
+	} else {
+		asus->fan_pwm_mode = ASUS_FAN_CTRL_MANUAL;
+		asus_hwmon_invalidate(asus);
+	}
+	mutex_unlock(&asus->fan_lock);
+
+	return 0;
+}
+
+static int asus_hwmon_fan_read(struct asus_wmi *asus, int fan, long *rpm)
+{
+	int value;
+	int ret;
+
+	switch (asus->fan_type) {
+	case FAN_TYPE_SPEC83:
+		ret = asus_wmi_get_devstate(asus, fan ?
+					    ASUS_WMI_DEVID_GPU_FAN_CTRL :
+					    ASUS_WMI_DEVID_CPU_FAN_CTRL,
+					    &value);
+		if (ret < 0)
+			return ret;
+
+		value &= 0xffff;
+		break;
+
+	case FAN_TYPE_AGFN:
+		/* no speed readable on manual and curve mode */
+		if (asus->fan_pwm_mode != ASUS_FAN_CTRL_AUTO)
+			return -ENXIO;
+
+		ret = asus_agfn_fan_speed_read(asus, 1, &value);
+		if (ret) {
+			pr_warn("reading fan speed failed: %d\n", ret);
+			return -ENXIO;
+		}
+		break;
+
+	default:
+		return -ENXIO;
+	}
+
+	*rpm = value < 0 ? -1 : value * 100;
+	return 0;
+}
+
+static int asus_hwmon_pwm_enable_write(struct asus_wmi *asus, long state)
+{
+	int value = 0;
+	int ret = 0;
+	u32 retval;
+
+	if (asus->fan_type == FAN_TYPE_SPEC83) {
+		switch (state) { /* standard documented hwmon values */
+		case ASUS_FAN_CTRL_FULLSPEED:
+			value = 1;
+			break;
+		case ASUS_FAN_CTRL_AUTO:
+			value = 0;
+			break;
+		default:
+			return -EINVAL;
+		}
+	} else if (asus->fan_type == FAN_TYPE_AGFN) {
+		switch (state) {
+		case ASUS_FAN_CTRL_MANUAL:
+		case ASUS_FAN_CTRL_AUTO:
+			/* The curve work takes fan_lock, stop it before */
+			cancel_delayed_work_sync(&asus->fan_curve.work);
+			break;
+
+		case ASUS_FAN_CTRL_CURVE:
+			asus_fan_curve_start(asus);
+			return 0;
+
+		default:
+			return -EINVAL;
+		}
+	}
+
+	mutex_lock(&asus->fan_lock);
+	if (asus->fan_type == FAN_TYPE_SPEC83) {
+		ret = __asus_wmi_set_devstate(ASUS_WMI_DEVID_CPU_FAN_CTRL,
+					      value, &retval);
+		if (ret == -EINPROGRESS)
+			ret = 0;	/* replayed by the breaker */
+		else if (!ret && retval != 1)
+			ret = -EIO;
+	} else if (asus->fan_type == FAN_TYPE_AGFN &&
+		   state == ASUS_FAN_CTRL_AUTO) {
+		ret = asus_fan_set_auto(asus);
+	}
+
+	if (!ret) {
+		asus->fan_pwm_mode = state;
+		asus_hwmon_invalidate(asus);
+	}
+	mutex_unlock(&asus->fan_lock);
+
+	return ret;
+}
+
+static ssize_t fan1_label_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	return sprintf(buf, "%s\n", ASUS_CPU_FAN_DESC);
+}
+
+static ssize_t fan2_label_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	return sprintf(buf, "%s\n", ASUS_GPU_FAN_DESC);
+}
+
+static int asus_hwmon_temp_read(struct asus_wmi *asus, long *temp)
+{
+	u32 value;
+	int err;
+
+	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_THERMAL_CTRL, &value);
+	if (err < 0)
+		return err;
+
+	*temp = deci_kelvin_to_millicelsius(value & 0xFFFF);
+	return 0;
+}
+
+static int asus_hwmon_temp_channel(struct asus_wmi *asus, int channel,
+				   long *value)
+{
+	return asus_hwmon_temp_read(asus, value);
+}
+
+/*
+ * Limits are checked on every reading, which includes the ones of the
+ * telemetry sampler. Only crossings are notified, so pollers of the alarm
+ * attributes sleep until something happens.
+ */
+static bool asus_hwmon_limit_check(struct asus_hwmon_limit *limit,
+				   long value, bool below)
+{
+	bool alarm;
+	bool changed;
+
+	alarm = limit->limit && (below ? value < limit->limit :
+					 value >= limit->limit);
+	changed = alarm != limit->alarm;
+	limit->alarm = alarm;
+
+	return changed;
+}
+
+static void asus_hwmon_notify(struct asus_wmi *asus,
+			      enum hwmon_sensor_types type, u32 attr,
+			      int channel, const char *name)
+{
+	if (!asus->hwmon_dev)
+		return;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0))
+	hwmon_notify_event(asus->hwmon_dev, type, attr, channel);
+#else
+	sysfs_notify(&asus->hwmon_dev->kobj, NULL, name);
+#endif
+}
+
+static bool asus_hwmon_limits_set(struct asus_wmi *asus)
+{
+	return asus->hwmon_temp_max.limit || asus->hwmon_temp_crit.limit ||
+	       asus->hwmon_fan_min[0].limit || asus->hwmon_fan_min[1].limit;
+}
+
+static int asus_hwmon_read_fan(struct asus_wmi *asus, int fan, int *rpm)
+{
+	static const char * const names[] = {
+		"fan1_min_alarm", "fan2_min_alarm",
+	};
+	long value;
+	bool changed;
+	int err;
+
+	err = asus_hwmon_cached(asus, &asus->hwmon_fan[fan],
+				asus_hwmon_fan_read, fan, &value);
+	if (err)
+		return err;
+
+	mutex_lock(&asus->hwmon_lock);
+	changed = asus_hwmon_limit_check(&asus->hwmon_fan_min[fan], value,
+					 true);
+	mutex_unlock(&asus->hwmon_lock);
+
+	if (changed)
+		asus_hwmon_notify(asus, hwmon_fan, hwmon_fan_min_alarm, fan,
+				  names[fan]);
+
+	*rpm = value;
+	if (!fan)
+		kbbl_map_feed(asus, KBBL_MAP_FAN, *rpm);
+
+	return 0;
+}
+
+static int asus_hwmon_read_temp(struct asus_wmi *asus, long *temp)
+{
+	bool max_changed;
+	bool crit_changed;
+	int err;
+
+	err = asus_hwmon_cached(asus, &asus->hwmon_temp,
+				asus_hwmon_temp_channel, 0, temp);
+	if (err)
+		return err;
+
+	mutex_lock(&asus->hwmon_lock);
+	max_changed = asus_hwmon_limit_check(&asus->hwmon_temp_max, *temp,
+					     false);
+	crit_changed = asus_hwmon_limit_check(&asus->hwmon_temp_crit, *temp,
+					      false);
+	mutex_unlock(&asus->hwmon_lock);
+
+	if (max_changed)
+		asus_hwmon_notify(asus, hwmon_temp, hwmon_temp_max_alarm, 0,
+				  "temp1_max_alarm");
+	if (crit_changed)
+		asus_hwmon_notify(asus, hwmon_temp, hwmon_temp_crit_alarm, 0,
+				  "temp1_crit_alarm");
+
+	kbbl_map_feed(asus, KBBL_MAP_TEMP, *temp / 1000);
+	return 0;
+}
+
+static void asus_telemetry_wake(struct asus_telemetry *telemetry);
+
+static int asus_hwmon_limit_write(struct asus_wmi *asus,
+				  struct asus_hwmon_limit *limit, long value,
+				  long max)
+{
+	if (value < 0 || value > max)
+		return -EINVAL;
+
+	/* Without samples the alarm would never fire */
+	mutex_lock(&asus->hwmon_lock);
+	if (value && asus->telemetry.ring && !asus->telemetry.period) {
+		mutex_unlock(&asus->hwmon_lock);
+		return -EBUSY;
+	}
+	limit->limit = value;
+	mutex_unlock(&asus->hwmon_lock);
+
+	/* The sampler provides the readings, keep it at full speed */
+	if (asus->telemetry.ring)
+		asus_telemetry_wake(&asus->telemetry);
+
+	return 0;
+}
+
+static umode_t asus_hwmon_is_visible(const void *data,
+				     enum hwmon_sensor_types type,
+				     u32 attr, int channel)
+{
+	const struct asus_wmi *asus = data;
+	u32 value = ASUS_WMI_UNSUPPORTED_METHOD;
+	int err;
+
+	switch (type) {
+	case hwmon_chip:
+		return 0644;
+
+	case hwmon_fan:
+		if (asus->fan_type == FAN_TYPE_NONE)
+			return 0;
+		if (attr == hwmon_fan_min)
+			return 0644;
+		return 0444;
+
+	case hwmon_pwm:
+		if (attr == hwmon_pwm_input &&
+		    asus->fan_type != FAN_TYPE_AGFN)
+			return 0;
+		if (asus->fan_type == FAN_TYPE_NONE)
+			return 0;
+		return 0644;
+
+	case hwmon_temp:
+		err = asus_wmi_get_devstate((struct asus_wmi *)asus,
+					    ASUS_WMI_DEVID_THERMAL_CTRL,
+					    &value);
+		if (err < 0)
+			return 0; /* can't return negative here */
+
+		/*
+		 * If the temperature value in deci-Kelvin is near the absolute
+		 * zero temperature, something is clearly wrong
+		 */
+		if (value == 0 || value == 1)
+			return 0;
+		if (attr == hwmon_temp_max || attr == hwmon_temp_crit)
+			return 0644;
+		return 0444;
+
+	default:
+		return 0;
+	}
+}
+
+static int asus_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			   u32 attr, int channel, long *val)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	int value;
+	int err;
+
+	switch (type) {
+	case hwmon_chip:
+		*val = asus->hwmon_interval;
+		return 0;
+
+	case hwmon_fan:
+		if (attr == hwmon_fan_min) {
+			*val = asus->hwmon_fan_min[channel].limit;
+			return 0;
+		}
+
+		err = asus_hwmon_read_fan(asus, channel, &value);
+		if (err)
+			return err;
+
+		if (attr == hwmon_fan_min_alarm)
+			*val = asus->hwmon_fan_min[channel].alarm;
+		else
+			*val = value;
+		return 0;
+
+	case hwmon_pwm:
+		if (attr == hwmon_pwm_enable) {
+			/*
+			 * Just read back the cached pwm mode.
+			 *
+			 * For the CPU_FAN device, the spec indicates that we
+			 * should be able to read the device status and consult
+			 * bit 19 to see if we are in Full On or Automatic mode.
+			 * However, this does not work in practice on X532FL at
+			 * least (the bit is always 0) and there's also nothing
+			 * in the DSDT to indicate that this behaviour exists.
+			 */
+			*val = asus->fan_pwm_mode;
+			return 0;
+		}
+		return asus_hwmon_pwm_read(asus, val);
+
+	case hwmon_temp:
+		switch (attr) {
+		case hwmon_temp_max:
+			*val = asus->hwmon_temp_max.limit;
+			return 0;
+		case hwmon_temp_crit:
+			*val = asus->hwmon_temp_crit.limit;
+			return 0;
+		case hwmon_temp_max_alarm:
+			err = asus_hwmon_read_temp(asus, val);
+			*val = asus->hwmon_temp_max.alarm;
+			return err;
+		case hwmon_temp_crit_alarm:
+			err = asus_hwmon_read_temp(asus, val);
+			*val = asus->hwmon_temp_crit.alarm;
+			return err;
+		default:
+			return asus_hwmon_read_temp(asus, val);
+		}
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int asus_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+			    u32 attr, int channel, long val)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	switch (type) {
+	case hwmon_chip:
+		mutex_lock(&asus->hwmon_lock);
+		asus->hwmon_interval = clamp_val(val, 0,
+						 ASUS_HWMON_UPDATE_INTERVAL_MAX);
+		mutex_unlock(&asus->hwmon_lock);
+		return 0;
+
+	case hwmon_pwm:
+		if (attr == hwmon_pwm_enable)
+			return asus_hwmon_pwm_enable_write(asus, val);
+		return asus_hwmon_pwm_write(asus, val);
+
+	case hwmon_temp:
+		return asus_hwmon_limit_write(asus, attr == hwmon_temp_max ?
+					      &asus->hwmon_temp_max :
+					      &asus->hwmon_temp_crit,
+					      val, ASUS_HWMON_TEMP_LIMIT_MAX);
+
+	case hwmon_fan:
+		return asus_hwmon_limit_write(asus,
+					      &asus->hwmon_fan_min[channel],
+					      val, ASUS_HWMON_FAN_LIMIT_MAX);
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static ssize_t pwm1_auto_point_temp_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	int index = to_sensor_dev_attr(attr)->index;
+
+	return sprintf(buf, "%d\n", asus->fan_curve.temp[index]);
+}
+
+static ssize_t pwm1_auto_point_temp_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_fan_curve *curve = &asus->fan_curve;
+	int index = to_sensor_dev_attr(attr)->index;
+	int value;
+	int result;
+
+	result = kstrtoint(buf, 10, &value);
+	if (result)
+		return result;
+
+	if (value < 0 || value > ASUS_FAN_CURVE_TEMP_MAX)
+		return -EINVAL;
+
+	/* Points must stay in strictly ascending temperature order */
+	mutex_lock(&curve->lock);
+	if ((index > 0 && value <= curve->temp[index - 1]) ||
+	    (index < ASUS_FAN_CURVE_POINTS - 1 &&
+	     value >= curve->temp[index + 1]))
+		result = -EINVAL;
+	else
+		curve->temp[index] = value;
+	mutex_unlock(&curve->lock);
+
+	return result ? result : count;
+}
+
+static ssize_t pwm1_auto_point_pwm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	int index = to_sensor_dev_attr(attr)->index;
+
+	return sprintf(buf, "%u\n", asus->fan_curve.pwm[index]);
+}
+
+static ssize_t pwm1_auto_point_pwm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	int index = to_sensor_dev_attr(attr)->index;
+	u8 value;
+	int result;
+
+	result = kstrtou8(buf, 10, &value);
+	if (result)
+		return result;
+
+	mutex_lock(&asus->fan_curve.lock);
+	asus->fan_curve.pwm[index] = value;
+	mutex_unlock(&asus->fan_curve.lock);
+
+	return count;
+}
+
+static ssize_t pwm1_auto_temp_hyst_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", asus->fan_curve.hyst);
+}
+
+static ssize_t pwm1_auto_temp_hyst_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	int value;
+	int result;
+
+	result = kstrtoint(buf, 10, &value);
+	if (result)
+		return result;
+
+	if (value < 0 || value > ASUS_FAN_CURVE_HYST_MAX)
+		return -EINVAL;
+
+	mutex_lock(&asus->fan_curve.lock);
+	asus->fan_curve.hyst = value;
+	mutex_unlock(&asus->fan_curve.lock);
+
+	return count;
+}
+
+static ssize_t pwm1_auto_ramp_step_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", asus->fan_curve.ramp);
+}
+
+static ssize_t pwm1_auto_ramp_step_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	u8 value;
+	int result;
+
+	result = kstrtou8(buf, 10, &value);
+	if (result)
+		return result;
+
+	mutex_lock(&asus->fan_curve.lock);
+	asus->fan_curve.ramp = value;
+	mutex_unlock(&asus->fan_curve.lock);
+
+	return count;
+}
+
+/* Fan labels are fixed, so they are kept out of the chip description */
+static DEVICE_ATTR_RO(fan1_label);
+static DEVICE_ATTR_RO(fan2_label);
+
+/* Fan curve, temperatures in millidegree Celsius */
+#define ASUS_FAN_CURVE_POINT_ATTRS(_point, _index)			\
+	static SENSOR_DEVICE_ATTR(pwm1_auto_point##_point##_temp, 0644,	\
+				  pwm1_auto_point_temp_show,		\
+				  pwm1_auto_point_temp_store, _index);	\
+	static SENSOR_DEVICE_ATTR(pwm1_auto_point##_point##_pwm, 0644,	\
+				  pwm1_auto_point_pwm_show,		\
+				  pwm1_auto_point_pwm_store, _index)
+
+ASUS_FAN_CURVE_POINT_ATTRS(1, 0);
+ASUS_FAN_CURVE_POINT_ATTRS(2, 1);
+ASUS_FAN_CURVE_POINT_ATTRS(3, 2);
+ASUS_FAN_CURVE_POINT_ATTRS(4, 3);
+ASUS_FAN_CURVE_POINT_ATTRS(5, 4);
+ASUS_FAN_CURVE_POINT_ATTRS(6, 5);
+ASUS_FAN_CURVE_POINT_ATTRS(7, 6);
+ASUS_FAN_CURVE_POINT_ATTRS(8, 7);
+static DEVICE_ATTR_RW(pwm1_auto_temp_hyst);
+static DEVICE_ATTR_RW(pwm1_auto_ramp_step);
+
+#define ASUS_FAN_CURVE_POINT_ATTRS_LIST(_point)				\
+	&sensor_dev_attr_pwm1_auto_point##_point##_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm1_auto_point##_point##_pwm.dev_attr.attr
+
+static struct attribute *hwmon_attributes[] = {
+	&dev_attr_fan1_label.attr,
+	&dev_attr_fan2_label.attr,
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(1),
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(2),
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(3),
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(4),
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(5),
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(6),
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(7),
+	ASUS_FAN_CURVE_POINT_ATTRS_LIST(8),
+	&dev_attr_pwm1_auto_temp_hyst.attr,
+	&dev_attr_pwm1_auto_ramp_step.attr,
+	NULL
+};
+
+static umode_t asus_hwmon_sysfs_is_visible(struct kobject *kobj,
+					  struct attribute *attr, int idx)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	if (asus->fan_type == FAN_TYPE_NONE)
+		return 0;
+
+	/* Only the two labels are there without AGFN */
+	if (asus->fan_type != FAN_TYPE_AGFN && idx > 1)
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group hwmon_attribute_group = {
+	.is_visible = asus_hwmon_sysfs_is_visible,
+	.attrs = hwmon_attributes
+};
+__ATTRIBUTE_GROUPS(hwmon_attribute);
+
+#ifndef HWMON_CHANNEL_INFO
+#define HWMON_CHANNEL_INFO(stype, ...)		\
+	(&(struct hwmon_channel_info) {		\
+		.type = hwmon_##stype,		\
+		.config = (u32 []) {		\
+			__VA_ARGS__, 0		\
+		}				\
+	})
+#endif
+
+static const struct hwmon_channel_info *asus_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+	HWMON_CHANNEL_INFO(fan,
+			   HWMON_F_INPUT | HWMON_F_MIN | HWMON_F_MIN_ALARM,
+			   HWMON_F_INPUT | HWMON_F_MIN | HWMON_F_MIN_ALARM),
+	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_MAX | HWMON_T_MAX_ALARM |
+			   HWMON_T_CRIT | HWMON_T_CRIT_ALARM),
+	NULL
+};
+
+static const struct hwmon_ops asus_hwmon_ops = {
+	.is_visible = asus_hwmon_is_visible,
+	.read = asus_hwmon_read,
+	.write = asus_hwmon_write,
+};
+
+static const struct hwmon_chip_info asus_hwmon_chip_info = {
+	.ops = &asus_hwmon_ops,
+	.info = asus_hwmon_info,
+};
+
+static int asus_wmi_hwmon_init(struct asus_wmi *asus)
+{
+	struct device *dev = &asus->platform_device->dev;
+	struct device *hwmon;
+
+	mutex_init(&asus->hwmon_lock);
+	asus->hwmon_interval = ASUS_HWMON_UPDATE_INTERVAL;
+
+	hwmon = devm_hwmon_device_register_with_info(dev, "asus", asus,
+			&asus_hwmon_chip_info, hwmon_attribute_groups);
+
+	if (IS_ERR(hwmon)) {
+		pr_err("Could not register asus hwmon device\n");
+		return PTR_ERR(hwmon);
+	}
+
+	asus->hwmon_dev = hwmon;
+	return 0;
+}
+
+static int asus_wmi_fan_init(struct asus_wmi *asus)
+{
+	asus->fan_type = FAN_TYPE_NONE;
+	asus->agfn_pwm = -1;
+	asus_fan_curve_init(asus);
+
+	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_CPU_FAN_CTRL))
+		asus->fan_type = FAN_TYPE_SPEC83;
+	else if (asus_wmi_has_agfn_fan(asus))
+		asus->fan_type = FAN_TYPE_AGFN;
+	else
+		asus->fan_type = FAN_TYPE_SPEC83;
+	if (asus->fan_type == FAN_TYPE_NONE)
+		return -ENODEV;
+
+	mutex_lock(&asus->fan_lock);
+	asus_fan_set_auto(asus);
+	asus->fan_pwm_mode = ASUS_FAN_CTRL_AUTO;
+	mutex_unlock(&asus->fan_lock);
+	return 0;
+}
+
+/* Telemetry sampler **********************************************************/
+
+/*
+ * Fan and temperature history for dashboards. Samples are taken through the
+ * hwmon cache, so they never cost more BIOS calls than hwmon polling would.
+ */
+
+static void asus_telemetry_sample(struct asus_wmi *asus)
+{
+	struct asus_telemetry *telemetry = &asus->telemetry;
+	struct faustus_telemetry_sample sample = { 0 };
+	long temp;
+	int rpm;
+	int i;
+
+	sample.timestamp_ns = ktime_get_ns();
+
+	if (!asus_hwmon_read_temp(asus, &temp)) {
+		sample.temp = temp;
+		sample.valid |= FAUSTUS_TELEMETRY_TEMP;
+	}
+
+	for (i = 0; asus->fan_type != FAN_TYPE_NONE && i < 2; i++) {
+		if (asus_hwmon_read_fan(asus, i, &rpm) || rpm < 0)
+			continue;
+
+		sample.fan[i] = rpm;
+		sample.valid |= i ? FAUSTUS_TELEMETRY_FAN2 :
+				    FAUSTUS_TELEMETRY_FAN1;
+	}
+
+	mutex_lock(&telemetry->lock);
+	telemetry->ring[telemetry->head & (ASUS_TELEMETRY_SAMPLES - 1)] = sample;
+	telemetry->head++;
+	mutex_unlock(&telemetry->lock);
+
+	wake_up_interruptible(&telemetry->wait);
+}
+
+static void asus_telemetry_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, telemetry.work);
+	struct asus_telemetry *telemetry = &asus->telemetry;
+	unsigned long idle = msecs_to_jiffies(ASUS_TELEMETRY_IDLE);
+	unsigned int delay;
+
+	asus_telemetry_sample(asus);
+
+	/* Nobody looked at the history for a while, slow down */
+	mutex_lock(&telemetry->lock);
+	if (telemetry->readers || asus_hwmon_limits_set(asus) ||
+	    time_before(jiffies, telemetry->consumed + idle))
+		telemetry->delay = telemetry->period;
+	else
+		telemetry->delay = min(telemetry->delay * 2,
+				       (unsigned int)ASUS_TELEMETRY_PERIOD_MAX);
+	delay = telemetry->delay;
+	mutex_unlock(&telemetry->lock);
+
+	if (delay)
+		queue_delayed_work(system_wq, &telemetry->work,
+				   msecs_to_jiffies(delay));
+}
+
+/* Go back to the configured period right away after a backoff */
+static void asus_telemetry_wake(struct asus_telemetry *telemetry)
+{
+	bool backed_off;
+
+	mutex_lock(&telemetry->lock);
+	telemetry->consumed = jiffies;
+	backed_off = telemetry->delay != telemetry->period;
+	telemetry->delay = telemetry->period;
+	mutex_unlock(&telemetry->lock);
+
+	if (backed_off && telemetry->period)
+		mod_delayed_work(system_wq, &telemetry->work, 0);
+}
+
+struct asus_telemetry_reader {
+	struct asus_wmi *asus;
+	u64 cursor;	/* sequence number of the next sample to return */
+};
+
+static int asus_telemetry_open(struct inode *inode, struct file *file)
+{
+	struct asus_wmi *asus = container_of(file->private_data,
+					     struct asus_wmi,
+					     telemetry.miscdev);
+	struct asus_telemetry *telemetry = &asus->telemetry;
+	struct asus_telemetry_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	reader->asus = asus;
+
+	mutex_lock(&telemetry->lock);
+	if (telemetry->head > ASUS_TELEMETRY_SAMPLES)
+		reader->cursor = telemetry->head - ASUS_TELEMETRY_SAMPLES;
+	telemetry->readers++;
+	mutex_unlock(&telemetry->lock);
+
+	asus_telemetry_wake(telemetry);
+
+	file->private_data = reader;
+	return nonseekable_open(inode, file);
+}
+
+static int asus_telemetry_release(struct inode *inode, struct file *file)
+{
+	struct asus_telemetry_reader *reader = file->private_data;
+	struct asus_telemetry *telemetry = &reader->asus->telemetry;
+
+	mutex_lock(&telemetry->lock);
+	telemetry->readers--;
+	telemetry->consumed = jiffies;
+	mutex_unlock(&telemetry->lock);
+
+	kfree(reader);
+	return 0;
+}
+
+static ssize_t asus_telemetry_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct asus_telemetry_reader *reader = file->private_data;
+	struct asus_telemetry *telemetry = &reader->asus->telemetry;
+	struct faustus_telemetry_sample *sample;
+	size_t copied = 0;
+	int err = 0;
+
+	if (count < sizeof(*sample))
+		return -EINVAL;
+
+	mutex_lock(&telemetry->lock);
+	while (reader->cursor == telemetry->head) {
+		mutex_unlock(&telemetry->lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		err = wait_event_interruptible(telemetry->wait,
+				READ_ONCE(telemetry->head) != reader->cursor);
+		if (err)
+			return err;
+
+		mutex_lock(&telemetry->lock);
+	}
+
+	/* Samples older than the ring size have been overwritten */
+	if (telemetry->head - reader->cursor > ASUS_TELEMETRY_SAMPLES)
+		reader->cursor = telemetry->head - ASUS_TELEMETRY_SAMPLES;
+
+	while (reader->cursor != telemetry->head &&
+	       count - copied >= sizeof(*sample)) {
+		sample = &telemetry->ring[reader->cursor &
+					  (ASUS_TELEMETRY_SAMPLES - 1)];
+		if (copy_to_user(buf + copied, sample, sizeof(*sample))) {
+			err = -EFAULT;
+			break;
+		}
+
+		copied += sizeof(*sample);
+		reader->cursor++;
+	}
+	telemetry->consumed = jiffies;
+	mutex_unlock(&telemetry->lock);
+
+	return copied ? copied : err;
+}
+
+static __poll_t asus_telemetry_poll(struct file *file, poll_table *wait)
+{
+	struct asus_telemetry_reader *reader = file->private_data;
+	struct asus_telemetry *telemetry = &reader->asus->telemetry;
+
+	poll_wait(file, &telemetry->wait, wait);
+
+	if (READ_ONCE(telemetry->head) != reader->cursor)
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations asus_telemetry_fops = {
+	.owner = THIS_MODULE,
+	.open = asus_telemetry_open,
+	.release = asus_telemetry_release,
+	.read = asus_telemetry_read,
+	.poll = asus_telemetry_poll,
+};
+
+static ssize_t telemetry_period_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", asus->telemetry.period);
+}
+
+static ssize_t telemetry_period_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_telemetry *telemetry = &asus->telemetry;
+	unsigned int value;
+	int result;
+
+	result = kstrtouint(buf, 10, &value);
+	if (result)
+		return result;
+
+	if (value && (value < ASUS_TELEMETRY_PERIOD_MIN ||
+		      value > ASUS_TELEMETRY_PERIOD_MAX))
+		return -EINVAL;
+
+	/* The hwmon limits are checked on the samples, keep them coming */
+	mutex_lock(&asus->hwmon_lock);
+	if (!value && asus_hwmon_limits_set(asus)) {
+		mutex_unlock(&asus->hwmon_lock);
+		return -EBUSY;
+	}
+	mutex_lock(&telemetry->lock);
+	telemetry->period = value;
+	telemetry->delay = value;
+	telemetry->consumed = jiffies;
+	mutex_unlock(&telemetry->lock);
+	mutex_unlock(&asus->hwmon_lock);
+
+	if (value)
+		mod_delayed_work(system_wq, &telemetry->work, 0);
+	else
+		cancel_delayed_work_sync(&telemetry->work);
+
+	return count;
+}
+
+static ssize_t telemetry_delay_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", asus->telemetry.delay);
+}
+
+/* Sampling period in ms, 0 stops the sampler */
+static DEVICE_ATTR_RW(telemetry_period);
+
+/* Current sampling period in ms including the backoff */
+static DEVICE_ATTR_RO(telemetry_delay);
+
+static struct attribute *telemetry_sysfs_attributes[] = {
+	&dev_attr_telemetry_period.attr,
+	&dev_attr_telemetry_delay.attr,
+	NULL,
+};
+
+static const struct attribute_group telemetry_attribute_group = {
+	.name = "telemetry",
+	.attrs = telemetry_sysfs_attributes
+};
+
+/*
+ * All sensors and modes gathered in one pass under one timestamp. Sensors
+ * are read through the hwmon cache, so at most one BIOS call is made per
+ * sensor.
+ */
+static void asus_telemetry_snapshot(struct asus_wmi *asus,
+				    struct faustus_snapshot *snap)
+{
+	struct asus_state state;
+	long value;
+	int rpm;
+	int i;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->version = FAUSTUS_SNAPSHOT_VERSION;
+	snap->size = sizeof(*snap);
+	snap->timestamp_ns = ktime_get_ns();
+
+	if (!asus_hwmon_read_temp(asus, &value)) {
+		snap->temp = value;
+		snap->valid |= FAUSTUS_TELEMETRY_TEMP;
+	}
+
+	for (i = 0; asus->fan_type != FAN_TYPE_NONE && i < 2; i++) {
+		if (asus_hwmon_read_fan(asus, i, &rpm) || rpm < 0)
+			continue;
+
+		snap->fan[i] = rpm;
+		snap->valid |= i ? FAUSTUS_TELEMETRY_FAN2 :
+				   FAUSTUS_TELEMETRY_FAN1;
+	}
+
+	if (asus->fan_type == FAN_TYPE_AGFN &&
+	    !asus_hwmon_pwm_read(asus, &value) && value >= 0) {
+		snap->pwm = value;
+		snap->valid |= FAUSTUS_SNAPSHOT_PWM;
+	}
+
+	if (asus->fan_type != FAN_TYPE_NONE) {
+		snap->pwm_enable = asus->fan_pwm_mode;
+		snap->valid |= FAUSTUS_SNAPSHOT_PWM_ENABLE;
+	}
+
+	asus_state_read(asus, &state);
+
+	if (asus->fan_boost_mode_available) {
+		snap->fan_boost_mode = state.fan_boost_mode;
+		snap->valid |= FAUSTUS_SNAPSHOT_FAN_BOOST_MODE;
+	}
+
+	if (asus->throttle_thermal_policy_available) {
+		snap->throttle_thermal_policy =
+			state.throttle_thermal_policy_mode;
+		snap->valid |= FAUSTUS_SNAPSHOT_THERMAL_POLICY;
+	}
+}
+
+static ssize_t telemetry_snapshot_read(struct file *filp, struct kobject *kobj,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0))
+				       const struct bin_attribute *attr,
+#else
+				       struct bin_attribute *attr,
+#endif
+				       char *buf, loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct faustus_snapshot snap;
+
+	asus_telemetry_snapshot(asus, &snap);
+
+	return memory_read_from_buffer(buf, count, &off, &snap, sizeof(snap));
+}
+
+static struct bin_attribute bin_attr_telemetry_snapshot = {
+	.attr = { .name = "telemetry_snapshot", .mode = 0444 },
+	.size = sizeof(struct faustus_snapshot),
+	.read = telemetry_snapshot_read,
+};
+
+static int asus_wmi_telemetry_init(struct asus_wmi *asus)
+{
+	struct asus_telemetry *telemetry = &asus->telemetry;
+	int err;
+
+	telemetry->ring = kcalloc(ASUS_TELEMETRY_SAMPLES,
+				  sizeof(*telemetry->ring), GFP_KERNEL);
+	if (!telemetry->ring)
+		return -ENOMEM;
+
+	mutex_init(&telemetry->lock);
+	init_waitqueue_head(&telemetry->wait);
+	INIT_DELAYED_WORK(&telemetry->work, asus_telemetry_work);
+	telemetry->period = ASUS_TELEMETRY_PERIOD;
+	telemetry->delay = ASUS_TELEMETRY_PERIOD;
+	telemetry->consumed = jiffies;
+
+	telemetry->miscdev.minor = MISC_DYNAMIC_MINOR;
+	telemetry->miscdev.name = "faustus_telemetry";
+	telemetry->miscdev.fops = &asus_telemetry_fops;
+	telemetry->miscdev.parent = &asus->platform_device->dev;
+	err = misc_register(&telemetry->miscdev);
+	if (err)
+		goto error_misc;
+
+	err = sysfs_create_group(&asus->platform_device->dev.kobj,
+				 &telemetry_attribute_group);
+	if (err)
+		goto error_sysfs;
+
+	err = sysfs_create_bin_file(&asus->platform_device->dev.kobj,
+				    &bin_attr_telemetry_snapshot);
+	if (err)
+		goto error_snapshot;
+
+	queue_delayed_work(system_wq, &telemetry->work, 0);
+	return 0;
+
+error_snapshot:
+	sysfs_remove_group(&asus->platform_device->dev.kobj,
+			   &telemetry_attribute_group);
+error_sysfs:
+	misc_deregister(&telemetry->miscdev);
+error_misc:
+	kfree(telemetry->ring);
+	telemetry->ring = NULL;
+	return err;
+}
+
+static void asus_wmi_telemetry_exit(struct asus_wmi *asus)
+{
+	struct asus_telemetry *telemetry = &asus->telemetry;
+
+	if (!telemetry->ring)
+		return;
+
+	sysfs_remove_bin_file(&asus->platform_device->dev.kobj,
+			      &bin_attr_telemetry_snapshot);
+	sysfs_remove_group(&asus->platform_device->dev.kobj,
+			   &telemetry_attribute_group);
+	misc_deregister(&telemetry->miscdev);
+	telemetry->period = 0;
+	cancel_delayed_work_sync(&telemetry->work);
+	kfree(telemetry->ring);
+	telemetry->ring = NULL;
+}
+
+/* Mode residency *************************************************************/
+
+/*
+ * Time spent in each fan boost mode or thermal policy and how often it was
+ * entered from where, updated on every successful mode write. Monotonic time
+ * is used, so suspended time is not accounted to any mode.
+ */
+static void asus_mode_residency_init(struct asus_mode_residency *res, u8 mode)
+{
+	spin_lock_init(&res->lock);
+	res->mode = mode;
+	res->since = ktime_get_ns();
+}
+
+static void asus_mode_residency_update(struct asus_mode_residency *res,
+				       u8 mode, enum asus_mode_source source)
+{
+	u64 now = ktime_get_ns();
+
+	if (mode >= ASUS_MODE_COUNT)
+		return;
+
+	spin_lock(&res->lock);
+	res->time[res->mode] += now - res->since;
+	res->since = now;
+	if (mode != res->mode)
+		res->entries[mode][source]++;
+	res->mode = mode;
+	spin_unlock(&res->lock);
+}
+
+/*
+ * One line per mode: mode, ms, entries from hotkey, sysfs, driver and
+ * thermal framework
+ */
+static ssize_t asus_mode_residency_show(struct asus_mode_residency *res,
+					char *buf)
+{
+	u64 time[ASUS_MODE_COUNT];
+	unsigned long entries[ASUS_MODE_COUNT][ASUS_MODE_SRC_COUNT];
+	ssize_t len = 0;
+	int i;
+
+	spin_lock(&res->lock);
+	memcpy(time, res->time, sizeof(time));
+	memcpy(entries, res->entries, sizeof(entries));
+	time[res->mode] += ktime_get_ns() - res->since;
+	spin_unlock(&res->lock);
+
+	for (i = 0; i < ASUS_MODE_COUNT; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%d %llu %lu %lu %lu %lu\n", i,
+				 div_u64(time[i], NSEC_PER_MSEC),
+				 entries[i][ASUS_MODE_SRC_HOTKEY],
+				 entries[i][ASUS_MODE_SRC_SYSFS],
+				 entries[i][ASUS_MODE_SRC_DRIVER],
+				 entries[i][ASUS_MODE_SRC_THERMAL]);
+
+	return len;
+}
+
+/* Fan mode *******************************************************************/
+
+static int fan_boost_mode_check_present(struct asus_wmi *asus)
+{
+	u32 result;
+	int err;
+
+	asus->fan_boost_mode_available = false;
+
+	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_BOOST_MODE,
+				    &result);
+	if (err) {
+		if (err == -ENODEV)
+			return 0;
+		else
+			return err;
+	}
+
+	if ((result & ASUS_WMI_DSTS_PRESENCE_BIT) &&
+			(result & ASUS_FAN_BOOST_MODES_MASK)) {
+		asus->fan_boost_mode_available = true;
+		asus->fan_boost_mode_mask = result & ASUS_FAN_BOOST_MODES_MASK;
+		asus_mode_residency_init(&asus->fan_boost_mode_residency,
+					 asus->fan_boost_mode);
+	}
+
+	return 0;
+}
+
+/*
+ * Called with ctl_lock held. The mode is only published once the BIOS took
+ * it, -EINPROGRESS means the write waits behind an open breaker.
+ */
+static int fan_boost_mode_write(struct asus_wmi *asus, u8 value,
+				enum asus_mode_source source)
+{
+	int err;
+	u32 retval;
+
+	lockdep_assert_held(&asus->ctl_lock);
+
+	pr_info("Set fan boost mode: %u\n", value);
+	err = __asus_wmi_set_devstate(ASUS_WMI_DEVID_FAN_BOOST_MODE, value,
+				      &retval);
+	if (err == -EINPROGRESS) {
+		pr_info("Fan boost mode %u deferred\n", value);
+		return err;
+	}
+
+	if (err) {
+		pr_warn("Failed to set fan boost mode: %d\n", err);
+		return err;
+	}
+
+	if (retval != 1) {
+		pr_warn("Failed to set fan boost mode (retval): 0x%x\n",
+			retval);
+		return -EIO;
+	}
+
+	asus_state_publish(asus, asus->fan_boost_mode, value);
+	sysfs_notify(&asus->platform_device->dev.kobj, NULL,
+			"fan_boost_mode");
+
+	asus_mode_residency_update(&asus->fan_boost_mode_residency, value,
+				   source);
+
+	if (!asus->throttle_thermal_policy_available)
+		kbbl_map_feed(asus, KBBL_MAP_POLICY, value);
+
+	return 0;
+}
+
+static int fan_boost_mode_switch_next(struct asus_wmi *asus)
+{
+	u8 mask = asus->fan_boost_mode_mask;
+	u8 mode;
+	int err;
+
+	mutex_lock(&asus->ctl_lock);
+	mode = asus->fan_boost_mode;
+	if (mode == ASUS_FAN_BOOST_MODE_NORMAL) {
+		if (mask & ASUS_FAN_BOOST_MODE_OVERBOOST_MASK)
+			mode = ASUS_FAN_BOOST_MODE_OVERBOOST;
+		else if (mask & ASUS_FAN_BOOST_MODE_SILENT_MASK)
+			mode = ASUS_FAN_BOOST_MODE_SILENT;
+	} else if (mode == ASUS_FAN_BOOST_MODE_OVERBOOST) {
+		if (mask & ASUS_FAN_BOOST_MODE_SILENT_MASK)
+			mode = ASUS_FAN_BOOST_MODE_SILENT;
+		else
+			mode = ASUS_FAN_BOOST_MODE_NORMAL;
+	} else {
+		mode = ASUS_FAN_BOOST_MODE_NORMAL;
+	}
+
+	err = fan_boost_mode_write(asus, mode, ASUS_MODE_SRC_HOTKEY);
+	mutex_unlock(&asus->ctl_lock);
+
+	return err;
+}
+
+static ssize_t fan_boost_mode_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_state state;
+
+	asus_state_read(asus, &state);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", state.fan_boost_mode);
+}
+
+static ssize_t fan_boost_mode_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	u8 new_mode;
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	u8 mask = asus->fan_boost_mode_mask;
+
+	int successfully_converted = kstrtou8(buf, 10, &new_mode);
+	if (successfully_converted < 0) {
+		pr_warn("Trying to store invalid value\n");
+		return -EINVAL;
+	}
+
+	if (new_mode == ASUS_FAN_BOOST_MODE_OVERBOOST) {
+		if (!(mask & ASUS_FAN_BOOST_MODE_OVERBOOST_MASK))
+			return -EINVAL;
+	} else if (new_mode == ASUS_FAN_BOOST_MODE_SILENT) {
+		if (!(mask & ASUS_FAN_BOOST_MODE_SILENT_MASK))
+			return -EINVAL;
+	} else if (new_mode != ASUS_FAN_BOOST_MODE_NORMAL) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&asus->ctl_lock);
+	fan_boost_mode_write(asus, new_mode, ASUS_MODE_SRC_SYSFS);
+	mutex_unlock(&asus->ctl_lock);
+
+	return count;
+}
+
+static ssize_t fan_boost_mode_time_in_state_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return asus_mode_residency_show(&asus->fan_boost_mode_residency, buf);
+}
+
+// Fan boost mode: 0 - normal, 1 - overboost, 2 - silent
+static DEVICE_ATTR_RW(fan_boost_mode);
+static DEVICE_ATTR_RO(fan_boost_mode_time_in_state);
+
+/* Throttle thermal policy ****************************************************/
+
+static int throttle_thermal_policy_check_present(struct asus_wmi *asus)
+{
+	u32 result;
+	int err;
+
+	asus->throttle_thermal_policy_available = false;
+
+	err = asus_wmi_get_devstate(asus,
+				    ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY,
+				    &result);
+	if (err) {
+		if (err == -ENODEV)
+			return 0;
+		return err;
+	}
+
+	if (result & ASUS_WMI_DSTS_PRESENCE_BIT) {
+		asus->throttle_thermal_policy_available = true;
+		asus_mode_residency_init(&asus->throttle_thermal_policy_residency,
+					 asus->throttle_thermal_policy_mode);
 	}
 
 	return 0;
+}
 
-error_register:
-	asus->hotplug_slot.ops = NULL;
-	destroy_workqueue(asus->hotplug_workqueue);
-error_workqueue:
-	return ret;
+/* Called with ctl_lock held, published like fan_boost_mode_write() */
+static int throttle_thermal_policy_write(struct asus_wmi *asus, u8 value,
+					 enum asus_mode_source source)
+{
+	int err;
+	u32 retval;
+
+	lockdep_assert_held(&asus->ctl_lock);
+
+	err = __asus_wmi_set_devstate(ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY,
+				      value, &retval);
+	if (err == -EINPROGRESS) {
+		pr_info("Throttle thermal policy %u deferred\n", value);
+		return err;
+	}
+
+	if (err) {
+		pr_warn("Failed to set throttle thermal policy: %d\n", err);
+		return err;
+	}
+
+	if (retval != 1) {
+		pr_warn("Failed to set throttle thermal policy (retval): 0x%x\n",
+			retval);
+		return -EIO;
+	}
+
+	asus_state_publish(asus, asus->throttle_thermal_policy_mode, value);
+	sysfs_notify(&asus->platform_device->dev.kobj, NULL,
+			"throttle_thermal_policy");
+
+	asus_mode_residency_update(&asus->throttle_thermal_policy_residency,
+				   value, source);
+	kbbl_map_feed(asus, KBBL_MAP_POLICY, value);
+
+	return 0;
+}
+
+static int throttle_thermal_policy_set_default(struct asus_wmi *asus)
+{
+	int err;
+
+	if (!asus->throttle_thermal_policy_available)
+		return 0;
+
+	mutex_lock(&asus->ctl_lock);
+	err = throttle_thermal_policy_write(asus,
+					    ASUS_THROTTLE_THERMAL_POLICY_DEFAULT,
+					    ASUS_MODE_SRC_DRIVER);
+	mutex_unlock(&asus->ctl_lock);
+
+	return err;
+}
+
+static int throttle_thermal_policy_switch_next(struct asus_wmi *asus)
+{
+	u8 new_mode;
+	int err;
+
+	mutex_lock(&asus->ctl_lock);
+	new_mode = asus->throttle_thermal_policy_mode + 1;
+	if (new_mode > ASUS_THROTTLE_THERMAL_POLICY_SILENT)
+		new_mode = ASUS_THROTTLE_THERMAL_POLICY_DEFAULT;
+
+	err = throttle_thermal_policy_write(asus, new_mode,
+					    ASUS_MODE_SRC_HOTKEY);
+	mutex_unlock(&asus->ctl_lock);
+
+	return err;
+}
+
+static ssize_t throttle_thermal_policy_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_state state;
+
+	asus_state_read(asus, &state);
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			 state.throttle_thermal_policy_mode);
+}
+
+static ssize_t throttle_thermal_policy_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int result;
+	u8 new_mode;
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	result = kstrtou8(buf, 10, &new_mode);
+	if (result < 0)
+		return result;
+
+	if (new_mode > ASUS_THROTTLE_THERMAL_POLICY_SILENT)
+		return -EINVAL;
+
+	mutex_lock(&asus->ctl_lock);
+	throttle_thermal_policy_write(asus, new_mode, ASUS_MODE_SRC_SYSFS);
+	mutex_unlock(&asus->ctl_lock);
+
+	return count;
 }
 
+static ssize_t throttle_thermal_policy_time_in_state_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return asus_mode_residency_show(
+			&asus->throttle_thermal_policy_residency, buf);
+}
+
+// Throttle thermal policy: 0 - default, 1 - overboost, 2 - silent
+static DEVICE_ATTR_RW(throttle_thermal_policy);
+static DEVICE_ATTR_RO(throttle_thermal_policy_time_in_state);
+
+/* Performance levels *********************************************************/
+
 /*
- * Rfkill devices
+ * Fan boost modes and thermal policies ordered from the quietest to the
+ * fastest, so that they can be stepped through without caring about the
+ * mode numbering. Fan boost levels missing from fan_boost_mode_mask are
+ * skipped.
  */
-static int asus_rfkill_set(void *data, bool blocked)
+static const u8 asus_fan_boost_levels[] = {
+	ASUS_FAN_BOOST_MODE_SILENT,
+	ASUS_FAN_BOOST_MODE_NORMAL,
+	ASUS_FAN_BOOST_MODE_OVERBOOST,
+};
+
+static const u8 asus_thermal_policy_levels[] = {
+	ASUS_THROTTLE_THERMAL_POLICY_SILENT,
+	ASUS_THROTTLE_THERMAL_POLICY_DEFAULT,
+	ASUS_THROTTLE_THERMAL_POLICY_OVERBOOST,
+};
+
+static bool asus_perf_ctrl_available(struct asus_wmi *asus,
+				     enum asus_perf_ctrl ctrl)
 {
-	struct asus_rfkill *priv = data;
-	u32 ctrl_param = !blocked;
-	u32 dev_id = priv->dev_id;
+	if (ctrl == ASUS_PERF_THERMAL_POLICY)
+		return asus->throttle_thermal_policy_available;
 
-	/*
-	 * If the user bit is set, BIOS can't set and record the wlan status,
-	 * it will report the value read from id ASUS_WMI_DEVID_WLAN_LED
-	 * while we query the wlan status through WMI(ASUS_WMI_DEVID_WLAN).
-	 * So, we have to record wlan status in id ASUS_WMI_DEVID_WLAN_LED
-	 * while setting the wlan status through WMI.
-	 * This is also the behavior that windows app will do.
-	 */
-	if ((dev_id == ASUS_WMI_DEVID_WLAN) &&
-	     priv->asus->driver->wlan_ctrl_by_user)
-		dev_id = ASUS_WMI_DEVID_WLAN_LED;
+	return asus->fan_boost_mode_available;
+}
 
-	return asus_wmi_set_devstate(dev_id, ctrl_param, NULL);
+/* The control used by the hotkey, thermal policy wins if there are both */
+static enum asus_perf_ctrl asus_perf_ctrl_default(struct asus_wmi *asus)
+{
+	if (asus->throttle_thermal_policy_available)
+		return ASUS_PERF_THERMAL_POLICY;
+
+	return ASUS_PERF_FAN_BOOST;
 }
 
-static void asus_rfkill_query(struct rfkill *rfkill, void *data)
+/* Fill modes with the usable modes by level and return their count */
+static int asus_perf_levels(struct asus_wmi *asus, enum asus_perf_ctrl ctrl,
+			    u8 *modes)
 {
-	struct asus_rfkill *priv = data;
-	int result;
+	u8 mask = asus->fan_boost_mode_mask;
+	int count = 0;
+	int i;
 
-	result = asus_wmi_get_devstate_simple(priv->asus, priv->dev_id);
+	if (ctrl == ASUS_PERF_THERMAL_POLICY) {
+		memcpy(modes, asus_thermal_policy_levels,
+		       sizeof(asus_thermal_policy_levels));
+		return ARRAY_SIZE(asus_thermal_policy_levels);
+	}
 
-	if (result < 0)
-		return;
+	for (i = 0; i < ARRAY_SIZE(asus_fan_boost_levels); i++) {
+		u8 mode = asus_fan_boost_levels[i];
 
-	rfkill_set_sw_state(priv->rfkill, !result);
+		if ((mode == ASUS_FAN_BOOST_MODE_SILENT &&
+		     !(mask & ASUS_FAN_BOOST_MODE_SILENT_MASK)) ||
+		    (mode == ASUS_FAN_BOOST_MODE_OVERBOOST &&
+		     !(mask & ASUS_FAN_BOOST_MODE_OVERBOOST_MASK)))
+			continue;
+
+		modes[count++] = mode;
+	}
+
+	return count;
 }
 
-static int asus_rfkill_wlan_set(void *data, bool blocked)
+/* Level of a mode, -EINVAL if the mode is not usable on this machine */
+static int asus_perf_mode_level(struct asus_wmi *asus,
+				enum asus_perf_ctrl ctrl, int mode)
 {
-	struct asus_rfkill *priv = data;
-	struct asus_wmi *asus = priv->asus;
-	int ret;
+	u8 modes[ASUS_PERF_LEVELS_MAX];
+	int count;
+	int i;
 
-	/*
-	 * This handler is enabled only if hotplug is enabled.
-	 * In this case, the asus_wmi_set_devstate() will
-	 * trigger a wmi notification and we need to wait
-	 * this call to finish before being able to call
-	 * any wmi method
-	 */
-	mutex_lock(&asus->wmi_lock);
-	ret = asus_rfkill_set(data, blocked);
-	mutex_unlock(&asus->wmi_lock);
-	return ret;
+	count = asus_perf_levels(asus, ctrl, modes);
+	for (i = 0; i < count; i++) {
+		if (modes[i] == mode)
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static int asus_perf_level_get(struct asus_wmi *asus, enum asus_perf_ctrl ctrl)
+{
+	u8 mode;
+
+	mode = ctrl == ASUS_PERF_THERMAL_POLICY ?
+	       asus->throttle_thermal_policy_mode : asus->fan_boost_mode;
+
+	return asus_perf_mode_level(asus, ctrl, mode);
+}
+
+/* Set a mode by value like a sysfs write, 1 if it was already set */
+static int asus_perf_mode_set(struct asus_wmi *asus, enum asus_perf_ctrl ctrl,
+			      int mode)
+{
+	int err = 1;
+
+	if (!asus_perf_ctrl_available(asus, ctrl))
+		return -ENODEV;
+
+	if (asus_perf_mode_level(asus, ctrl, mode) < 0)
+		return -EINVAL;
+
+	mutex_lock(&asus->ctl_lock);
+	if (ctrl == ASUS_PERF_THERMAL_POLICY) {
+		if (asus->throttle_thermal_policy_mode != mode)
+			err = throttle_thermal_policy_write(asus, mode,
+							    ASUS_MODE_SRC_SYSFS);
+	} else if (asus->fan_boost_mode != mode) {
+		err = fan_boost_mode_write(asus, mode, ASUS_MODE_SRC_SYSFS);
+	}
+	mutex_unlock(&asus->ctl_lock);
+
+	return err;
+}
+
+static int asus_perf_level_set(struct asus_wmi *asus, enum asus_perf_ctrl ctrl,
+			       int level, enum asus_mode_source source)
+{
+	u8 modes[ASUS_PERF_LEVELS_MAX];
+	int count;
+
+	int err;
+
+	count = asus_perf_levels(asus, ctrl, modes);
+	if (level < 0 || level >= count)
+		return -EINVAL;
+
+	mutex_lock(&asus->ctl_lock);
+	if (ctrl == ASUS_PERF_THERMAL_POLICY)
+		err = throttle_thermal_policy_write(asus, modes[level], source);
+	else
+		err = fan_boost_mode_write(asus, modes[level], source);
+	mutex_unlock(&asus->ctl_lock);
+
+	return err;
+}
+
+/* Fastest level the thermal framework allows right now */
+static int asus_perf_level_cap(struct asus_wmi *asus, enum asus_perf_ctrl ctrl)
+{
+	u8 modes[ASUS_PERF_LEVELS_MAX];
+
+	return asus_perf_levels(asus, ctrl, modes) - 1 -
+	       READ_ONCE(asus->perf_cdev[ctrl].state);
+}
+
+/* Automatic performance level ************************************************/
+
+/*
+ * Opt-in governor raising the performance level to the fastest mode under
+ * sustained load and dropping it to the idle mode once the load is gone. The
+ * averaged load has to cross load_high or load_low (the band between them is
+ * the hysteresis), the mode is kept for at least dwell ms, and the fastest
+ * mode is left when the temperature reaches temp_max.
+ */
+
+/* Busy time of the online CPUs since the last call, in percent */
+static unsigned int asus_auto_policy_load(struct asus_auto_policy *policy)
+{
+	u64 idle = 0, wall = 0;
+	u64 cpu_idle, cpu_wall;
+	unsigned int load = 0;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		cpu_idle = get_cpu_idle_time_us(cpu, &cpu_wall);
+		if (cpu_idle == -1ULL) {
+			/* No NO_HZ idle accounting, use the tick statistics */
+			cpu_idle = div_u64(kcpustat_cpu(cpu).cpustat[CPUTIME_IDLE],
+					   NSEC_PER_USEC);
+			cpu_wall = div_u64(ktime_get_ns(), NSEC_PER_USEC);
+		}
+
+		idle += cpu_idle;
+		wall += cpu_wall;
+	}
+
+	if (wall > policy->wall_us && idle >= policy->idle_us &&
+	    wall - policy->wall_us >= idle - policy->idle_us)
+		load = 100 - div64_u64((idle - policy->idle_us) * 100,
+				       wall - policy->wall_us);
+
+	policy->idle_us = idle;
+	policy->wall_us = wall;
+
+	return load;
+}
+
+/* temp is negative if it could not be read */
+static int asus_auto_policy_target(struct asus_wmi *asus,
+				   struct asus_auto_policy *policy,
+				   enum asus_perf_ctrl ctrl, int level,
+				   long temp)
+{
+	u8 modes[ASUS_PERF_LEVELS_MAX];
+	int count;
+	int idle;
+	bool hot;
+	int i;
+
+	count = asus_perf_levels(asus, ctrl, modes);
+
+	/* The quietest mode or the default (normal) one */
+	idle = 0;
+	for (i = 0; policy->idle_default && i < count; i++) {
+		if (modes[i] == ASUS_FAN_BOOST_MODE_NORMAL ||
+		    modes[i] == ASUS_THROTTLE_THERMAL_POLICY_DEFAULT)
+			idle = i;
+	}
+
+	hot = temp >= 0 && temp >= policy->temp_max;
+
+	if (hot && level == count - 1)
+		return max(idle, count - 2);
+
+	if (policy->load >= policy->load_high && !hot)
+		return count - 1;
+
+	if (policy->load <= policy->load_low)
+		return idle;
+
+	return level;
+}
+
+static void asus_auto_policy_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, auto_policy.work);
+	struct asus_auto_policy *policy = &asus->auto_policy;
+	enum asus_perf_ctrl ctrl = asus_perf_ctrl_default(asus);
+	unsigned long dwell;
+	long temp;
+	int level;
+	int target;
+
+	/* Before the lock, the reading also feeds the RGB map */
+	if (asus_hwmon_read_temp(asus, &temp))
+		temp = -1;
+
+	mutex_lock(&policy->lock);
+	if (!policy->enabled)
+		goto out;
+
+	/* Exponential average over the last few samples */
+	policy->load = (policy->load * 3 + asus_auto_policy_load(policy)) / 4;
+
+	level = asus_perf_level_get(asus, ctrl);
+	target = asus_auto_policy_target(asus, policy, ctrl, level, temp);
+	target = min(target, asus_perf_level_cap(asus, ctrl));
+	dwell = msecs_to_jiffies(policy->dwell);
+
+	/* Boost leases take precedence, keep sampling until they are gone */
+	if (target != level && !READ_ONCE(asus->boost.active) &&
+	    time_after_eq(jiffies, policy->changed + dwell) &&
+	    !asus_perf_level_set(asus, ctrl, target, ASUS_MODE_SRC_DRIVER)) {
+		policy->changed = jiffies;
+		if (target > level)
+			policy->up++;
+		else
+			policy->down++;
+	}
+
+	queue_delayed_work(system_wq, &policy->work,
+			   msecs_to_jiffies(policy->interval));
+out:
+	mutex_unlock(&policy->lock);
+}
+
+#define ASUS_AUTO_POLICY_ATTR(_name, _min, _max)			\
+static ssize_t auto_policy_##_name##_show(struct device *dev,		\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct asus_wmi *asus = dev_get_drvdata(dev);			\
+									\
+	return sprintf(buf, "%d\n", (int)asus->auto_policy._name);	\
+}									\
+									\
+static ssize_t auto_policy_##_name##_store(struct device *dev,		\
+		struct device_attribute *attr, const char *buf,		\
+		size_t count)						\
+{									\
+	struct asus_wmi *asus = dev_get_drvdata(dev);			\
+	int value;							\
+	int result;							\
+									\
+	result = kstrtoint(buf, 10, &value);				\
+	if (result)							\
+		return result;						\
+									\
+	if (value < (_min) || value > (_max))				\
+		return -EINVAL;						\
+									\
+	mutex_lock(&asus->auto_policy.lock);				\
+	asus->auto_policy._name = value;				\
+	mutex_unlock(&asus->auto_policy.lock);				\
+									\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(auto_policy_##_name)
+
+/* Averaged CPU load in percent to switch to the fastest and the idle mode */
+ASUS_AUTO_POLICY_ATTR(load_high, 1, 100);
+ASUS_AUTO_POLICY_ATTR(load_low, 0, 99);
+/* Temperature in millidegree Celsius at which the fastest mode is left */
+ASUS_AUTO_POLICY_ATTR(temp_max, 0, 150000);
+/* Minimum time in ms between two transitions */
+ASUS_AUTO_POLICY_ATTR(dwell, 0, 3600000);
+/* Sampling period in ms */
+ASUS_AUTO_POLICY_ATTR(interval, 100, 60000);
+/* Idle mode: 0 - quietest, 1 - default */
+ASUS_AUTO_POLICY_ATTR(idle_default, 0, 1);
+
+static ssize_t auto_policy_enable_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", asus->auto_policy.enabled);
+}
+
+static ssize_t auto_policy_enable_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_auto_policy *policy = &asus->auto_policy;
+	bool enable;
+	int result;
+
+	result = kstrtobool(buf, &enable);
+	if (result)
+		return result;
+
+	mutex_lock(&policy->lock);
+	if (enable && !policy->enabled) {
+		/* Start from the current state without a stale average */
+		asus_auto_policy_load(policy);
+		policy->load = 0;
+		policy->changed = jiffies;
+		queue_delayed_work(system_wq, &policy->work,
+				   msecs_to_jiffies(policy->interval));
+	}
+	policy->enabled = enable;
+	mutex_unlock(&policy->lock);
+
+	if (!enable)
+		cancel_delayed_work_sync(&policy->work);
+
+	return count;
 }
 
-static const struct rfkill_ops asus_rfkill_wlan_ops = {
-	.set_block = asus_rfkill_wlan_set,
-	.query = asus_rfkill_query,
+static ssize_t auto_policy_transitions_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_auto_policy *policy = &asus->auto_policy;
+
+	return sprintf(buf, "up %lu\ndown %lu\nload %u\n", policy->up,
+		       policy->down, policy->load);
+}
+
+// Automatic performance level: 0 - off, 1 - on
+static DEVICE_ATTR_RW(auto_policy_enable);
+// Transitions made so far and the averaged load
+static DEVICE_ATTR_RO(auto_policy_transitions);
+
+static struct attribute *auto_policy_attributes[] = {
+	&dev_attr_auto_policy_enable.attr,
+	&dev_attr_auto_policy_load_high.attr,
+	&dev_attr_auto_policy_load_low.attr,
+	&dev_attr_auto_policy_temp_max.attr,
+	&dev_attr_auto_policy_dwell.attr,
+	&dev_attr_auto_policy_interval.attr,
+	&dev_attr_auto_policy_idle_default.attr,
+	&dev_attr_auto_policy_transitions.attr,
+	NULL
 };
 
-static const struct rfkill_ops asus_rfkill_ops = {
-	.set_block = asus_rfkill_set,
-	.query = asus_rfkill_query,
+static const struct attribute_group auto_policy_attribute_group = {
+	.name = "auto_policy",
+	.attrs = auto_policy_attributes
 };
 
-static int asus_new_rfkill(struct asus_wmi *asus,
-			   struct asus_rfkill *arfkill,
-			   const char *name, enum rfkill_type type, int dev_id)
+static int asus_wmi_auto_policy_init(struct asus_wmi *asus)
 {
-	int result = asus_wmi_get_devstate_simple(asus, dev_id);
-	struct rfkill **rfkill = &arfkill->rfkill;
+	struct asus_auto_policy *policy = &asus->auto_policy;
+	int err;
 
-	if (result < 0)
-		return result;
+	mutex_init(&policy->lock);
+	INIT_DELAYED_WORK(&policy->work, asus_auto_policy_work);
+	policy->load_high = ASUS_AUTO_POLICY_LOAD_HIGH;
+	policy->load_low = ASUS_AUTO_POLICY_LOAD_LOW;
+	policy->temp_max = ASUS_AUTO_POLICY_TEMP_MAX;
+	policy->dwell = ASUS_AUTO_POLICY_DWELL;
+	policy->interval = ASUS_AUTO_POLICY_INTERVAL;
+	policy->idle_default = 1;
+
+	if (!asus->fan_boost_mode_available &&
+	    !asus->throttle_thermal_policy_available)
+		return 0;
 
-	arfkill->dev_id = dev_id;
-	arfkill->asus = asus;
+	err = sysfs_create_group(&asus->platform_device->dev.kobj,
+				 &auto_policy_attribute_group);
+	if (!err)
+		policy->available = true;
 
-	if (dev_id == ASUS_WMI_DEVID_WLAN &&
-	    asus->driver->quirks->hotplug_wireless)
-		*rfkill = rfkill_alloc(name, &asus->platform_device->dev, type,
-				       &asus_rfkill_wlan_ops, arfkill);
-	else
-		*rfkill = rfkill_alloc(name, &asus->platform_device->dev, type,
-				       &asus_rfkill_ops, arfkill);
+	return err;
+}
 
-	if (!*rfkill)
-		return -EINVAL;
+static void asus_wmi_auto_policy_exit(struct asus_wmi *asus)
+{
+	struct asus_auto_policy *policy = &asus->auto_policy;
 
-	if ((dev_id == ASUS_WMI_DEVID_WLAN) &&
-			(asus->driver->quirks->wapf > 0))
-		rfkill_set_led_trigger_name(*rfkill, "asus-wlan");
+	if (!policy->available)
+		return;
 
-	rfkill_init_sw_state(*rfkill, !result);
-	result = rfkill_register(*rfkill);
-	if (result) {
-		rfkill_destroy(*rfkill);
-		*rfkill = NULL;
-		return result;
+	sysfs_remove_group(&asus->platform_device->dev.kobj,
+			   &auto_policy_attribute_group);
+	policy->enabled = false;
+	cancel_delayed_work_sync(&policy->work);
+	policy->available = false;
+}
+
+/* Performance boost leases ***************************************************/
+
+/*
+ * Clients of /dev/faustus_boost ask for a minimum mode, optionally for a
+ * limited time. The fastest requested mode is applied while any lease is
+ * active and the mode from before the first lease is restored after the last
+ * one expired or its descriptor was closed.
+ */
+struct asus_boost_lease {
+	struct list_head list;	/* on asus_boost.leases while active */
+	struct asus_wmi *asus;
+	pid_t tgid;
+	char comm[TASK_COMM_LEN];
+	u32 mode;		/* FAUSTUS_BOOST_MODE_* */
+	bool timed;
+	unsigned long expires;	/* jiffies */
+};
+
+/* Rank of a mode on the FAUSTUS_BOOST_MODE_* scale */
+static u32 asus_boost_rank(u8 mode)
+{
+	switch (mode) {
+	case ASUS_FAN_BOOST_MODE_SILENT:
+		return FAUSTUS_BOOST_MODE_SILENT;
+	case ASUS_FAN_BOOST_MODE_OVERBOOST:
+		return FAUSTUS_BOOST_MODE_OVERBOOST;
+	default:
+		return FAUSTUS_BOOST_MODE_DEFAULT;
 	}
-	return 0;
 }
 
-static void asus_wmi_rfkill_exit(struct asus_wmi *asus)
+/* The slowest level at least as fast as the requested mode */
+static int asus_boost_level(struct asus_wmi *asus, enum asus_perf_ctrl ctrl,
+			    u32 mode)
 {
-	if (asus->driver->wlan_ctrl_by_user && ashs_present())
-		return;
+	u8 modes[ASUS_PERF_LEVELS_MAX];
+	int count;
+	int i;
 
-	asus_unregister_rfkill_notifier(asus, "\\_SB.PCI0.P0P5");
-	asus_unregister_rfkill_notifier(asus, "\\_SB.PCI0.P0P6");
-	asus_unregister_rfkill_notifier(asus, "\\_SB.PCI0.P0P7");
-	if (asus->wlan.rfkill) {
-		rfkill_unregister(asus->wlan.rfkill);
-		rfkill_destroy(asus->wlan.rfkill);
-		asus->wlan.rfkill = NULL;
+	count = asus_perf_levels(asus, ctrl, modes);
+	for (i = 0; i < count; i++) {
+		if (asus_boost_rank(modes[i]) >= mode)
+			return i;
 	}
-	/*
-	 * Refresh pci hotplug in case the rfkill state was changed after
-	 * asus_unregister_rfkill_notifier()
-	 */
-	asus_rfkill_hotplug(asus);
-	if (asus->hotplug_slot.ops)
-		pci_hp_deregister(&asus->hotplug_slot);
-	if (asus->hotplug_workqueue)
-		destroy_workqueue(asus->hotplug_workqueue);
 
-	if (asus->bluetooth.rfkill) {
-		rfkill_unregister(asus->bluetooth.rfkill);
-		rfkill_destroy(asus->bluetooth.rfkill);
-		asus->bluetooth.rfkill = NULL;
-	}
-	if (asus->wimax.rfkill) {
-		rfkill_unregister(asus->wimax.rfkill);
-		rfkill_destroy(asus->wimax.rfkill);
-		asus->wimax.rfkill = NULL;
-	}
-	if (asus->wwan3g.rfkill) {
-		rfkill_unregister(asus->wwan3g.rfkill);
-		rfkill_destroy(asus->wwan3g.rfkill);
-		asus->wwan3g.rfkill = NULL;
-	}
-	if (asus->gps.rfkill) {
-		rfkill_unregister(asus->gps.rfkill);
-		rfkill_destroy(asus->gps.rfkill);
-		asus->gps.rfkill = NULL;
-	}
-	if (asus->uwb.rfkill) {
-		rfkill_unregister(asus->uwb.rfkill);
-		rfkill_destroy(asus->uwb.rfkill);
-		asus->uwb.rfkill = NULL;
-	}
+	return count - 1;
 }
 
-static int asus_wmi_rfkill_init(struct asus_wmi *asus)
+/* Drop expired leases and apply what the remaining ones ask for */
+static void asus_boost_update(struct asus_wmi *asus)
 {
-	int result = 0;
+	struct asus_boost *boost = &asus->boost;
+	enum asus_perf_ctrl ctrl = asus_perf_ctrl_default(asus);
+	struct asus_boost_lease *lease, *tmp;
+	unsigned long next = 0;
+	bool timed = false;
+	int target = -1;
+	int level;
 
-	mutex_init(&asus->hotplug_lock);
-	mutex_init(&asus->wmi_lock);
+	lockdep_assert_held(&boost->lock);
 
-	result = asus_new_rfkill(asus, &asus->wlan, "asus-wlan",
-				 RFKILL_TYPE_WLAN, ASUS_WMI_DEVID_WLAN);
+	list_for_each_entry_safe(lease, tmp, &boost->leases, list) {
+		if (lease->timed && time_after_eq(jiffies, lease->expires)) {
+			list_del_init(&lease->list);
+			continue;
+		}
 
-	if (result && result != -ENODEV)
-		goto exit;
+		if (lease->timed && (!timed || time_before(lease->expires, next))) {
+			next = lease->expires;
+			timed = true;
+		}
 
-	result = asus_new_rfkill(asus, &asus->bluetooth,
-				 "asus-bluetooth", RFKILL_TYPE_BLUETOOTH,
-				 ASUS_WMI_DEVID_BLUETOOTH);
+		target = max(target, asus_boost_level(asus, ctrl, lease->mode));
+	}
 
-	if (result && result != -ENODEV)
-		goto exit;
+	level = asus_perf_level_get(asus, ctrl);
 
-	result = asus_new_rfkill(asus, &asus->wimax, "asus-wimax",
-				 RFKILL_TYPE_WIMAX, ASUS_WMI_DEVID_WIMAX);
+	if (target < 0) {
+		if (boost->active && level != boost->baseline)
+			asus_perf_level_set(asus, ctrl, boost->baseline,
+					    ASUS_MODE_SRC_DRIVER);
+		boost->active = false;
+		return;
+	}
 
-	if (result && result != -ENODEV)
-		goto exit;
+	if (!boost->active) {
+		boost->baseline = level;
+		boost->active = true;
+	}
 
-	result = asus_new_rfkill(asus, &asus->wwan3g, "asus-wwan3g",
-				 RFKILL_TYPE_WWAN, ASUS_WMI_DEVID_WWAN3G);
+	/* A lease never makes things slower than they were */
+	target = max(target, boost->baseline);
+	if (target != level)
+		asus_perf_level_set(asus, ctrl, target, ASUS_MODE_SRC_DRIVER);
 
-	if (result && result != -ENODEV)
-		goto exit;
+	if (timed)
+		mod_delayed_work(system_wq, &boost->expiry,
+				 time_after(next, jiffies) ? next - jiffies : 0);
+}
 
-	result = asus_new_rfkill(asus, &asus->gps, "asus-gps",
-				 RFKILL_TYPE_GPS, ASUS_WMI_DEVID_GPS);
+/*
+ * Level change for the default control on behalf of the power profiles or
+ * the thermal framework. During a boost lease the level becomes the one
+ * restored after it, and the lease floor stays in effect. Only the thermal
+ * framework may go faster than it allows. Returns 0 if the level or the
+ * baseline was changed, 1 if they were already set.
+ */
+static int asus_perf_level_request(struct asus_wmi *asus, int level,
+				   enum asus_mode_source source)
+{
+	enum asus_perf_ctrl ctrl = asus_perf_ctrl_default(asus);
+	struct asus_boost *boost = &asus->boost;
+	int err = 1;
+
+	if (source != ASUS_MODE_SRC_THERMAL)
+		level = min(level, asus_perf_level_cap(asus, ctrl));
+
+	mutex_lock(&boost->lock);
+	if (boost->active) {
+		if (boost->baseline != level)
+			err = 0;
+		boost->baseline = level;
+		asus_boost_update(asus);
+	} else if (asus_perf_level_get(asus, ctrl) != level) {
+		err = asus_perf_level_set(asus, ctrl, level, source);
+	}
+	mutex_unlock(&boost->lock);
 
-	if (result && result != -ENODEV)
-		goto exit;
+	return err;
+}
 
-	result = asus_new_rfkill(asus, &asus->uwb, "asus-uwb",
-				 RFKILL_TYPE_UWB, ASUS_WMI_DEVID_UWB);
+static void asus_boost_expiry_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(to_delayed_work(work),
+					     struct asus_wmi, boost.expiry);
 
-	if (result && result != -ENODEV)
-		goto exit;
+	mutex_lock(&asus->boost.lock);
+	asus_boost_update(asus);
+	mutex_unlock(&asus->boost.lock);
+}
 
-	if (!asus->driver->quirks->hotplug_wireless)
-		goto exit;
+static int asus_boost_open(struct inode *inode, struct file *file)
+{
+	struct asus_wmi *asus = container_of(file->private_data,
+					     struct asus_wmi, boost.miscdev);
+	struct asus_boost_lease *lease;
 
-	result = asus_setup_pci_hotplug(asus);
-	/*
-	 * If we get -EBUSY then something else is handling the PCI hotplug -
-	 * don't fail in this case
-	 */
-	if (result == -EBUSY)
-		result = 0;
+	lease = kzalloc(sizeof(*lease), GFP_KERNEL);
+	if (!lease)
+		return -ENOMEM;
 
-	asus_register_rfkill_notifier(asus, "\\_SB.PCI0.P0P5");
-	asus_register_rfkill_notifier(asus, "\\_SB.PCI0.P0P6");
-	asus_register_rfkill_notifier(asus, "\\_SB.PCI0.P0P7");
-	/*
-	 * Refresh pci hotplug in case the rfkill state was changed during
-	 * setup.
-	 */
-	asus_rfkill_hotplug(asus);
+	INIT_LIST_HEAD(&lease->list);
+	lease->asus = asus;
 
-exit:
-	if (result && result != -ENODEV)
-		asus_wmi_rfkill_exit(asus);
+	file->private_data = lease;
+	return nonseekable_open(inode, file);
+}
 
-	if (result == -ENODEV)
-		result = 0;
+static int asus_boost_release(struct inode *inode, struct file *file)
+{
+	struct asus_boost_lease *lease = file->private_data;
+	struct asus_boost *boost = &lease->asus->boost;
 
-	return result;
-}
+	mutex_lock(&boost->lock);
+	if (!list_empty(&lease->list)) {
+		list_del(&lease->list);
+		asus_boost_update(lease->asus);
+	}
+	mutex_unlock(&boost->lock);
 
-/* Quirks *********************************************************************/
+	kfree(lease);
+	return 0;
+}
 
-static void asus_wmi_set_xusb2pr(struct asus_wmi *asus)
+static long asus_boost_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
 {
-	struct pci_dev *xhci_pdev;
-	u32 orig_ports_available;
-	u32 ports_available = asus->driver->quirks->xusb2pr;
+	struct asus_boost_lease *lease = file->private_data;
+	struct asus_boost *boost = &lease->asus->boost;
+	struct faustus_boost_request request;
 
-	xhci_pdev = pci_get_device(PCI_VENDOR_ID_INTEL,
-			PCI_DEVICE_ID_INTEL_LYNXPOINT_LP_XHCI,
-			NULL);
+	switch (cmd) {
+	case FAUSTUS_BOOST_IOC_REQUEST:
+		if (copy_from_user(&request, (void __user *)arg,
+				   sizeof(request)))
+			return -EFAULT;
 
-	if (!xhci_pdev)
-		return;
+		if (request.mode > FAUSTUS_BOOST_MODE_OVERBOOST)
+			return -EINVAL;
 
-	pci_read_config_dword(xhci_pdev, USB_INTEL_XUSB2PR,
-				&orig_ports_available);
+		mutex_lock(&boost->lock);
+		lease->mode = request.mode;
+		lease->timed = request.timeout_ms != 0;
+		lease->expires = jiffies + msecs_to_jiffies(request.timeout_ms);
+		lease->tgid = task_tgid_nr(current);
+		get_task_comm(lease->comm, current);
+		if (list_empty(&lease->list))
+			list_add_tail(&lease->list, &boost->leases);
+		asus_boost_update(lease->asus);
+		mutex_unlock(&boost->lock);
+		return 0;
 
-	pci_write_config_dword(xhci_pdev, USB_INTEL_XUSB2PR,
-				cpu_to_le32(ports_available));
+	case FAUSTUS_BOOST_IOC_CANCEL:
+		mutex_lock(&boost->lock);
+		if (!list_empty(&lease->list)) {
+			list_del_init(&lease->list);
+			asus_boost_update(lease->asus);
+		}
+		mutex_unlock(&boost->lock);
+		return 0;
 
-	pr_info("set USB_INTEL_XUSB2PR old: 0x%04x, new: 0x%04x\n",
-			orig_ports_available, ports_available);
+	default:
+		return -ENOTTY;
+	}
 }
 
-/*
- * Some devices dont support or have borcken get_als method
- * but still support set method.
- */
-static void asus_wmi_set_als(void)
+static const struct file_operations asus_boost_fops = {
+	.owner = THIS_MODULE,
+	.open = asus_boost_open,
+	.release = asus_boost_release,
+	.unlocked_ioctl = asus_boost_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static ssize_t boost_leases_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_ALS_ENABLE, 1, NULL);
-}
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_boost *boost = &asus->boost;
+	struct asus_boost_lease *lease;
+	ssize_t len = 0;
+
+	mutex_lock(&boost->lock);
+	list_for_each_entry(lease, &boost->leases, list) {
+		if (!lease->timed)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%d %s %u -\n", lease->tgid,
+					 lease->comm, lease->mode);
+		else
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%d %s %u %u\n", lease->tgid,
+					 lease->comm, lease->mode,
+					 time_after(lease->expires, jiffies) ?
+					 jiffies_to_msecs(lease->expires -
+							  jiffies) : 0);
+	}
+	mutex_unlock(&boost->lock);
 
-/* Hwmon device ***************************************************************/
+	return len;
+}
 
-static int asus_agfn_fan_speed_read(struct asus_wmi *asus, int fan,
-					  int *speed)
-{
-	struct agfn_fan_args args = {
-		.agfn.len = sizeof(args),
-		.agfn.mfun = ASUS_FAN_MFUN,
-		.agfn.sfun = ASUS_FAN_SFUN_READ,
-		.fan = fan,
-		.speed = 0,
-	};
-	struct acpi_buffer input = { (acpi_size) sizeof(args), &args };
-	int status;
+// Active leases: pid, command, mode (0 - silent, 1 - default, 2 - overboost), ms left
+static DEVICE_ATTR_RO(boost_leases);
 
-	if (fan != 1)
-		return -EINVAL;
+static struct attribute *boost_attributes[] = {
+	&dev_attr_boost_leases.attr,
+	NULL
+};
 
-	status = asus_wmi_evaluate_method_agfn(input);
+static const struct attribute_group boost_attribute_group = {
+	.attrs = boost_attributes
+};
 
-	if (status || args.agfn.err)
-		return -ENXIO;
+static int asus_wmi_boost_init(struct asus_wmi *asus)
+{
+	struct asus_boost *boost = &asus->boost;
+	int err;
 
-	if (speed)
-		*speed = args.speed;
+	mutex_init(&boost->lock);
+	INIT_LIST_HEAD(&boost->leases);
+	INIT_DELAYED_WORK(&boost->expiry, asus_boost_expiry_work);
 
-	return 0;
-}
+	if (!asus->fan_boost_mode_available &&
+	    !asus->throttle_thermal_policy_available)
+		return 0;
 
-static int asus_agfn_fan_speed_write(struct asus_wmi *asus, int fan,
-				     int *speed)
-{
-	struct agfn_fan_args args = {
-		.agfn.len = sizeof(args),
-		.agfn.mfun = ASUS_FAN_MFUN,
-		.agfn.sfun = ASUS_FAN_SFUN_WRITE,
-		.fan = fan,
-		.speed = speed ?  *speed : 0,
-	};
-	struct acpi_buffer input = { (acpi_size) sizeof(args), &args };
-	int status;
+	boost->miscdev.minor = MISC_DYNAMIC_MINOR;
+	boost->miscdev.name = "faustus_boost";
+	boost->miscdev.fops = &asus_boost_fops;
+	boost->miscdev.parent = &asus->platform_device->dev;
+	err = misc_register(&boost->miscdev);
+	if (err)
+		return err;
 
-	/* 1: for setting 1st fan's speed 0: setting auto mode */
-	if (fan != 1 && fan != 0)
-		return -EINVAL;
+	err = sysfs_create_group(&asus->platform_device->dev.kobj,
+				 &boost_attribute_group);
+	if (err) {
+		misc_deregister(&boost->miscdev);
+		return err;
+	}
 
-	status = asus_wmi_evaluate_method_agfn(input);
+	boost->available = true;
+	return 0;
+}
 
-	if (status || args.agfn.err)
-		return -ENXIO;
+static void asus_wmi_boost_exit(struct asus_wmi *asus)
+{
+	struct asus_boost *boost = &asus->boost;
 
-	if (speed && fan == 1)
-		asus->agfn_pwm = *speed;
+	if (!boost->available)
+		return;
 
-	return 0;
+	sysfs_remove_group(&asus->platform_device->dev.kobj,
+			   &boost_attribute_group);
+	misc_deregister(&boost->miscdev);
+	cancel_delayed_work_sync(&boost->expiry);
+	boost->available = false;
 }
 
+/* Power source profiles ****************************************************/
+
 /*
- * Check if we can read the speed of one fan. If true we assume we can also
- * control it.
+ * The BIOS reports the charger being plugged and unplugged with events 0x57
+ * and 0x58. With profiles enabled, the profile of the new power source is
+ * applied in one pass and only the settings that differ are written.
  */
-static bool asus_wmi_has_agfn_fan(struct asus_wmi *asus)
-{
-	int status;
-	int speed;
-	u32 value;
 
-	status = asus_agfn_fan_speed_read(asus, 1, &speed);
-	if (status != 0)
-		return false;
+static int asus_power_profile_mode_level(struct asus_wmi *asus, int mode)
+{
+	enum asus_perf_ctrl ctrl = asus_perf_ctrl_default(asus);
 
-	status = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_CTRL, &value);
-	if (status != 0)
-		return false;
+	if (!asus_perf_ctrl_available(asus, ctrl))
+		return -ENODEV;
 
-	/*
-	 * We need to find a better way, probably using sfun,
-	 * bits or spec ...
-	 * Currently we disable it if:
-	 * - ASUS_WMI_UNSUPPORTED_METHOD is returned
-	 * - reverved bits are non-zero
-	 * - sfun and presence bit are not set
-	 */
-	return !(value == ASUS_WMI_UNSUPPORTED_METHOD || value & 0xFFF80000
-		 || (!asus->sfun && !(value & ASUS_WMI_DSTS_PRESENCE_BIT)));
+	return asus_perf_mode_level(asus, ctrl, mode);
 }
 
-static int asus_fan_set_auto(struct asus_wmi *asus)
+static void asus_power_profile_work(struct work_struct *work)
 {
-	int status;
-	u32 retval;
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     power_profiles.work);
+	struct asus_power_profiles *profiles = &asus->power_profiles;
+	struct asus_power_profile *profile;
+	int writes = 0, skipped = 0;
+	int level;
 
-	switch (asus->fan_type) {
-	case FAN_TYPE_SPEC83:
-		status = asus_wmi_set_devstate(ASUS_WMI_DEVID_CPU_FAN_CTRL,
-					       0, &retval);
-		if (status)
-			return status;
+	mutex_lock(&profiles->lock);
+	if (!profiles->enabled)
+		goto out;
 
-		if (retval != 1)
-			return -EIO;
-		break;
+	profile = &profiles->profile[profiles->source];
 
-	case FAN_TYPE_AGFN:
-		status = asus_agfn_fan_speed_write(asus, 0, NULL);
-		if (status)
-			return -ENXIO;
-		break;
+	if (profile->mode >= 0) {
+		level = asus_power_profile_mode_level(asus, profile->mode);
+		if (level >= 0 &&
+		    !asus_perf_level_request(asus, level, ASUS_MODE_SRC_DRIVER))
+			writes++;
+		else
+			skipped++;
+	}
 
-	default:
-		return -ENXIO;
+	if (profile->kbd >= 0 && !IS_ERR_OR_NULL(asus->kbd_led.dev)) {
+		if (asus_kbd_led_set_policy(asus, profile->kbd))
+			writes++;
+		else
+			skipped++;
 	}
 
+	if (profile->rgb >= 0) {
+		if (kbbl_rgb_set_dark(asus, KBBL_DARK_PROFILE, !profile->rgb))
+			writes++;
+		else
+			skipped++;
+	}
 
-	return 0;
+	profiles->writes += writes;
+	profiles->skipped += skipped;
+out:
+	mutex_unlock(&profiles->lock);
 }
 
-static ssize_t pwm1_show(struct device *dev,
-			       struct device_attribute *attr,
-			       char *buf)
+static void asus_power_profile_notify(struct asus_wmi *asus,
+				      enum asus_power_source source)
 {
-	struct asus_wmi *asus = dev_get_drvdata(dev);
-	int err;
-	int value;
+	struct asus_power_profiles *profiles = &asus->power_profiles;
 
-	/* If we already set a value then just return it */
-	if (asus->agfn_pwm >= 0)
-		return sprintf(buf, "%d\n", asus->agfn_pwm);
+	if (!READ_ONCE(profiles->enabled))
+		return;
 
-	/*
-	 * If we haven't set already set a value through the AGFN interface,
-	 * we read a current value through the (now-deprecated) FAN_CTRL device.
-	 */
-	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_CTRL, &value);
-	if (err < 0)
-		return err;
+	WRITE_ONCE(profiles->source, source);
+	schedule_work(&profiles->work);
+}
 
-	value &= 0xFF;
+static bool asus_power_profile_mode_valid(struct asus_wmi *asus, int value)
+{
+	return value == -1 || asus_power_profile_mode_level(asus, value) >= 0;
+}
 
-	if (value == 1) /* Low Speed */
-		value = 85;
-	else if (value == 2)
-		value = 170;
-	else if (value == 3)
-		value = 255;
-	else if (value) {
-		pr_err("Unknown fan speed %#x\n", value);
-		value = -1;
-	}
+static bool asus_power_profile_kbd_valid(struct asus_wmi *asus, int value)
+{
+	return value >= -1 && value <= (int)asus->kbd_led.max_brightness;
+}
 
-	return sprintf(buf, "%d\n", value);
+static bool asus_power_profile_rgb_valid(struct asus_wmi *asus, int value)
+{
+	return value >= -1 && value <= 1;
+}
+
+#define ASUS_POWER_PROFILE_ATTR(_source, _index, _field)		\
+static ssize_t power_profile_##_source##_##_field##_show(		\
+		struct device *dev, struct device_attribute *attr,	\
+		char *buf)						\
+{									\
+	struct asus_wmi *asus = dev_get_drvdata(dev);			\
+									\
+	return sprintf(buf, "%d\n",					\
+		       asus->power_profiles.profile[_index]._field);	\
+}									\
+									\
+static ssize_t power_profile_##_source##_##_field##_store(		\
+		struct device *dev, struct device_attribute *attr,	\
+		const char *buf, size_t count)				\
+{									\
+	struct asus_wmi *asus = dev_get_drvdata(dev);			\
+	struct asus_power_profiles *profiles = &asus->power_profiles;	\
+	int value;							\
+	int result;							\
+									\
+	result = kstrtoint(buf, 10, &value);				\
+	if (result)							\
+		return result;						\
+									\
+	if (!asus_power_profile_##_field##_valid(asus, value))		\
+		return -EINVAL;						\
+									\
+	mutex_lock(&profiles->lock);					\
+	profiles->profile[_index]._field = value;			\
+	if (profiles->enabled && profiles->source == (_index))		\
+		schedule_work(&profiles->work);				\
+	mutex_unlock(&profiles->lock);					\
+									\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(power_profile_##_source##_##_field)
+
+/* Mode as written to fan_boost_mode or throttle_thermal_policy */
+ASUS_POWER_PROFILE_ATTR(ac, ASUS_POWER_AC, mode);
+ASUS_POWER_PROFILE_ATTR(battery, ASUS_POWER_BATTERY, mode);
+/* Keyboard backlight level */
+ASUS_POWER_PROFILE_ATTR(ac, ASUS_POWER_AC, kbd);
+ASUS_POWER_PROFILE_ATTR(battery, ASUS_POWER_BATTERY, kbd);
+/* RGB keyboard: 0 - off, 1 - on */
+ASUS_POWER_PROFILE_ATTR(ac, ASUS_POWER_AC, rgb);
+ASUS_POWER_PROFILE_ATTR(battery, ASUS_POWER_BATTERY, rgb);
+
+static ssize_t power_profile_enable_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", asus->power_profiles.enabled);
 }
 
-static ssize_t pwm1_store(struct device *dev,
-				     struct device_attribute *attr,
-				     const char *buf, size_t count) {
+static ssize_t power_profile_enable_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
 	struct asus_wmi *asus = dev_get_drvdata(dev);
-	int value;
-	int state;
-	int ret;
+	struct asus_power_profiles *profiles = &asus->power_profiles;
+	bool enable;
+	int result;
 
-	ret = kstrtouint(buf, 10, &value);
-	if (ret)
-		return ret;
+	result = kstrtobool(buf, &enable);
+	if (result)
+		return result;
 
-	value = clamp(value, 0, 255);
+	mutex_lock(&profiles->lock);
+	if (enable && !profiles->enabled) {
+		/* Events only come on changes, start from the current source */
+		profiles->source = power_supply_is_system_supplied() == 0 ?
+				   ASUS_POWER_BATTERY : ASUS_POWER_AC;
+		schedule_work(&profiles->work);
+	}
+	WRITE_ONCE(profiles->enabled, enable);
+	mutex_unlock(&profiles->lock);
 
-	state = asus_agfn_fan_speed_write(asus, 1, &value);
-	if (state)
-		pr_warn("Setting fan speed failed: %d\n", state);
-	else
-		asus->fan_pwm_mode = ASUS_FAN_CTRL_MANUAL;
+	if (!enable)
+		kbbl_rgb_set_dark(asus, KBBL_DARK_PROFILE, false);
 
 	return count;
 }
 
-static ssize_t fan1_input_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
+static ssize_t power_profile_source_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
-	int value;
-	int ret;
+	struct asus_power_profiles *profiles = &asus->power_profiles;
+	ssize_t len;
+
+	mutex_lock(&profiles->lock);
+	len = sprintf(buf, "source %s\nwrites %lu\nskipped %lu\n",
+		      profiles->source == ASUS_POWER_AC ? "ac" : "battery",
+		      profiles->writes, profiles->skipped);
+	mutex_unlock(&profiles->lock);
+
+	return len;
+}
+
+// Power source profiles: 0 - off, 1 - on
+static DEVICE_ATTR_RW(power_profile_enable);
+// Current power source and settings written or skipped so far
+static DEVICE_ATTR_RO(power_profile_source);
+
+static struct attribute *power_profile_attributes[] = {
+	&dev_attr_power_profile_enable.attr,
+	&dev_attr_power_profile_source.attr,
+	&dev_attr_power_profile_ac_mode.attr,
+	&dev_attr_power_profile_ac_kbd.attr,
+	&dev_attr_power_profile_ac_rgb.attr,
+	&dev_attr_power_profile_battery_mode.attr,
+	&dev_attr_power_profile_battery_kbd.attr,
+	&dev_attr_power_profile_battery_rgb.attr,
+	NULL
+};
 
-	switch (asus->fan_type) {
-	case FAN_TYPE_SPEC83:
-		ret = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_CPU_FAN_CTRL,
-					    &value);
-		if (ret < 0)
-			return ret;
+static umode_t power_profile_is_visible(struct kobject *kobj,
+					struct attribute *attr, int idx)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	bool ok = true;
 
-		value &= 0xffff;
-		break;
+	if (attr == &dev_attr_power_profile_ac_mode.attr ||
+	    attr == &dev_attr_power_profile_battery_mode.attr)
+		ok = asus->fan_boost_mode_available ||
+		     asus->throttle_thermal_policy_available;
+	else if (attr == &dev_attr_power_profile_ac_kbd.attr ||
+		 attr == &dev_attr_power_profile_battery_kbd.attr)
+		ok = !IS_ERR_OR_NULL(asus->kbd_led.dev);
+	else if (attr == &dev_attr_power_profile_ac_rgb.attr ||
+		 attr == &dev_attr_power_profile_battery_rgb.attr)
+		ok = asus->kbbl_rgb_available;
 
-	case FAN_TYPE_AGFN:
-		/* no speed readable on manual mode */
-		if (asus->fan_pwm_mode == ASUS_FAN_CTRL_MANUAL)
-			return -ENXIO;
+	return ok ? attr->mode : 0;
+}
 
-		ret = asus_agfn_fan_speed_read(asus, 1, &value);
-		if (ret) {
-			pr_warn("reading fan speed failed: %d\n", ret);
-			return -ENXIO;
-		}
-		break;
+static const struct attribute_group power_profile_attribute_group = {
+	.name = "power_profile",
+	.is_visible = power_profile_is_visible,
+	.attrs = power_profile_attributes
+};
 
-	default:
-		return -ENXIO;
+static int asus_wmi_power_profile_init(struct asus_wmi *asus)
+{
+	struct asus_power_profiles *profiles = &asus->power_profiles;
+	int err;
+	int i;
+
+	mutex_init(&profiles->lock);
+	INIT_WORK(&profiles->work, asus_power_profile_work);
+	for (i = 0; i < ASUS_POWER_COUNT; i++) {
+		profiles->profile[i].mode = -1;
+		profiles->profile[i].kbd = -1;
+		profiles->profile[i].rgb = -1;
 	}
 
-	return sprintf(buf, "%d\n", value < 0 ? -1 : value*100);
+	if (!asus->fan_boost_mode_available &&
+	    !asus->throttle_thermal_policy_available &&
+	    IS_ERR_OR_NULL(asus->kbd_led.dev) && !asus->kbbl_rgb_available)
+		return 0;
+
+	err = sysfs_create_group(&asus->platform_device->dev.kobj,
+				 &power_profile_attribute_group);
+	if (!err)
+		profiles->available = true;
+
+	return err;
 }
 
-static ssize_t fan2_input_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
+static void asus_wmi_power_profile_exit(struct asus_wmi *asus)
 {
-	struct asus_wmi *asus = dev_get_drvdata(dev);
-	int value;
-	int ret;
+	struct asus_power_profiles *profiles = &asus->power_profiles;
 
-	switch (asus->fan_type) {
-	case FAN_TYPE_SPEC83:
-		ret = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_GPU_FAN_CTRL,
-					    &value);
-		if (ret < 0)
-			return ret;
+	if (!profiles->available)
+		return;
 
-		value &= 0xffff;
-		break;
+	sysfs_remove_group(&asus->platform_device->dev.kobj,
+			   &power_profile_attribute_group);
+	WRITE_ONCE(profiles->enabled, false);
+	cancel_work_sync(&profiles->work);
+	profiles->available = false;
+}
 
-	case FAN_TYPE_AGFN:
-		/* no speed readable on manual mode */
-		if (asus->fan_pwm_mode == ASUS_FAN_CTRL_MANUAL)
-			return -ENXIO;
+/* Named profiles *************************************************************/
 
-		ret = asus_agfn_fan_speed_read(asus, 1, &value);
-		if (ret) {
-			pr_warn("reading fan speed failed: %d\n", ret);
-			return -ENXIO;
-		}
-		break;
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
 
-	default:
-		return -ENXIO;
-	}
+static const char * const asus_profile_field_names[] = {
+	[ASUS_PROFILE_FAN_BOOST_MODE] = "fan_boost_mode",
+	[ASUS_PROFILE_THERMAL_POLICY] = "throttle_thermal_policy",
+	[ASUS_PROFILE_CHARGE_END] = "charge_control_end_threshold",
+	[ASUS_PROFILE_KBD] = "kbd_backlight",
+	[ASUS_PROFILE_KBBL] = "kbbl",
+};
 
-	return sprintf(buf, "%d\n", value < 0 ? -1 : value*100);
+static struct asus_profile *to_asus_profile(struct config_item *item)
+{
+	return container_of(item, struct asus_profile, item);
 }
 
-static ssize_t pwm1_enable_show(struct device *dev,
-						 struct device_attribute *attr,
-						 char *buf)
+static struct asus_wmi *asus_profile_owner(struct config_item *item)
 {
-	struct asus_wmi *asus = dev_get_drvdata(dev);
+	return container_of(to_config_group(item->ci_parent), struct asus_wmi,
+			    profiles.subsys.su_group);
+}
 
-	/*
-	 * Just read back the cached pwm mode.
-	 *
-	 * For the CPU_FAN device, the spec indicates that we should be
-	 * able to read the device status and consult bit 19 to see if we
-	 * are in Full On or Automatic mode. However, this does not work
-	 * in practice on X532FL at least (the bit is always 0) and there's
-	 * also nothing in the DSDT to indicate that this behaviour exists.
-	 */
-	return sprintf(buf, "%d\n", asus->fan_pwm_mode);
+/* Writes queued behind an open WMI breaker reach the BIOS later */
+static int asus_profile_result(int err)
+{
+	return err == -EINPROGRESS ? ASUS_PROFILE_DEFERRED : err;
 }
 
-static ssize_t pwm1_enable_store(struct device *dev,
-						  struct device_attribute *attr,
-						  const char *buf, size_t count)
+static int asus_profile_set_mode(struct asus_wmi *asus,
+				 enum asus_perf_ctrl ctrl, int mode)
 {
-	struct asus_wmi *asus = dev_get_drvdata(dev);
-	int status = 0;
-	int state;
-	int value;
-	int ret;
-	u32 retval;
+	int err = asus_perf_mode_set(asus, ctrl, mode);
 
-	ret = kstrtouint(buf, 10, &state);
-	if (ret)
-		return ret;
+	return err == 1 ? ASUS_PROFILE_UNCHANGED : asus_profile_result(err);
+}
 
-	if (asus->fan_type == FAN_TYPE_SPEC83) {
-		switch (state) { /* standard documented hwmon values */
-		case ASUS_FAN_CTRL_FULLSPEED:
-			value = 1;
-			break;
-		case ASUS_FAN_CTRL_AUTO:
-			value = 0;
-			break;
-		default:
-			return -EINVAL;
-		}
+/*
+ * Written temporarily and subject to the RGB lease. The colors are applied
+ * directly, leaving the kbbl_set_* fields staged by sysfs clients alone.
+ * Under a priority lease they wait for its release.
+ */
+static int asus_profile_set_kbbl(struct asus_wmi *asus,
+				 struct asus_profile *profile)
+{
+	struct asus_kbbl_lease *lease = &asus->kbbl_lease;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	int color = profile->kbbl_color;
+	struct faustus_kbbl_state state = {
+		.red = color >= 0 ? color >> 16 : rgb->kbbl_red,
+		.green = color >= 0 ? (color >> 8) & 0xff : rgb->kbbl_green,
+		.blue = color >= 0 ? color & 0xff : rgb->kbbl_blue,
+	};
+	int err;
+
+	if (!asus->kbbl_rgb_available)
+		return -ENODEV;
+
+	mutex_lock(&lease->lock);
+	state.mode = profile->kbbl_mode >= 0 ? profile->kbbl_mode :
+					       rgb->kbbl_mode;
+	state.speed = profile->kbbl_speed >= 0 ? profile->kbbl_speed :
+						 rgb->kbbl_speed;
+	state.flags = kbbl_rgb_flags(rgb);
+
+	if (state.red == rgb->kbbl_red && state.green == rgb->kbbl_green &&
+	    state.blue == rgb->kbbl_blue && state.mode == rgb->kbbl_mode &&
+	    state.speed == rgb->kbbl_speed && !asus->kbbl_dark) {
+		err = ASUS_PROFILE_UNCHANGED;
+	} else {
+		err = asus_profile_result(kbbl_rgb_submit(asus, &state));
+	}
+	mutex_unlock(&lease->lock);
+
+	return err;
+}
+
+/*
+ * Apply every field of a profile in one pass, writing only what differs from
+ * the current state, and record the result of each field.
+ */
+static int asus_profile_activate(struct asus_wmi *asus,
+				 struct asus_profile *profile)
+{
+	int *status = profile->status;
+	int err = 0;
+	int i;
+
+	mutex_lock(&asus->profiles.lock);
+
+	if (profile->fan_boost_mode < 0)
+		status[ASUS_PROFILE_FAN_BOOST_MODE] = ASUS_PROFILE_UNSET;
+	else
+		status[ASUS_PROFILE_FAN_BOOST_MODE] =
+			asus_profile_set_mode(asus, ASUS_PERF_FAN_BOOST,
+					      profile->fan_boost_mode);
+
+	if (profile->throttle_thermal_policy < 0)
+		status[ASUS_PROFILE_THERMAL_POLICY] = ASUS_PROFILE_UNSET;
+	else
+		status[ASUS_PROFILE_THERMAL_POLICY] =
+			asus_profile_set_mode(asus, ASUS_PERF_THERMAL_POLICY,
+					      profile->throttle_thermal_policy);
+
+	if (profile->charge_control_end_threshold < 0)
+		status[ASUS_PROFILE_CHARGE_END] = ASUS_PROFILE_UNSET;
+	else if (!asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_RSOC))
+		status[ASUS_PROFILE_CHARGE_END] = -ENODEV;
+	else if (charge_end_threshold == profile->charge_control_end_threshold)
+		status[ASUS_PROFILE_CHARGE_END] = ASUS_PROFILE_UNCHANGED;
+	else
+		status[ASUS_PROFILE_CHARGE_END] = asus_profile_result(
+				charge_end_threshold_write(
+				profile->charge_control_end_threshold));
+
+	if (profile->kbd_backlight < 0)
+		status[ASUS_PROFILE_KBD] = ASUS_PROFILE_UNSET;
+	else if (IS_ERR_OR_NULL(asus->kbd_led.dev))
+		status[ASUS_PROFILE_KBD] = -ENODEV;
+	else if (asus_kbd_led_set_policy(asus, profile->kbd_backlight))
+		status[ASUS_PROFILE_KBD] = 0;
+	else
+		status[ASUS_PROFILE_KBD] = ASUS_PROFILE_UNCHANGED;
+
+	if (profile->kbbl_color < 0 && profile->kbbl_mode < 0 &&
+	    profile->kbbl_speed < 0)
+		status[ASUS_PROFILE_KBBL] = ASUS_PROFILE_UNSET;
+	else
+		status[ASUS_PROFILE_KBBL] = asus_profile_set_kbbl(asus, profile);
+
+	for (i = 0; i < ASUS_PROFILE_FIELDS; i++) {
+		if (status[i] < 0 && !err)
+			err = status[i];
+	}
+	/* A partly applied profile is not the active one, see status */
+	if (!err)
+		asus->profiles.active = profile;
+
+	mutex_unlock(&asus->profiles.lock);
+
+	return err;
+}
+
+#define ASUS_PROFILE_ATTR(_name, _max)					\
+static ssize_t asus_profile_##_name##_show(struct config_item *item,	\
+					   char *page)			\
+{									\
+	return sprintf(page, "%d\n", to_asus_profile(item)->_name);	\
+}									\
+									\
+static ssize_t asus_profile_##_name##_store(struct config_item *item,	\
+					    const char *page,		\
+					    size_t count)		\
+{									\
+	struct asus_wmi *asus = asus_profile_owner(item);		\
+	int value;							\
+	int result;							\
+									\
+	result = kstrtoint(page, 10, &value);				\
+	if (result)							\
+		return result;						\
+									\
+	if (value < -1 || value > (_max))				\
+		return -EINVAL;						\
+									\
+	mutex_lock(&asus->profiles.lock);				\
+	to_asus_profile(item)->_name = value;				\
+	mutex_unlock(&asus->profiles.lock);				\
+									\
+	return count;							\
+}									\
+CONFIGFS_ATTR(asus_profile_, _name)
+
+ASUS_PROFILE_ATTR(fan_boost_mode, ASUS_FAN_BOOST_MODE_SILENT);
+ASUS_PROFILE_ATTR(throttle_thermal_policy,
+		  ASUS_THROTTLE_THERMAL_POLICY_SILENT);
+ASUS_PROFILE_ATTR(charge_control_end_threshold, 100);
+ASUS_PROFILE_ATTR(kbd_backlight, 3);
+ASUS_PROFILE_ATTR(kbbl_mode, 3);
+ASUS_PROFILE_ATTR(kbbl_speed, 2);
+
+static ssize_t asus_profile_kbbl_color_show(struct config_item *item,
+					    char *page)
+{
+	int color = to_asus_profile(item)->kbbl_color;
 
-		ret = asus_wmi_set_devstate(ASUS_WMI_DEVID_CPU_FAN_CTRL,
-					    value, &retval);
-		if (ret)
-			return ret;
+	if (color < 0)
+		return sprintf(page, "-1\n");
 
-		if (retval != 1)
-			return -EIO;
-	} else if (asus->fan_type == FAN_TYPE_AGFN) {
-		switch (state) {
-		case ASUS_FAN_CTRL_MANUAL:
-			break;
+	return sprintf(page, "%06x\n", color);
+}
 
-		case ASUS_FAN_CTRL_AUTO:
-			status = asus_fan_set_auto(asus);
-			if (status)
-				return status;
-			break;
+/* Hex rrggbb like the kbbl/ attributes, or -1 */
+static ssize_t asus_profile_kbbl_color_store(struct config_item *item,
+					     const char *page, size_t count)
+{
+	struct asus_wmi *asus = asus_profile_owner(item);
+	int value;
+	int result;
 
-		default:
+	if (sysfs_streq(page, "-1")) {
+		value = -1;
+	} else {
+		result = kstrtoint(page, 16, &value);
+		if (result)
+			return result;
+		if (value < 0 || value > 0xffffff)
 			return -EINVAL;
-		}
 	}
 
-	asus->fan_pwm_mode = state;
+	mutex_lock(&asus->profiles.lock);
+	to_asus_profile(item)->kbbl_color = value;
+	mutex_unlock(&asus->profiles.lock);
+
 	return count;
 }
+CONFIGFS_ATTR(asus_profile_, kbbl_color);
 
-static ssize_t fan1_label_show(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
+static ssize_t asus_profile_activate_show(struct config_item *item,
+					  char *page)
 {
-	return sprintf(buf, "%s\n", ASUS_CPU_FAN_DESC);
-}
+	struct asus_wmi *asus = asus_profile_owner(item);
 
-static ssize_t fan2_label_show(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
-{
-	return sprintf(buf, "%s\n", ASUS_GPU_FAN_DESC);
+	return sprintf(page, "%d\n",
+		       asus->profiles.active == to_asus_profile(item));
 }
 
-static ssize_t asus_hwmon_temp1(struct device *dev,
-				struct device_attribute *attr,
-				char *buf)
+/* Write 1 to apply the profile, fails if any field failed */
+static ssize_t asus_profile_activate_store(struct config_item *item,
+					   const char *page, size_t count)
 {
-	struct asus_wmi *asus = dev_get_drvdata(dev);
-	u32 value;
-	int err;
+	bool value;
+	int result;
 
-	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_THERMAL_CTRL, &value);
-	if (err < 0)
-		return err;
+	result = kstrtobool(page, &value);
+	if (result)
+		return result;
 
-	return sprintf(buf, "%ld\n",
-		       deci_kelvin_to_millicelsius(value & 0xFFFF));
-}
+	if (!value)
+		return -EINVAL;
 
-/* Fan1 */
-static DEVICE_ATTR_RW(pwm1);
-static DEVICE_ATTR_RW(pwm1_enable);
-static DEVICE_ATTR_RO(fan1_input);
-static DEVICE_ATTR_RO(fan1_label);
+	result = asus_profile_activate(asus_profile_owner(item),
+				       to_asus_profile(item));
 
-/* Fan2 */
-static DEVICE_ATTR_RO(fan2_input);
-static DEVICE_ATTR_RO(fan2_label);
+	return result ? result : count;
+}
+CONFIGFS_ATTR(asus_profile_, activate);
 
-/* Temperature */
-static DEVICE_ATTR(temp1_input, S_IRUGO, asus_hwmon_temp1, NULL);
+static ssize_t asus_profile_status_show(struct config_item *item, char *page)
+{
+	struct asus_wmi *asus = asus_profile_owner(item);
+	struct asus_profile *profile = to_asus_profile(item);
+	ssize_t len = 0;
+	int i;
 
-static struct attribute *hwmon_attributes[] = {
-	&dev_attr_pwm1.attr,
-	&dev_attr_pwm1_enable.attr,
-	&dev_attr_fan1_input.attr,
-	&dev_attr_fan1_label.attr,
-	&dev_attr_fan2_input.attr,
-        &dev_attr_fan2_label.attr,
+	mutex_lock(&asus->profiles.lock);
+	for (i = 0; i < ASUS_PROFILE_FIELDS; i++) {
+		len += sprintf(page + len, "%s ", asus_profile_field_names[i]);
+		if (profile->status[i] == ASUS_PROFILE_UNSET)
+			len += sprintf(page + len, "unset\n");
+		else if (profile->status[i] == ASUS_PROFILE_UNCHANGED)
+			len += sprintf(page + len, "unchanged\n");
+		else if (profile->status[i] == ASUS_PROFILE_DEFERRED)
+			len += sprintf(page + len, "deferred\n");
+		else if (profile->status[i])
+			len += sprintf(page + len, "error %d\n",
+				       profile->status[i]);
+		else
+			len += sprintf(page + len, "written\n");
+	}
+	mutex_unlock(&asus->profiles.lock);
+
+	return len;
+}
+CONFIGFS_ATTR_RO(asus_profile_, status);
+
+static struct configfs_attribute *asus_profile_attrs[] = {
+	&asus_profile_attr_fan_boost_mode,
+	&asus_profile_attr_throttle_thermal_policy,
+	&asus_profile_attr_charge_control_end_threshold,
+	&asus_profile_attr_kbd_backlight,
+	&asus_profile_attr_kbbl_color,
+	&asus_profile_attr_kbbl_mode,
+	&asus_profile_attr_kbbl_speed,
+	&asus_profile_attr_activate,
+	&asus_profile_attr_status,
+	NULL,
+};
 
+static void asus_profile_release(struct config_item *item)
+{
+	kfree(to_asus_profile(item));
+}
 
-	&dev_attr_temp1_input.attr,
-	NULL
+static struct configfs_item_operations asus_profile_item_ops = {
+	.release = asus_profile_release,
 };
 
-static umode_t asus_hwmon_sysfs_is_visible(struct kobject *kobj,
-					  struct attribute *attr, int idx)
+static const struct config_item_type asus_profile_type = {
+	.ct_item_ops = &asus_profile_item_ops,
+	.ct_attrs = asus_profile_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct config_item *asus_profiles_make_item(struct config_group *group,
+						   const char *name)
 {
-	struct device *dev = container_of(kobj, struct device, kobj);
-	struct asus_wmi *asus = dev_get_drvdata(dev->parent);
-	u32 value = ASUS_WMI_UNSUPPORTED_METHOD;
+	struct asus_profile *profile;
+	int i;
 
-	if (attr == &dev_attr_pwm1.attr) {
-		if (asus->fan_type != FAN_TYPE_AGFN)
-			return 0;
-	} else if (attr == &dev_attr_fan1_input.attr
-	    || attr == &dev_attr_fan1_label.attr
-	    || attr == &dev_attr_fan2_input.attr
-	    || attr == &dev_attr_fan2_label.attr
-	    || attr == &dev_attr_pwm1_enable.attr) {
-		if (asus->fan_type == FAN_TYPE_NONE)
-			return 0;
-	} else if (attr == &dev_attr_temp1_input.attr) {
-		int err = asus_wmi_get_devstate(asus,
-						ASUS_WMI_DEVID_THERMAL_CTRL,
-						&value);
+	profile = kzalloc(sizeof(*profile), GFP_KERNEL);
+	if (!profile)
+		return ERR_PTR(-ENOMEM);
 
-		if (err < 0)
-			return 0; /* can't return negative here */
+	profile->fan_boost_mode = -1;
+	profile->throttle_thermal_policy = -1;
+	profile->charge_control_end_threshold = -1;
+	profile->kbd_backlight = -1;
+	profile->kbbl_color = -1;
+	profile->kbbl_mode = -1;
+	profile->kbbl_speed = -1;
+	for (i = 0; i < ASUS_PROFILE_FIELDS; i++)
+		profile->status[i] = ASUS_PROFILE_UNSET;
 
-		/*
-		 * If the temperature value in deci-Kelvin is near the absolute
-		 * zero temperature, something is clearly wrong
-		 */
-		if (value == 0 || value == 1)
-			return 0;
-	}
+	config_item_init_type_name(&profile->item, name, &asus_profile_type);
 
-	return attr->mode;
+	return &profile->item;
 }
 
-static const struct attribute_group hwmon_attribute_group = {
-	.is_visible = asus_hwmon_sysfs_is_visible,
-	.attrs = hwmon_attributes
+static void asus_profiles_drop_item(struct config_group *group,
+				    struct config_item *item)
+{
+	struct asus_wmi *asus = container_of(group, struct asus_wmi,
+					     profiles.subsys.su_group);
+
+	mutex_lock(&asus->profiles.lock);
+	if (asus->profiles.active == to_asus_profile(item))
+		asus->profiles.active = NULL;
+	mutex_unlock(&asus->profiles.lock);
+
+	config_item_put(item);
+}
+
+static struct configfs_group_operations asus_profiles_group_ops = {
+	.make_item = asus_profiles_make_item,
+	.drop_item = asus_profiles_drop_item,
 };
-__ATTRIBUTE_GROUPS(hwmon_attribute);
 
-static int asus_wmi_hwmon_init(struct asus_wmi *asus)
+static const struct config_item_type asus_profiles_type = {
+	.ct_group_ops = &asus_profiles_group_ops,
+	.ct_owner = THIS_MODULE,
+};
+
+static void asus_wmi_profiles_init(struct asus_wmi *asus)
 {
-	struct device *dev = &asus->platform_device->dev;
-	struct device *hwmon;
+	struct configfs_subsystem *subsys = &asus->profiles.subsys;
+	int err;
 
-	hwmon = devm_hwmon_device_register_with_groups(dev, "asus", asus,
-			hwmon_attribute_groups);
+	mutex_init(&asus->profiles.lock);
+	config_group_init_type_name(&subsys->su_group, "faustus",
+				    &asus_profiles_type);
+	mutex_init(&subsys->su_mutex);
 
-	if (IS_ERR(hwmon)) {
-		pr_err("Could not register asus hwmon device\n");
-		return PTR_ERR(hwmon);
+	err = configfs_register_subsystem(subsys);
+	if (err) {
+		pr_warn("Could not register configfs profiles: %d\n", err);
+		return;
 	}
-	return 0;
+
+	asus->profiles.registered = true;
 }
 
-static int asus_wmi_fan_init(struct asus_wmi *asus)
+static void asus_wmi_profiles_exit(struct asus_wmi *asus)
 {
-	asus->fan_type = FAN_TYPE_NONE;
-	asus->agfn_pwm = -1;
+	if (asus->profiles.registered)
+		configfs_unregister_subsystem(&asus->profiles.subsys);
+	asus->profiles.registered = false;
+}
 
-	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_CPU_FAN_CTRL))
-		asus->fan_type = FAN_TYPE_SPEC83;
-	else if (asus_wmi_has_agfn_fan(asus))
-		asus->fan_type = FAN_TYPE_AGFN;
-	else
-		asus->fan_type = FAN_TYPE_SPEC83;
-	if (asus->fan_type == FAN_TYPE_NONE)
-		return -ENODEV;
+#else
 
-	asus_fan_set_auto(asus);
-	asus->fan_pwm_mode = ASUS_FAN_CTRL_AUTO;
-	return 0;
+static void asus_wmi_profiles_init(struct asus_wmi *asus)
+{
 }
 
-/* Fan mode *******************************************************************/
-
-static int fan_boost_mode_check_present(struct asus_wmi *asus)
+static void asus_wmi_profiles_exit(struct asus_wmi *asus)
 {
-	u32 result;
-	int err;
+}
 
-	asus->fan_boost_mode_available = false;
+#endif
 
-	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_BOOST_MODE,
-				    &result);
-	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		else
-			return err;
+/* Control device *************************************************************/
+
+/*
+ * /dev/faustus gets and sets several settings per ioctl with binary values,
+ * see struct faustus_ctl_state.
+ */
+#define FAUSTUS_CTL_ALL		(FAUSTUS_CTL_FAN_BOOST_MODE | \
+				 FAUSTUS_CTL_THERMAL_POLICY | \
+				 FAUSTUS_CTL_KBD_BACKLIGHT | \
+				 FAUSTUS_CTL_CHARGE_END | FAUSTUS_CTL_KBBL | \
+				 FAUSTUS_CTL_TELEMETRY)
+
+static void asus_ctl_result(struct faustus_ctl_state *state, u32 field,
+			    int ret, int *err)
+{
+	if (ret == -EINPROGRESS)
+		state->deferred |= field;
+	if (ret >= 0 || ret == -EINPROGRESS)
+		return;
+
+	state->failed |= field;
+	if (!*err)
+		*err = ret;
+}
+
+static int asus_ctl_get_telemetry(struct asus_wmi *asus,
+				  struct faustus_ctl_state *state)
+{
+	long temp;
+	int rpm;
+	int i;
+
+	state->telemetry_valid = 0;
+	if (!asus_hwmon_read_temp(asus, &temp)) {
+		state->temp = temp;
+		state->telemetry_valid |= FAUSTUS_TELEMETRY_TEMP;
 	}
 
-	if ((result & ASUS_WMI_DSTS_PRESENCE_BIT) &&
-			(result & ASUS_FAN_BOOST_MODES_MASK)) {
-		asus->fan_boost_mode_available = true;
-		asus->fan_boost_mode_mask = result & ASUS_FAN_BOOST_MODES_MASK;
+	for (i = 0; i < ARRAY_SIZE(state->fan); i++) {
+		if (!asus_hwmon_read_fan(asus, i, &rpm)) {
+			state->fan[i] = rpm;
+			state->telemetry_valid |= FAUSTUS_TELEMETRY_FAN1 << i;
+		}
 	}
 
-	return 0;
+	return state->telemetry_valid ? 0 : -ENODEV;
 }
 
-static int fan_boost_mode_write(struct asus_wmi *asus)
+static int asus_ctl_get(struct asus_wmi *asus, struct faustus_ctl_state *state)
 {
-	int err;
-	u8 value;
-	u32 retval;
+	struct asus_state current_state;
+	u32 mask = state->mask;
+	int err = 0;
+	int ret;
 
-	value = asus->fan_boost_mode;
+	asus_state_read(asus, &current_state);
 
-	pr_info("Set fan boost mode: %u\n", value);
-	err = asus_wmi_set_devstate(ASUS_WMI_DEVID_FAN_BOOST_MODE, value,
-				    &retval);
+	if (mask & FAUSTUS_CTL_FAN_BOOST_MODE) {
+		ret = asus->fan_boost_mode_available ? 0 : -ENODEV;
+		state->fan_boost_mode = current_state.fan_boost_mode;
+		asus_ctl_result(state, FAUSTUS_CTL_FAN_BOOST_MODE, ret, &err);
+	}
 
-	sysfs_notify(&asus->platform_device->dev.kobj, NULL,
-			"fan_boost_mode");
+	if (mask & FAUSTUS_CTL_THERMAL_POLICY) {
+		ret = asus->throttle_thermal_policy_available ? 0 : -ENODEV;
+		state->throttle_thermal_policy =
+			current_state.throttle_thermal_policy_mode;
+		asus_ctl_result(state, FAUSTUS_CTL_THERMAL_POLICY, ret, &err);
+	}
 
-	if (err) {
-		pr_warn("Failed to set fan boost mode: %d\n", err);
-		return err;
+	if (mask & FAUSTUS_CTL_KBD_BACKLIGHT) {
+		if (IS_ERR_OR_NULL(asus->kbd_led.dev))
+			ret = -ENODEV;
+		else
+			ret = kbd_led_get_level(asus);
+		if (ret >= 0)
+			state->kbd_backlight = ret;
+		asus_ctl_result(state, FAUSTUS_CTL_KBD_BACKLIGHT, ret, &err);
 	}
 
-	if (retval != 1) {
-		pr_warn("Failed to set fan boost mode (retval): 0x%x\n",
-			retval);
-		return -EIO;
+	if (mask & FAUSTUS_CTL_CHARGE_END) {
+		ret = asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_RSOC) ?
+		      0 : -ENODEV;
+		state->charge_control_end_threshold = charge_end_threshold;
+		asus_ctl_result(state, FAUSTUS_CTL_CHARGE_END, ret, &err);
 	}
 
-	return 0;
+	if (mask & FAUSTUS_CTL_KBBL) {
+		ret = asus->kbbl_rgb_available ? 0 : -ENODEV;
+		if (!ret)
+			kbbl_state_get(asus, &state->kbbl);
+		asus_ctl_result(state, FAUSTUS_CTL_KBBL, ret, &err);
+	}
+
+	if (mask & FAUSTUS_CTL_TELEMETRY) {
+		ret = asus_ctl_get_telemetry(asus, state);
+		asus_ctl_result(state, FAUSTUS_CTL_TELEMETRY, ret, &err);
+	}
+
+	return err;
 }
 
-static int fan_boost_mode_switch_next(struct asus_wmi *asus)
+static int asus_ctl_set(struct asus_wmi *asus, struct faustus_ctl_state *state)
 {
-	u8 mask = asus->fan_boost_mode_mask;
+	u32 mask = state->mask;
+	int err = 0;
+	int ret;
 
-	if (asus->fan_boost_mode == ASUS_FAN_BOOST_MODE_NORMAL) {
-		if (mask & ASUS_FAN_BOOST_MODE_OVERBOOST_MASK)
-			asus->fan_boost_mode = ASUS_FAN_BOOST_MODE_OVERBOOST;
-		else if (mask & ASUS_FAN_BOOST_MODE_SILENT_MASK)
-			asus->fan_boost_mode = ASUS_FAN_BOOST_MODE_SILENT;
-	} else if (asus->fan_boost_mode == ASUS_FAN_BOOST_MODE_OVERBOOST) {
-		if (mask & ASUS_FAN_BOOST_MODE_SILENT_MASK)
-			asus->fan_boost_mode = ASUS_FAN_BOOST_MODE_SILENT;
+	if (mask & FAUSTUS_CTL_TELEMETRY)
+		return -EINVAL;
+
+	if (mask & FAUSTUS_CTL_FAN_BOOST_MODE) {
+		ret = asus_perf_mode_set(asus, ASUS_PERF_FAN_BOOST,
+					 state->fan_boost_mode);
+		asus_ctl_result(state, FAUSTUS_CTL_FAN_BOOST_MODE, ret, &err);
+	}
+
+	if (mask & FAUSTUS_CTL_THERMAL_POLICY) {
+		ret = asus_perf_mode_set(asus, ASUS_PERF_THERMAL_POLICY,
+					 state->throttle_thermal_policy);
+		asus_ctl_result(state, FAUSTUS_CTL_THERMAL_POLICY, ret, &err);
+	}
+
+	if (mask & FAUSTUS_CTL_KBD_BACKLIGHT) {
+		if (IS_ERR_OR_NULL(asus->kbd_led.dev))
+			ret = -ENODEV;
+		else if (state->kbd_backlight > asus->kbd_led.max_brightness)
+			ret = -EINVAL;
 		else
-			asus->fan_boost_mode = ASUS_FAN_BOOST_MODE_NORMAL;
-	} else {
-		asus->fan_boost_mode = ASUS_FAN_BOOST_MODE_NORMAL;
+			ret = 0;
+		if (!ret)
+			kbd_led_set_by_kbd(asus, state->kbd_backlight);
+		asus_ctl_result(state, FAUSTUS_CTL_KBD_BACKLIGHT, ret, &err);
+	}
+
+	if (mask & FAUSTUS_CTL_CHARGE_END) {
+		if (!asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_RSOC))
+			ret = -ENODEV;
+		else if (state->charge_control_end_threshold > 100)
+			ret = -EINVAL;
+		else
+			ret = charge_end_threshold_write(
+					state->charge_control_end_threshold);
+		asus_ctl_result(state, FAUSTUS_CTL_CHARGE_END, ret, &err);
+	}
+
+	if (mask & FAUSTUS_CTL_KBBL) {
+		if (!asus->kbbl_rgb_available)
+			ret = -ENODEV;
+		else
+			ret = kbbl_state_set(asus, NULL, &state->kbbl);
+		asus_ctl_result(state, FAUSTUS_CTL_KBBL, ret, &err);
 	}
 
-	return fan_boost_mode_write(asus);
+	return err;
 }
 
-static ssize_t fan_boost_mode_show(struct device *dev,
-				   struct device_attribute *attr, char *buf)
+static int asus_ctl_open(struct inode *inode, struct file *file)
 {
-	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_wmi *asus = container_of(file->private_data,
+					     struct asus_wmi, ctl_miscdev);
 
-	return scnprintf(buf, PAGE_SIZE, "%d\n", asus->fan_boost_mode);
+	file->private_data = asus;
+	return nonseekable_open(inode, file);
 }
 
-static ssize_t fan_boost_mode_store(struct device *dev,
-				    struct device_attribute *attr,
-				    const char *buf, size_t count)
+static long asus_ctl_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
 {
-	u8 new_mode;
-	struct asus_wmi *asus = dev_get_drvdata(dev);
-	u8 mask = asus->fan_boost_mode_mask;
+	struct asus_wmi *asus = file->private_data;
+	void __user *argp = (void __user *)arg;
+	struct faustus_ctl_state state;
+	int err;
 
-	int successfully_converted = kstrtou8(buf, 10, &new_mode);
-	if (successfully_converted < 0) {
-		pr_warn("Trying to store invalid value\n");
-		return -EINVAL;
-	}
+	switch (cmd) {
+	case FAUSTUS_CTL_IOC_VERSION:
+		return put_user(FAUSTUS_CTL_VERSION, (__u32 __user *)argp);
 
-	if (new_mode == ASUS_FAN_BOOST_MODE_OVERBOOST) {
-		if (!(mask & ASUS_FAN_BOOST_MODE_OVERBOOST_MASK))
-			return -EINVAL;
-	} else if (new_mode == ASUS_FAN_BOOST_MODE_SILENT) {
-		if (!(mask & ASUS_FAN_BOOST_MODE_SILENT_MASK))
+	case FAUSTUS_CTL_IOC_GET:
+	case FAUSTUS_CTL_IOC_SET:
+		if (copy_from_user(&state, argp, sizeof(state)))
+			return -EFAULT;
+
+		if (state.mask & ~FAUSTUS_CTL_ALL ||
+		    memchr_inv(state.reserved, 0, sizeof(state.reserved)))
 			return -EINVAL;
-	} else if (new_mode != ASUS_FAN_BOOST_MODE_NORMAL) {
-		return -EINVAL;
+
+		state.failed = 0;
+		state.deferred = 0;
+		if (cmd == FAUSTUS_CTL_IOC_GET)
+			err = asus_ctl_get(asus, &state);
+		else
+			err = asus_ctl_set(asus, &state);
+
+		if (copy_to_user(argp, &state, sizeof(state)))
+			return -EFAULT;
+		return err;
+
+	default:
+		return -ENOTTY;
 	}
+}
 
-	asus->fan_boost_mode = new_mode;
-	fan_boost_mode_write(asus);
+static const struct file_operations asus_ctl_fops = {
+	.owner = THIS_MODULE,
+	.open = asus_ctl_open,
+	.unlocked_ioctl = asus_ctl_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
 
-	return count;
+static int asus_wmi_ctl_init(struct asus_wmi *asus)
+{
+	int err;
+
+	asus->ctl_miscdev.minor = MISC_DYNAMIC_MINOR;
+	asus->ctl_miscdev.name = "faustus";
+	asus->ctl_miscdev.fops = &asus_ctl_fops;
+	asus->ctl_miscdev.parent = &asus->platform_device->dev;
+	err = misc_register(&asus->ctl_miscdev);
+	if (err)
+		return err;
+
+	asus->ctl_available = true;
+	return 0;
 }
 
-// Fan boost mode: 0 - normal, 1 - overboost, 2 - silent
-static DEVICE_ATTR_RW(fan_boost_mode);
+static void asus_wmi_ctl_exit(struct asus_wmi *asus)
+{
+	if (asus->ctl_available)
+		misc_deregister(&asus->ctl_miscdev);
+	asus->ctl_available = false;
+}
 
-/* Throttle thermal policy ****************************************************/
+/* Thermal framework **********************************************************/
 
-static int throttle_thermal_policy_check_present(struct asus_wmi *asus)
+/*
+ * Cooling state 0 is the fastest mode, higher states trade performance for
+ * less heat until the quietest mode.
+ */
+static int asus_cdev_get_max_state(struct thermal_cooling_device *cdev,
+				   unsigned long *state)
 {
-	u32 result;
-	int err;
+	struct asus_perf_cdev *perf = cdev->devdata;
+	u8 modes[ASUS_PERF_LEVELS_MAX];
 
-	asus->throttle_thermal_policy_available = false;
+	*state = asus_perf_levels(perf->asus, perf->ctrl, modes) - 1;
+	return 0;
+}
 
-	err = asus_wmi_get_devstate(asus,
-				    ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY,
-				    &result);
-	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		return err;
-	}
+static int asus_cdev_get_cur_state(struct thermal_cooling_device *cdev,
+				   unsigned long *state)
+{
+	struct asus_perf_cdev *perf = cdev->devdata;
+	u8 modes[ASUS_PERF_LEVELS_MAX];
+	int level;
+
+	level = asus_perf_level_get(perf->asus, perf->ctrl);
+	if (level < 0)
+		return level;
+
+	*state = asus_perf_levels(perf->asus, perf->ctrl, modes) - 1 - level;
+	return 0;
+}
+
+static int asus_cdev_set_cur_state(struct thermal_cooling_device *cdev,
+				   unsigned long state)
+{
+	struct asus_perf_cdev *perf = cdev->devdata;
+	struct asus_wmi *asus = perf->asus;
+	u8 modes[ASUS_PERF_LEVELS_MAX];
+	int level;
+	int count;
+	int err;
+
+	count = asus_perf_levels(asus, perf->ctrl, modes);
+	if (state >= count)
+		return -EINVAL;
 
-	if (result & ASUS_WMI_DSTS_PRESENCE_BIT)
-		asus->throttle_thermal_policy_available = true;
+	/* Also caps the automatic mode and the power profiles */
+	WRITE_ONCE(perf->state, state);
+	level = count - 1 - state;
+
+	/* Boost leases and power profiles only drive the default control */
+	if (perf->ctrl == asus_perf_ctrl_default(asus))
+		err = asus_perf_level_request(asus, level,
+					      ASUS_MODE_SRC_THERMAL);
+	else if (asus_perf_level_get(asus, perf->ctrl) != level)
+		err = asus_perf_level_set(asus, perf->ctrl, level,
+					  ASUS_MODE_SRC_THERMAL);
+	else
+		err = 0;
 
-	return 0;
+	return err == 1 || err == -EINPROGRESS ? 0 : err;
 }
 
-static int throttle_thermal_policy_write(struct asus_wmi *asus)
+static const struct thermal_cooling_device_ops asus_cdev_ops = {
+	.get_max_state = asus_cdev_get_max_state,
+	.get_cur_state = asus_cdev_get_cur_state,
+	.set_cur_state = asus_cdev_set_cur_state,
+};
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0))
+static int asus_tz_get_temp(struct thermal_zone_device *tz, int *temp)
 {
+	struct asus_wmi *asus = thermal_zone_device_priv(tz);
+	long value;
 	int err;
-	u8 value;
-	u32 retval;
 
-	value = asus->throttle_thermal_policy_mode;
+	err = asus_hwmon_read_temp(asus, &value);
+	if (err)
+		return err;
 
-	err = asus_wmi_set_devstate(ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY,
-				    value, &retval);
+	*temp = value;
+	return 0;
+}
 
-	sysfs_notify(&asus->platform_device->dev.kobj, NULL,
-			"throttle_thermal_policy");
+/* Our cooling devices go to the passive trip, the rest is left to others */
+static bool asus_tz_should_bind(struct thermal_zone_device *tz,
+				const struct thermal_trip *trip,
+				struct thermal_cooling_device *cdev,
+				struct cooling_spec *c)
+{
+	struct asus_wmi *asus = thermal_zone_device_priv(tz);
+	int i;
 
-	if (err) {
-		pr_warn("Failed to set throttle thermal policy: %d\n", err);
-		return err;
-	}
+	if (trip->type != THERMAL_TRIP_PASSIVE)
+		return false;
 
-	if (retval != 1) {
-		pr_warn("Failed to set throttle thermal policy (retval): 0x%x\n",
-			retval);
-		return -EIO;
+	for (i = 0; i < ARRAY_SIZE(asus->perf_cdev); i++) {
+		if (asus->perf_cdev[i].cdev == cdev)
+			return true;
 	}
 
-	return 0;
+	return false;
 }
 
-static int throttle_thermal_policy_set_default(struct asus_wmi *asus)
-{
-	if (!asus->throttle_thermal_policy_available)
-		return 0;
+static const struct thermal_zone_device_ops asus_tz_ops = {
+	.get_temp = asus_tz_get_temp,
+	.should_bind = asus_tz_should_bind,
+};
 
-	asus->throttle_thermal_policy_mode = ASUS_THROTTLE_THERMAL_POLICY_DEFAULT;
-	return throttle_thermal_policy_write(asus);
-}
+static const struct thermal_zone_params asus_tz_params = {
+	.no_hwmon = true,
+};
 
-static int throttle_thermal_policy_switch_next(struct asus_wmi *asus)
+static void asus_wmi_thermal_zone_init(struct asus_wmi *asus)
 {
-	u8 new_mode = asus->throttle_thermal_policy_mode + 1;
+	struct thermal_trip trips[] = {
+		{
+			.type = THERMAL_TRIP_PASSIVE,
+			.temperature = ASUS_THERMAL_PASSIVE_TEMP,
+			.hysteresis = ASUS_THERMAL_PASSIVE_HYST,
+			.flags = THERMAL_TRIP_FLAG_RW_TEMP,
+		},
+	};
+	struct thermal_zone_device *tz;
+	long temp;
 
-	if (new_mode > ASUS_THROTTLE_THERMAL_POLICY_SILENT)
-		new_mode = ASUS_THROTTLE_THERMAL_POLICY_DEFAULT;
+	/* Same check as for the hwmon temperature */
+	if (asus_hwmon_read_temp(asus, &temp) || temp <= -273000)
+		return;
 
-	asus->throttle_thermal_policy_mode = new_mode;
-	return throttle_thermal_policy_write(asus);
-}
+	tz = thermal_zone_device_register_with_trips("asus_wmi", trips,
+			ARRAY_SIZE(trips), asus, &asus_tz_ops, &asus_tz_params,
+			ASUS_THERMAL_PASSIVE_DELAY, ASUS_THERMAL_POLLING_DELAY);
+	if (IS_ERR(tz)) {
+		pr_warn("Could not register thermal zone: %ld\n", PTR_ERR(tz));
+		return;
+	}
 
-static ssize_t throttle_thermal_policy_show(struct device *dev,
-				   struct device_attribute *attr, char *buf)
-{
-	struct asus_wmi *asus = dev_get_drvdata(dev);
-	u8 mode = asus->throttle_thermal_policy_mode;
+	if (thermal_zone_device_enable(tz)) {
+		thermal_zone_device_unregister(tz);
+		return;
+	}
 
-	return scnprintf(buf, PAGE_SIZE, "%d\n", mode);
+	asus->thermal_zone = tz;
 }
+#endif
 
-static ssize_t throttle_thermal_policy_store(struct device *dev,
-				    struct device_attribute *attr,
-				    const char *buf, size_t count)
+static void asus_wmi_thermal_init(struct asus_wmi *asus)
 {
-	int result;
-	u8 new_mode;
-	struct asus_wmi *asus = dev_get_drvdata(dev);
-
-	result = kstrtou8(buf, 10, &new_mode);
-	if (result < 0)
-		return result;
+	static const char * const names[] = {
+		[ASUS_PERF_FAN_BOOST] = "asus-fan-boost",
+		[ASUS_PERF_THERMAL_POLICY] = "asus-thermal-policy",
+	};
+	struct thermal_cooling_device *cdev;
+	int i;
 
-	if (new_mode > ASUS_THROTTLE_THERMAL_POLICY_SILENT)
-		return -EINVAL;
+	for (i = 0; i < ARRAY_SIZE(asus->perf_cdev); i++) {
+		struct asus_perf_cdev *perf = &asus->perf_cdev[i];
+		u8 modes[ASUS_PERF_LEVELS_MAX];
+
+		perf->asus = asus;
+		perf->ctrl = i;
+		if (!asus_perf_ctrl_available(asus, i) ||
+		    asus_perf_levels(asus, i, modes) < 2)
+			continue;
+
+		cdev = thermal_cooling_device_register(names[i], perf,
+						       &asus_cdev_ops);
+		if (IS_ERR(cdev)) {
+			pr_warn("Could not register %s cooling device: %ld\n",
+				names[i], PTR_ERR(cdev));
+			continue;
+		}
 
-	asus->throttle_thermal_policy_mode = new_mode;
-	throttle_thermal_policy_write(asus);
+		perf->cdev = cdev;
+	}
 
-	return count;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0))
+	asus_wmi_thermal_zone_init(asus);
+#endif
 }
 
-// Throttle thermal policy: 0 - default, 1 - overboost, 2 - silent
-static DEVICE_ATTR_RW(throttle_thermal_policy);
+static void asus_wmi_thermal_exit(struct asus_wmi *asus)
+{
+	int i;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0))
+	if (asus->thermal_zone)
+		thermal_zone_device_unregister(asus->thermal_zone);
+	asus->thermal_zone = NULL;
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(asus->perf_cdev); i++) {
+		if (asus->perf_cdev[i].cdev)
+			thermal_cooling_device_unregister(asus->perf_cdev[i].cdev);
+		asus->perf_cdev[i].cdev = NULL;
+	}
+}
 
 /* Backlight ******************************************************************/
 
@@ -2392,9 +7866,8 @@ static int read_brightness_max(struct asus_wmi *asus)
 	return retval;
 }
 
-static int read_brightness(struct backlight_device *bd)
+static int read_brightness_level(struct asus_wmi *asus)
 {
-	struct asus_wmi *asus = bl_get_data(bd);
 	u32 retval;
 	int err;
 
@@ -2405,6 +7878,14 @@ static int read_brightness(struct backlight_device *bd)
 	return retval & ASUS_WMI_DSTS_BRIGHTNESS_MASK;
 }
 
+static int read_brightness(struct backlight_device *bd)
+{
+	struct asus_wmi *asus = bl_get_data(bd);
+
+	return asus_shadow_get(asus, ASUS_SHADOW_BRIGHTNESS,
+			       &asus->bl_brightness_wk, read_brightness_level);
+}
+
 static u32 get_scalar_command(struct backlight_device *bd)
 {
 	struct asus_wmi *asus = bl_get_data(bd);
@@ -2428,13 +7909,21 @@ static int update_bl_status(struct backlight_device *bd)
 	u32 ctrl_param;
 	int power, err = 0;
 
-	power = read_backlight_power(asus);
+	power = asus_shadow_get(asus, ASUS_SHADOW_BL_POWER, &asus->bl_power_wk,
+				read_backlight_power);
 	if (power != -ENODEV && bd->props.power != power) {
 		ctrl_param = !!(bd->props.power == FB_BLANK_UNBLANK);
-		err = asus_wmi_set_devstate(ASUS_WMI_DEVID_BACKLIGHT,
-					    ctrl_param, NULL);
+		err = __asus_wmi_set_devstate(ASUS_WMI_DEVID_BACKLIGHT,
+					      ctrl_param, NULL);
 		if (asus->driver->quirks->store_backlight_power)
 			asus->driver->panel_power = bd->props.power;
+		if (!err)
+			asus_shadow_set(asus, ASUS_SHADOW_BL_POWER,
+					&asus->bl_power_wk, bd->props.power);
+		else
+			clear_bit(ASUS_SHADOW_BL_POWER, &asus->shadow_valid);
+		if (err == -EINPROGRESS)
+			err = 0;
 
 		/* When using scalar brightness, updating the brightness
 		 * will mess with the backlight power */
@@ -2444,13 +7933,23 @@ static int update_bl_status(struct backlight_device *bd)
 
 	if (asus->driver->quirks->scalar_panel_brightness)
 		ctrl_param = get_scalar_command(bd);
+	else if (test_bit(ASUS_SHADOW_BRIGHTNESS, &asus->shadow_valid) &&
+		 READ_ONCE(asus->bl_brightness_wk) == bd->props.brightness)
+		return err;	/* only the power changed */
 	else
 		ctrl_param = bd->props.brightness;
 
-	err = asus_wmi_set_devstate(ASUS_WMI_DEVID_BRIGHTNESS,
-				    ctrl_param, NULL);
+	err = __asus_wmi_set_devstate(ASUS_WMI_DEVID_BRIGHTNESS,
+				      ctrl_param, NULL);
 
-	return err;
+	/* Scalar commands step the level, the result has to be read back */
+	if (!err && !asus->driver->quirks->scalar_panel_brightness)
+		asus_shadow_set(asus, ASUS_SHADOW_BRIGHTNESS,
+				&asus->bl_brightness_wk, bd->props.brightness);
+	else
+		clear_bit(ASUS_SHADOW_BRIGHTNESS, &asus->shadow_valid);
+
+	return err == -EINPROGRESS ? 0 : err;
 }
 
 static const struct backlight_ops asus_wmi_bl_ops = {
@@ -2549,11 +8048,22 @@ static bool asus_wmi_has_fnlock_key(struct asus_wmi *asus)
 		!(result & ASUS_WMI_FNLOCK_BIOS_DISABLED);
 }
 
+/* Called with ctl_lock held */
 static void asus_wmi_fnlock_update(struct asus_wmi *asus)
 {
 	int mode = asus->fnlock_locked;
 
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_FNLOCK, mode, NULL);
+	lockdep_assert_held(&asus->ctl_lock);
+
+	if (test_bit(ASUS_SHADOW_FNLOCK, &asus->shadow_valid) &&
+	    READ_ONCE(asus->dev_wk[ASUS_SHADOW_FNLOCK]) == mode)
+		return;
+
+	if (__asus_wmi_set_devstate(ASUS_WMI_DEVID_FNLOCK, mode, NULL))
+		clear_bit(ASUS_SHADOW_FNLOCK, &asus->shadow_valid);
+	else
+		asus_shadow_set(asus, ASUS_SHADOW_FNLOCK,
+				&asus->dev_wk[ASUS_SHADOW_FNLOCK], mode);
 }
 
 /* WMI events *****************************************************************/
@@ -2597,37 +8107,64 @@ static int asus_wmi_get_event_code(u32 value)
 }
 #endif
 
+/*
+ * The next colors are computed from the current ones under the lease lock
+ * and committed persistently like any other client, leaving the kbbl_set_*
+ * fields staged by sysfs writers alone.
+ */
 static void asus_wmi_handle_aura_event(struct asus_wmi *asus, int direction)
 {
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	struct faustus_kbbl_state state;
 	int color1, color2, color3, speed;
-	
+
+	if (!asus->kbbl_rgb_available)
+		return;
+
+	mutex_lock(&asus->kbbl_lease.lock);
+	if (asus->kbbl_lease.owner &&
+	    asus->kbbl_lease.type == FAUSTUS_KBBL_LEASE_EXCLUSIVE) {
+		asus->kbbl_lease.rejects++;
+		goto out_unlock;
+	}
+
+	state = (struct faustus_kbbl_state) {
+		.red = rgb->kbbl_red,
+		.green = rgb->kbbl_green,
+		.blue = rgb->kbbl_blue,
+		.mode = rgb->kbbl_mode,
+		.speed = rgb->kbbl_speed,
+		.flags = kbbl_rgb_flags(rgb),
+		.persistent = 1,
+	};
+
 	speed = (asus->kbbl_rgb.kbbl_auraspeed)? asus->kbbl_rgb.kbbl_auraspeed : 5; // default to 5
 	asus->kbbl_rgb.kbbl_auramode = (asus->kbbl_rgb.kbbl_set_auramode <= 3)?
 		asus->kbbl_rgb.kbbl_set_auramode : 0;
 
 	if (asus->kbbl_rgb.kbbl_auramode == 2) {
 		if (!direction && asus->kbbl_rgb.kbbl_speed+1 <= 2) {
-			asus->kbbl_rgb.kbbl_set_speed = asus->kbbl_rgb.kbbl_speed+=1;
+			state.speed = asus->kbbl_rgb.kbbl_speed+1;
 		} else if (!direction) {
-			asus->kbbl_rgb.kbbl_set_speed = 0;
+			state.speed = 0;
 		}
 		if (direction && asus->kbbl_rgb.kbbl_speed-1 >= 0) {
-			asus->kbbl_rgb.kbbl_set_speed = asus->kbbl_rgb.kbbl_speed-=1;
+			state.speed = asus->kbbl_rgb.kbbl_speed-1;
 		} else if (direction) {
-			asus->kbbl_rgb.kbbl_set_speed = 2;
+			state.speed = 2;
 		}
 	}
 
 	if (asus->kbbl_rgb.kbbl_auramode == 1) {
 		if (!direction && asus->kbbl_rgb.kbbl_mode+1 <= 3) {
-			asus->kbbl_rgb.kbbl_set_mode = asus->kbbl_rgb.kbbl_mode+=1;
+			state.mode = asus->kbbl_rgb.kbbl_mode+1;
 		} else if (!direction) {
-			asus->kbbl_rgb.kbbl_set_mode = 0;
+			state.mode = 0;
 		}
 		if (direction && asus->kbbl_rgb.kbbl_mode-1 >= 0) {
-			asus->kbbl_rgb.kbbl_set_mode = asus->kbbl_rgb.kbbl_mode-=1;
+			state.mode = asus->kbbl_rgb.kbbl_mode-1;
 		} else if (direction) {
-			asus->kbbl_rgb.kbbl_set_mode = 3;
+			state.mode = 3;
 		}
 	}		
 
@@ -2643,7 +8180,7 @@ static void asus_wmi_handle_aura_event(struct asus_wmi *asus, int direction)
 
 	if (asus->kbbl_rgb.kbbl_auramode == 3) {
 		if (asus->kbbl_rgb.kbbl_mode == 2) // Don't run manual color cycle if keyboard mode is auto color cycle
-			return;
+			goto out_unlock;
 		if (!direction) {
 			if (color1 != 255 && color2 != 255 && color1+speed <= 255 && color2+speed <= 255) {
 				color1+=speed;
@@ -2676,7 +8213,7 @@ static void asus_wmi_handle_aura_event(struct asus_wmi *asus, int direction)
 
 	} else if (!asus->kbbl_rgb.kbbl_auramode) {
 		if (asus->kbbl_rgb.kbbl_mode == 2) // Don't run manual color cycle if keyboard mode is auto color cycle
-			return;
+			goto out_unlock;
 		if (color1==255 && color2<255 && color3<255) {
 			if (color3!=0 && color3-speed>=0) {
 				color3-=speed;
@@ -2718,24 +8255,24 @@ static void asus_wmi_handle_aura_event(struct asus_wmi *asus, int direction)
 
 	if (direction && (!asus->kbbl_rgb.kbbl_auramode
 			|| asus->kbbl_rgb.kbbl_auramode == 3)) {
-		asus->kbbl_rgb.kbbl_set_red = color1;
-		asus->kbbl_rgb.kbbl_set_green  = color2;
-		asus->kbbl_rgb.kbbl_set_blue = color3;
+		state.red = color1;
+		state.green = color2;
+		state.blue = color3;
 		//pr_info("RED: %d GREEN: %d BLUE: %d", color1, color2, color3);
 	} else if (!direction && (!asus->kbbl_rgb.kbbl_auramode
 			|| asus->kbbl_rgb.kbbl_auramode == 3)) {
-		asus->kbbl_rgb.kbbl_set_red = color1;
-		asus->kbbl_rgb.kbbl_set_blue  = color2;
-		asus->kbbl_rgb.kbbl_set_green = color3;
+		state.red = color1;
+		state.blue = color2;
+		state.green = color3;
 		//pr_info("RED: %d GREEN: %d BLUE: %d", color1, color3, color2);
 	}
 
-	if (!asus->kbbl_rgb.kbbl_set_flags) {
-		asus->kbbl_rgb.kbbl_set_flags = 42; // default to 2a...
-		asus->kbbl_rgb.kbbl_set_red = 255; // initializaton
-	}
-	kbbl_rgb_write(asus, 1);
-	return;
+	if (!state.red && !state.green && !state.blue)
+		state.red = 255; // initializaton
+
+	kbbl_rgb_submit(asus, &state);
+out_unlock:
+	mutex_unlock(&asus->kbbl_lease.lock);
 }
 
 static void asus_wmi_handle_event_code(int code, struct asus_wmi *asus)
@@ -2758,6 +8295,8 @@ static void asus_wmi_handle_event_code(int code, struct asus_wmi *asus)
 	else if (code >= NOTIFY_BRNDOWN_MIN && code <= NOTIFY_BRNDOWN_MAX)
 		code = ASUS_WMI_BRN_DOWN;
 
+	asus_shadow_invalidate_key(asus, code);
+
 	if (code == ASUS_WMI_BRN_DOWN || code == ASUS_WMI_BRN_UP) {
 		if (acpi_video_get_backlight_type() == acpi_backlight_vendor) {
 			asus_wmi_backlight_notify(asus, orig_code);
@@ -2784,6 +8323,16 @@ static void asus_wmi_handle_event_code(int code, struct asus_wmi *asus)
 		return;
 	}
 
+	/* Still ignored by the keymap, only the opt-in ALS mode uses it */
+	if (code == NOTIFY_ALS && READ_ONCE(asus->kbd_als.enabled))
+		schedule_work(&asus->kbd_als.work);
+
+	/* Also ignored by the keymap */
+	if (code == NOTIFY_BATTERY_MODE)
+		asus_power_profile_notify(asus, ASUS_POWER_BATTERY);
+	else if (code == NOTIFY_AC_MODE)
+		asus_power_profile_notify(asus, ASUS_POWER_AC);
+
 	if (code == NOTIFY_KBD_BRTTOGGLE) {
 		if (asus->kbd_led_wk == asus->kbd_led.max_brightness)
 			kbd_led_set_by_kbd(asus, 0);
@@ -2793,8 +8342,11 @@ static void asus_wmi_handle_event_code(int code, struct asus_wmi *asus)
 	}
 
 	if (code == NOTIFY_FNLOCK_TOGGLE) {
-		asus->fnlock_locked = !asus->fnlock_locked;
+		mutex_lock(&asus->ctl_lock);
+		asus_state_publish(asus, asus->fnlock_locked,
+				   !asus->fnlock_locked);
 		asus_wmi_fnlock_update(asus);
+		mutex_unlock(&asus->ctl_lock);
 		return;
 	}
 	if (code == NOTIFY_WNDWSLOCK_TOGGLE) {
@@ -2908,30 +8460,47 @@ static int asus_wmi_notify_queue_flush(struct asus_wmi *asus)
 
 /* Sysfs **********************************************************************/
 
+/*
+ * Presence is probed once (normally by asus_sysfs_is_visible()) and a value
+ * equal to the cached state is not written again. Only 0 and 1 are cached,
+ * other values are passed to the BIOS as they are.
+ */
 static ssize_t store_sys_wmi(struct asus_wmi *asus, int devid,
-			     const char *buf, size_t count)
+			     enum asus_shadow_id id, const char *buf,
+			     size_t count)
 {
 	u32 retval;
 	int err, value;
 
-	value = asus_wmi_get_devstate_simple(asus, devid);
-	if (value < 0)
-		return value;
+	if (!test_bit(id, &asus->shadow_present)) {
+		value = asus_shadow_get_devstate(asus, id, devid);
+		if (value < 0)
+			return value;
+	}
 
 	err = kstrtoint(buf, 0, &value);
 	if (err)
 		return err;
 
-	err = asus_wmi_set_devstate(devid, value, &retval);
-	if (err < 0)
-		return err;
+	if (test_bit(id, &asus->shadow_valid) &&
+	    READ_ONCE(asus->dev_wk[id]) == value)
+		return count;
 
+	/* A write queued by the breaker is accepted but not cached */
+	err = __asus_wmi_set_devstate(devid, value, &retval);
+	if (err < 0 || (value != 0 && value != 1)) {
+		clear_bit(id, &asus->shadow_valid);
+		return err < 0 && err != -EINPROGRESS ? err : count;
+	}
+
+	asus_shadow_set(asus, id, &asus->dev_wk[id], value);
 	return count;
 }
 
-static ssize_t show_sys_wmi(struct asus_wmi *asus, int devid, char *buf)
+static ssize_t show_sys_wmi(struct asus_wmi *asus, int devid,
+			    enum asus_shadow_id id, char *buf)
 {
-	int value = asus_wmi_get_devstate_simple(asus, devid);
+	int value = asus_shadow_get_devstate(asus, id, devid);
 
 	if (value < 0)
 		return value;
@@ -2939,14 +8508,14 @@ static ssize_t show_sys_wmi(struct asus_wmi *asus, int devid, char *buf)
 	return sprintf(buf, "%d\n", value);
 }
 
-#define ASUS_WMI_CREATE_DEVICE_ATTR(_name, _mode, _cm)			\
+#define ASUS_WMI_CREATE_DEVICE_ATTR(_name, _mode, _cm, _shadow)		\
 	static ssize_t show_##_name(struct device *dev,			\
 				    struct device_attribute *attr,	\
 				    char *buf)				\
 	{								\
 		struct asus_wmi *asus = dev_get_drvdata(dev);		\
 									\
-		return show_sys_wmi(asus, _cm, buf);			\
+		return show_sys_wmi(asus, _cm, _shadow, buf);		\
 	}								\
 	static ssize_t store_##_name(struct device *dev,		\
 				     struct device_attribute *attr,	\
@@ -2954,7 +8523,7 @@ static ssize_t show_sys_wmi(struct asus_wmi *asus, int devid, char *buf)
 	{								\
 		struct asus_wmi *asus = dev_get_drvdata(dev);		\
 									\
-		return store_sys_wmi(asus, _cm, buf, count);		\
+		return store_sys_wmi(asus, _cm, _shadow, buf, count);	\
 	}								\
 	static struct device_attribute dev_attr_##_name = {		\
 		.attr = {						\
@@ -2964,11 +8533,16 @@ static ssize_t show_sys_wmi(struct asus_wmi *asus, int devid, char *buf)
 		.store  = store_##_name,				\
 	}
 
-ASUS_WMI_CREATE_DEVICE_ATTR(touchpad, 0644, ASUS_WMI_DEVID_TOUCHPAD);
-ASUS_WMI_CREATE_DEVICE_ATTR(camera, 0644, ASUS_WMI_DEVID_CAMERA);
-ASUS_WMI_CREATE_DEVICE_ATTR(cardr, 0644, ASUS_WMI_DEVID_CARDREADER);
-ASUS_WMI_CREATE_DEVICE_ATTR(lid_resume, 0644, ASUS_WMI_DEVID_LID_RESUME);
-ASUS_WMI_CREATE_DEVICE_ATTR(als_enable, 0644, ASUS_WMI_DEVID_ALS_ENABLE);
+ASUS_WMI_CREATE_DEVICE_ATTR(touchpad, 0644, ASUS_WMI_DEVID_TOUCHPAD,
+			    ASUS_SHADOW_TOUCHPAD);
+ASUS_WMI_CREATE_DEVICE_ATTR(camera, 0644, ASUS_WMI_DEVID_CAMERA,
+			    ASUS_SHADOW_CAMERA);
+ASUS_WMI_CREATE_DEVICE_ATTR(cardr, 0644, ASUS_WMI_DEVID_CARDREADER,
+			    ASUS_SHADOW_CARDR);
+ASUS_WMI_CREATE_DEVICE_ATTR(lid_resume, 0644, ASUS_WMI_DEVID_LID_RESUME,
+			    ASUS_SHADOW_LID_RESUME);
+ASUS_WMI_CREATE_DEVICE_ATTR(als_enable, 0644, ASUS_WMI_DEVID_ALS_ENABLE,
+			    ASUS_SHADOW_ALS_ENABLE);
 
 static ssize_t cpufv_store(struct device *dev, struct device_attribute *attr,
 			   const char *buf, size_t count)
@@ -2999,7 +8573,9 @@ static struct attribute *platform_attributes[] = {
 	&dev_attr_lid_resume.attr,
 	&dev_attr_als_enable.attr,
 	&dev_attr_fan_boost_mode.attr,
+	&dev_attr_fan_boost_mode_time_in_state.attr,
 	&dev_attr_throttle_thermal_policy.attr,
+	&dev_attr_throttle_thermal_policy_time_in_state.attr,
 	NULL
 };
 
@@ -3008,26 +8584,36 @@ static umode_t asus_sysfs_is_visible(struct kobject *kobj,
 {
 	struct device *dev = container_of(kobj, struct device, kobj);
 	struct asus_wmi *asus = dev_get_drvdata(dev);
+	enum asus_shadow_id id = ASUS_SHADOW_COUNT;
 	bool ok = true;
 	int devid = -1;
 
-	if (attr == &dev_attr_camera.attr)
+	if (attr == &dev_attr_camera.attr) {
 		devid = ASUS_WMI_DEVID_CAMERA;
-	else if (attr == &dev_attr_cardr.attr)
+		id = ASUS_SHADOW_CAMERA;
+	} else if (attr == &dev_attr_cardr.attr) {
 		devid = ASUS_WMI_DEVID_CARDREADER;
-	else if (attr == &dev_attr_touchpad.attr)
+		id = ASUS_SHADOW_CARDR;
+	} else if (attr == &dev_attr_touchpad.attr) {
 		devid = ASUS_WMI_DEVID_TOUCHPAD;
-	else if (attr == &dev_attr_lid_resume.attr)
+		id = ASUS_SHADOW_TOUCHPAD;
+	} else if (attr == &dev_attr_lid_resume.attr) {
 		devid = ASUS_WMI_DEVID_LID_RESUME;
-	else if (attr == &dev_attr_als_enable.attr)
+		id = ASUS_SHADOW_LID_RESUME;
+	} else if (attr == &dev_attr_als_enable.attr) {
 		devid = ASUS_WMI_DEVID_ALS_ENABLE;
-	else if (attr == &dev_attr_fan_boost_mode.attr)
+		id = ASUS_SHADOW_ALS_ENABLE;
+	}
+	else if (attr == &dev_attr_fan_boost_mode.attr ||
+		 attr == &dev_attr_fan_boost_mode_time_in_state.attr)
 		ok = asus->fan_boost_mode_available;
-	else if (attr == &dev_attr_throttle_thermal_policy.attr)
+	else if (attr == &dev_attr_throttle_thermal_policy.attr ||
+		 attr == &dev_attr_throttle_thermal_policy_time_in_state.attr)
 		ok = asus->throttle_thermal_policy_available;
 
+	/* Also marks the device present for store_sys_wmi() */
 	if (devid != -1)
-		ok = !(asus_wmi_get_devstate_simple(asus, devid) < 0);
+		ok = !(asus_shadow_get_devstate(asus, id, devid) < 0);
 
 	return ok ? attr->mode : 0;
 }
@@ -3118,6 +8704,10 @@ static int asus_wmi_platform_init(struct asus_wmi *asus)
 
 /* debugfs ********************************************************************/
 
+#define ASUS_WMI_BATCH_MAX	256	/* calls per batch write */
+#define ASUS_WMI_BATCH_LINE	96	/* longest result line is 81 chars */
+#define ASUS_WMI_SCAN_MAX	0x1000	/* dev_ids per scan */
+
 struct asus_wmi_debugfs_node {
 	struct asus_wmi *asus;
 	char *name;
@@ -3145,8 +8735,13 @@ static int show_devs(struct seq_file *m, void *data)
 	int err;
 	u32 retval = -1;
 
-	err = asus_wmi_set_devstate(asus->debug.dev_id, asus->debug.ctrl_param,
-				    &retval);
+	err = __asus_wmi_set_devstate(asus->debug.dev_id,
+				      asus->debug.ctrl_param, &retval);
+	if (err == -EINPROGRESS) {
+		seq_printf(m, "DEVS(%#x, %#x) queued\n", asus->debug.dev_id,
+			   asus->debug.ctrl_param);
+		return 0;
+	}
 	if (err < 0)
 		return err;
 
@@ -3168,9 +8763,17 @@ static int show_call(struct seq_file *m, void *data)
 	union acpi_object *obj;
 	acpi_status status;
 
+	mutex_lock(&asus_wmi_submit_lock);
 	status = wmi_evaluate_method(ASUS_WMI_MGMT_GUID,
 				     0, asus->debug.method_id,
 				     &input, &output);
+	mutex_unlock(&asus_wmi_submit_lock);
+
+	if (asus->debug.method_id != asus->dsts_id) {
+		asus_wmi_flight_forget(asus->debug.dev_id);
+		asus_shadow_invalidate(asus);
+		asus_led_invalidate(asus);
+	}
 
 	if (ACPI_FAILURE(status))
 		return -EIO;
@@ -3190,10 +8793,256 @@ static int show_call(struct seq_file *m, void *data)
 	return 0;
 }
 
+static int show_leds(struct seq_file *m, void *data)
+{
+	static const char * const names[ASUS_LED_COUNT] = {
+		[ASUS_LED_TPD] = "touchpad",
+		[ASUS_LED_KBD] = "kbd_backlight",
+		[ASUS_LED_WLAN] = "wlan",
+		[ASUS_LED_LIGHTBAR] = "lightbar",
+	};
+	struct asus_wmi *asus = m->private;
+	struct asus_led_slot slot;
+	unsigned long flags;
+	int i;
+
+	seq_puts(m, "led writes coalesced skipped\n");
+	for (i = 0; i < ASUS_LED_COUNT; i++) {
+		spin_lock_irqsave(&asus->led_lock, flags);
+		slot = asus->led_slots[i];
+		spin_unlock_irqrestore(&asus->led_lock, flags);
+
+		seq_printf(m, "%s %lu %lu %lu\n", names[i], slot.writes,
+			   slot.coalesced, slot.skipped);
+	}
+
+	return 0;
+}
+
+static int show_dsts_flights(struct seq_file *m, void *data)
+{
+	unsigned long calls, joined;
+
+	spin_lock(&asus_wmi_flight_lock);
+	calls = asus_wmi_flight_calls;
+	joined = asus_wmi_flight_joined;
+	spin_unlock(&asus_wmi_flight_lock);
+
+	seq_printf(m, "calls %lu\njoined %lu\n", calls, joined);
+
+	return 0;
+}
+
+/* DSTS of every dev_id in [scan_start, scan_end], only present ones shown */
+static int show_scan(struct seq_file *m, void *data)
+{
+	struct asus_wmi *asus = m->private;
+	u32 dev_id = asus->debug.scan_start;
+	u32 retval;
+	ktime_t start;
+	int err;
+
+	seq_puts(m, "dev_id dsts us\n");
+	do {
+		retval = 0;
+		start = ktime_get();
+		err = asus_wmi_evaluate_method(asus->dsts_id, dev_id, 0, &retval);
+		if (!err && (retval & ASUS_WMI_DSTS_PRESENCE_BIT))
+			seq_printf(m, "%#010x %#010x %lld\n", dev_id, retval,
+				   ktime_us_delta(ktime_get(), start));
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	} while (dev_id++ != asus->debug.scan_end);
+
+	return 0;
+}
+
+static int asus_wmi_debugfs_scan_open(struct inode *inode, struct file *file)
+{
+	struct asus_wmi *asus = inode->i_private;
+	u32 count;
+
+	if (asus->debug.scan_end < asus->debug.scan_start)
+		return -EINVAL;
+
+	count = asus->debug.scan_end - asus->debug.scan_start;
+	if (count >= ASUS_WMI_SCAN_MAX)
+		return -E2BIG;
+
+	/* Room for every id, so the scan is never run twice for one read */
+	return single_open_size(file, show_scan, asus, (count + 2) * 40);
+}
+
+static const struct file_operations asus_wmi_debugfs_scan_ops = {
+	.owner = THIS_MODULE,
+	.open = asus_wmi_debugfs_scan_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Each line written is a "method_id dev_id ctrl_param" call in hex. The
+ * calls are made in order and the results kept until the next batch.
+ */
+static ssize_t asus_wmi_debugfs_batch_write(struct file *file,
+					    const char __user *ubuf,
+					    size_t count, loff_t *ppos)
+{
+	struct asus_wmi *asus = file->private_data;
+	u32 method_id, dev_id, ctrl_param, retval;
+	size_t size = ASUS_WMI_BATCH_MAX * ASUS_WMI_BATCH_LINE;
+	char *buf, *line, *cur;
+	bool changed = false;
+	int calls = 0;
+	ktime_t start;
+	size_t len = 0;
+	char *out;
+	int err;
+
+	if (count > ASUS_WMI_BATCH_MAX * 40)
+		return -E2BIG;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	out = kvmalloc(size, GFP_KERNEL);
+	if (!out) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	cur = buf;
+	while ((line = strsep(&cur, "\n")) != NULL) {
+		line = strim(line);
+		if (!*line)
+			continue;
+
+		if (sscanf(line, "%x %x %x", &method_id, &dev_id,
+			   &ctrl_param) != 3 || ++calls > ASUS_WMI_BATCH_MAX) {
+			kvfree(out);
+			kfree(buf);
+			return -EINVAL;
+		}
+
+		retval = 0;
+		start = ktime_get();
+		if (method_id == ASUS_WMI_METHODID_DEVS)
+			err = __asus_wmi_set_devstate(dev_id, ctrl_param,
+						      &retval);
+		else
+			err = asus_wmi_evaluate_method(method_id, dev_id,
+						       ctrl_param, &retval);
+		changed |= method_id != asus->dsts_id;
+		len += scnprintf(out + len, size - len,
+				 "%#x(%#x, %#x) = %#x %d %lld\n", method_id,
+				 dev_id, ctrl_param, retval, err,
+				 ktime_us_delta(ktime_get(), start));
+	}
+	kfree(buf);
+
+	/* Anything but a status read may have changed what the driver caches */
+	if (changed) {
+		asus_shadow_invalidate(asus);
+		asus_led_invalidate(asus);
+	}
+
+	mutex_lock(&asus->debug.batch_lock);
+	kvfree(asus->debug.batch_out);
+	asus->debug.batch_out = out;
+	asus->debug.batch_len = len;
+	mutex_unlock(&asus->debug.batch_lock);
+
+	return count;
+}
+
+static ssize_t asus_wmi_debugfs_batch_read(struct file *file,
+					   char __user *ubuf, size_t count,
+					   loff_t *ppos)
+{
+	struct asus_wmi *asus = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&asus->debug.batch_lock);
+	ret = simple_read_from_buffer(ubuf, count, ppos, asus->debug.batch_out,
+				      asus->debug.batch_len);
+	mutex_unlock(&asus->debug.batch_lock);
+
+	return ret;
+}
+
+static const struct file_operations asus_wmi_debugfs_batch_ops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = asus_wmi_debugfs_batch_read,
+	.write = asus_wmi_debugfs_batch_write,
+	.llseek = default_llseek,
+};
+
+/*
+ * Feed a notify code through the event handler as if the firmware had sent
+ * it, to exercise hotkey paths concurrently with sysfs and ioctl writers.
+ */
+static ssize_t asus_wmi_debugfs_inject_write(struct file *file,
+					     const char __user *ubuf,
+					     size_t count, loff_t *ppos)
+{
+	struct asus_wmi *asus = file->private_data;
+	int code;
+	int err;
+
+	err = kstrtoint_from_user(ubuf, count, 0, &code);
+	if (err)
+		return err;
+
+	if (code < 0 || code > 0xff)
+		return -EINVAL;
+
+	asus_wmi_handle_event_code(code, asus);
+
+	return count;
+}
+
+static const struct file_operations asus_wmi_debugfs_inject_ops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = asus_wmi_debugfs_inject_write,
+	.llseek = default_llseek,
+};
+
+static int show_breakers(struct seq_file *m, void *data)
+{
+	struct asus_wmi_breaker b;
+	int i;
+
+	seq_puts(m, "dev_id state calls slow failed trips served deferred max_us\n");
+	for (i = 0; i < ASUS_WMI_BREAKERS; i++) {
+		spin_lock(&asus_wmi_breaker_lock);
+		b = asus_wmi_breakers[i];
+		spin_unlock(&asus_wmi_breaker_lock);
+
+		if (!b.used)
+			continue;
+
+		seq_printf(m, "%#010x %s %lu %lu %lu %lu %lu %lu %u\n",
+			   b.dev_id, b.open ? "open" : "closed", b.calls,
+			   b.slow, b.failed, b.trips, b.served, b.deferred,
+			   b.max_us);
+	}
+
+	return 0;
+}
+
 static struct asus_wmi_debugfs_node asus_wmi_debug_files[] = {
 	{NULL, "devs", show_devs},
 	{NULL, "dsts", show_dsts},
 	{NULL, "call", show_call},
+	{NULL, "leds", show_leds},
+	{NULL, "dsts_flights", show_dsts_flights},
+	{NULL, "breakers", show_breakers},
 };
 
 static int asus_wmi_debugfs_open(struct inode *inode, struct file *file)
@@ -3214,6 +9063,8 @@ static const struct file_operations asus_wmi_debugfs_io_ops = {
 static void asus_wmi_debugfs_exit(struct asus_wmi *asus)
 {
 	debugfs_remove_recursive(asus->debug.root);
+	kvfree(asus->debug.batch_out);
+	asus->debug.batch_out = NULL;
 }
 
 static void asus_wmi_debugfs_init(struct asus_wmi *asus)
@@ -3231,6 +9082,24 @@ static void asus_wmi_debugfs_init(struct asus_wmi *asus)
 	debugfs_create_x32("ctrl_param", S_IRUGO | S_IWUSR, asus->debug.root,
 			   &asus->debug.ctrl_param);
 
+	debugfs_create_x32("scan_start", S_IRUGO | S_IWUSR, asus->debug.root,
+			   &asus->debug.scan_start);
+
+	debugfs_create_x32("scan_end", S_IRUGO | S_IWUSR, asus->debug.root,
+			   &asus->debug.scan_end);
+
+	debugfs_create_file("scan", S_IFREG | S_IRUSR, asus->debug.root, asus,
+			    &asus_wmi_debugfs_scan_ops);
+
+	mutex_init(&asus->debug.batch_lock);
+	debugfs_create_file("batch", S_IFREG | S_IRUSR | S_IWUSR,
+			    asus->debug.root, asus,
+			    &asus_wmi_debugfs_batch_ops);
+
+	debugfs_create_file("inject_event", S_IFREG | S_IWUSR,
+			    asus->debug.root, asus,
+			    &asus_wmi_debugfs_inject_ops);
+
 	for (i = 0; i < ARRAY_SIZE(asus_wmi_debug_files); i++) {
 		struct asus_wmi_debugfs_node *node = &asus_wmi_debug_files[i];
 
@@ -3364,6 +9233,10 @@ static int asus_wmi_add(struct platform_device *pdev)
 	if (!asus)
 		return -ENOMEM;
 
+	seqlock_init(&asus->state_seq);
+	mutex_init(&asus->ctl_lock);
+	mutex_init(&asus->fan_lock);
+
 	asus->driver = &asus_nb_wmi_driver;
 	asus->platform_device = pdev;
 	asus->driver->platform_device = pdev;
@@ -3398,6 +9271,20 @@ static int asus_wmi_add(struct platform_device *pdev)
 	if (err)
 		goto fail_hwmon;
 
+	err = asus_wmi_telemetry_init(asus);
+	if (err)
+		goto fail_telemetry;
+
+	asus_wmi_thermal_init(asus); /* optional, failures are only logged */
+
+	err = asus_wmi_auto_policy_init(asus);
+	if (err)
+		goto fail_auto_policy;
+
+	err = asus_wmi_boost_init(asus);
+	if (err)
+		goto fail_boost;
+
 	err = asus_wmi_led_init(asus);
 	if (err)
 		goto fail_leds;
@@ -3406,6 +9293,16 @@ static int asus_wmi_add(struct platform_device *pdev)
 	if (err)
 		goto fail_rgbkb;
 
+	err = asus_wmi_power_profile_init(asus);
+	if (err)
+		goto fail_power_profile;
+
+	asus_wmi_profiles_init(asus); /* optional, failures are only logged */
+
+	err = asus_wmi_ctl_init(asus);
+	if (err)
+		goto fail_ctl;
+
 	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_WLAN, &result);
 	if (result & (ASUS_WMI_DSTS_PRESENCE_BIT | ASUS_WMI_DSTS_USER_BIT))
 		asus->driver->wlan_ctrl_by_user = 1;
@@ -3443,9 +9340,13 @@ static int asus_wmi_add(struct platform_device *pdev)
 	} else if (asus->driver->quirks->wmi_backlight_set_devstate)
 		err = asus_wmi_set_devstate(ASUS_WMI_DEVID_BACKLIGHT, 2, NULL);
 
-	if (asus_wmi_has_fnlock_key(asus)) {
-		asus->fnlock_locked = true;
+	/* The key does not come and go, only the lock state is restored later */
+	asus->fnlock_available = asus_wmi_has_fnlock_key(asus);
+	if (asus->fnlock_available) {
+		mutex_lock(&asus->ctl_lock);
+		asus_state_publish(asus, asus->fnlock_locked, true);
 		asus_wmi_fnlock_update(asus);
+		mutex_unlock(&asus->ctl_lock);
 	}
 
 	status = wmi_install_notify_handler(asus->driver->event_guid,
@@ -3465,10 +9366,22 @@ fail_wmi_handler:
 fail_backlight:
 	asus_wmi_rfkill_exit(asus);
 fail_rfkill:
+	asus_wmi_ctl_exit(asus);
+fail_ctl:
+	asus_wmi_profiles_exit(asus);
+	asus_wmi_power_profile_exit(asus);
+fail_power_profile:
 	kbbl_rgb_exit(asus);
 fail_rgbkb:
 	asus_wmi_led_exit(asus);
 fail_leds:
+	asus_wmi_boost_exit(asus);
+fail_boost:
+	asus_wmi_auto_policy_exit(asus);
+fail_auto_policy:
+	asus_wmi_thermal_exit(asus);
+	asus_wmi_telemetry_exit(asus);
+fail_telemetry:
 fail_hwmon:
 	asus_wmi_input_exit(asus);
 fail_input:
@@ -3492,12 +9405,22 @@ static int asus_wmi_remove(struct platform_device *device)
 	wmi_remove_notify_handler(asus->driver->event_guid);
 	asus_wmi_backlight_exit(asus);
 	asus_wmi_input_exit(asus);
+	asus_wmi_ctl_exit(asus);
+	asus_wmi_profiles_exit(asus);
+	asus_wmi_power_profile_exit(asus);
 	asus_wmi_led_exit(asus);
 	kbbl_rgb_exit(asus);
+	asus_wmi_boost_exit(asus);
+	asus_wmi_auto_policy_exit(asus);
+	asus_wmi_thermal_exit(asus);
+	asus_wmi_telemetry_exit(asus);
 	asus_wmi_rfkill_exit(asus);
 	asus_wmi_debugfs_exit(asus);
 	asus_wmi_sysfs_exit(asus->platform_device);
+	cancel_delayed_work_sync(&asus->fan_curve.work);
+	mutex_lock(&asus->fan_lock);
 	asus_fan_set_auto(asus);
+	mutex_unlock(&asus->fan_lock);
 
 	kfree(asus);
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0))
@@ -3530,11 +9453,16 @@ static int asus_hotk_resume(struct device *device)
 {
 	struct asus_wmi *asus = dev_get_drvdata(device);
 
+	asus_led_invalidate(asus);
+	asus_shadow_invalidate(asus);
 	if (!IS_ERR_OR_NULL(asus->kbd_led.dev))
 		kbd_led_update(asus);
 
-	if (asus_wmi_has_fnlock_key(asus))
+	if (asus->fnlock_available) {
+		mutex_lock(&asus->ctl_lock);
 		asus_wmi_fnlock_update(asus);
+		mutex_unlock(&asus->ctl_lock);
+	}
 
 	if (asus->driver->quirks->use_lid_flip_devid)
 		lid_flip_tablet_mode_get_state(asus);
@@ -3572,11 +9500,16 @@ static int asus_hotk_restore(struct device *device)
 		bl = !asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_UWB);
 		rfkill_set_sw_state(asus->uwb.rfkill, bl);
 	}
+	asus_led_invalidate(asus);
+	asus_shadow_invalidate(asus);
 	if (!IS_ERR_OR_NULL(asus->kbd_led.dev))
 		kbd_led_update(asus);
 
-	if (asus_wmi_has_fnlock_key(asus))
+	if (asus->fnlock_available) {
+		mutex_lock(&asus->ctl_lock);
 		asus_wmi_fnlock_update(asus);
+		mutex_unlock(&asus->ctl_lock);
+	}
 
 	if (asus->driver->quirks->use_lid_flip_devid)
 		lid_flip_tablet_mode_get_state(asus);
@@ -3602,6 +9535,12 @@ static struct platform_driver atw_platform_driver = {
 		.name = KBUILD_MODNAME,
 		.owner = THIS_MODULE,
 		.pm = &asus_pm_ops,
+		/*
+		 * Open /dev/faustus* descriptors and profile items keep using
+		 * asus. They pin the module, so only an unbind could free it
+		 * under them.
+		 */
+		.suppress_bind_attrs = true,
 	}
 };
 
@@ -3857,6 +9796,7 @@ static void __exit atw_cleanup(void)
 	pr_info("Faustus unloading..");
 	platform_driver_unregister(&atw_platform_driver);
 	platform_device_unregister(atw_platform_dev);
+	cancel_delayed_work_sync(&asus_wmi_breaker_work);
 }
  
 module_init(atw_init);
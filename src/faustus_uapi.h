@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Faustus userspace ABI
+ *
+ * Structures and ioctls shared with userspace tools. This header must stay
+ * includable from userspace, so only <linux/...> uapi headers are allowed.
+ */
+#ifndef __FAUSTUS_UAPI_H
+#define __FAUSTUS_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define FAUSTUS_IOC_MAGIC		'F'
+
+/* /dev/faustus_kbbl **********************************************************/
+
+/*
+ * Lease types for the RGB keyboard backlight. While a lease is held, writes
+ * from other clients (sysfs kbbl/, aura hotkeys, other descriptors) are
+ * rejected (exclusive) or their commits are queued until release (priority).
+ * A lease is dropped when its file descriptor is closed.
+ */
+#define FAUSTUS_KBBL_LEASE_NONE		0
+#define FAUSTUS_KBBL_LEASE_PRIORITY	1
+#define FAUSTUS_KBBL_LEASE_EXCLUSIVE	2
+
+/* Acquire (or with LEASE_NONE release) a lease, arg points to the type */
+#define FAUSTUS_KBBL_IOC_LEASE		_IOW(FAUSTUS_IOC_MAGIC, 0x01, __u32)
+
+/* Record read from and written to /dev/faustus_kbbl */
+struct faustus_kbbl_state {
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+	__u8 mode;		/* same values as kbbl/kbbl_mode */
+	__u8 speed;		/* same values as kbbl/kbbl_speed */
+	__u8 flags;		/* same values as kbbl/kbbl_flags */
+	__u8 persistent;	/* write only: 1 - permanently, 0 - temporarily */
+	__u8 reserved;
+};
+
+/* /dev/faustus_telemetry *****************************************************/
+
+#define FAUSTUS_TELEMETRY_TEMP		(1 << 0)
+#define FAUSTUS_TELEMETRY_FAN1		(1 << 1)
+#define FAUSTUS_TELEMETRY_FAN2		(1 << 2)
+
+/*
+ * Record read from /dev/faustus_telemetry, oldest first. A new descriptor
+ * starts at the oldest sample still held by the driver. Fields not flagged
+ * in valid could not be read and are zero.
+ */
+struct faustus_telemetry_sample {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC */
+	__s32 temp;		/* CPU temperature in millidegree Celsius */
+	__u32 fan[2];		/* CPU and GPU fan speed in RPM */
+	__u32 valid;		/* FAUSTUS_TELEMETRY_* */
+};
+
+/* telemetry_snapshot *********************************************************/
+
+/*
+ * Binary contents of /sys/devices/platform/faustus/telemetry_snapshot.
+ * Fields are only ever appended: check version and size, and read what fits.
+ * The FAUSTUS_TELEMETRY_* bits are shared with the telemetry samples.
+ */
+#define FAUSTUS_SNAPSHOT_VERSION		1
+
+#define FAUSTUS_SNAPSHOT_PWM			(1 << 8)
+#define FAUSTUS_SNAPSHOT_PWM_ENABLE		(1 << 9)
+#define FAUSTUS_SNAPSHOT_FAN_BOOST_MODE		(1 << 10)
+#define FAUSTUS_SNAPSHOT_THERMAL_POLICY		(1 << 11)
+
+struct faustus_snapshot {
+	__u32 version;		/* FAUSTUS_SNAPSHOT_VERSION */
+	__u32 size;		/* size of this structure */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC */
+	__s32 temp;		/* CPU temperature in millidegree Celsius */
+	__u32 fan[2];		/* CPU and GPU fan speed in RPM */
+	__u32 valid;		/* FAUSTUS_TELEMETRY_* | FAUSTUS_SNAPSHOT_* */
+	__u8 pwm;		/* as hwmon pwm1 */
+	__u8 pwm_enable;	/* as hwmon pwm1_enable */
+	__u8 fan_boost_mode;
+	__u8 throttle_thermal_policy;
+	__u32 reserved;
+};
+
+/* /dev/faustus_boost *********************************************************/
+
+/*
+ * Minimum modes for a boost lease. They map to throttle_thermal_policy, or
+ * to the closest available fan_boost_mode at least as fast.
+ */
+#define FAUSTUS_BOOST_MODE_SILENT	0
+#define FAUSTUS_BOOST_MODE_DEFAULT	1
+#define FAUSTUS_BOOST_MODE_OVERBOOST	2
+
+struct faustus_boost_request {
+	__u32 mode;		/* FAUSTUS_BOOST_MODE_* */
+	__u32 timeout_ms;	/* 0 - until cancelled or closed */
+};
+
+/*
+ * Each descriptor holds at most one lease, a new request replaces it. The
+ * lease ends on timeout, FAUSTUS_BOOST_IOC_CANCEL or close.
+ */
+#define FAUSTUS_BOOST_IOC_REQUEST	_IOW(FAUSTUS_IOC_MAGIC, 0x10, \
+					     struct faustus_boost_request)
+#define FAUSTUS_BOOST_IOC_CANCEL	_IO(FAUSTUS_IOC_MAGIC, 0x11)
+
+/* /dev/faustus **************************************************************/
+
+#define FAUSTUS_CTL_VERSION		1
+
+/* Fields of struct faustus_ctl_state, set in the order listed */
+#define FAUSTUS_CTL_FAN_BOOST_MODE	(1 << 0)
+#define FAUSTUS_CTL_THERMAL_POLICY	(1 << 1)
+#define FAUSTUS_CTL_KBD_BACKLIGHT	(1 << 2)
+#define FAUSTUS_CTL_CHARGE_END		(1 << 3)
+#define FAUSTUS_CTL_KBBL		(1 << 4)
+#define FAUSTUS_CTL_TELEMETRY		(1 << 5)	/* get only */
+
+/*
+ * Fields flagged in mask are read or written in one call. Fields that could
+ * not be handled are flagged in failed and the ioctl returns the first error,
+ * the structure is copied back either way. Writes the BIOS is not answering
+ * in time are queued and flagged in deferred instead. Setting kbbl fails with
+ * EBUSY while another client holds a /dev/faustus_kbbl lease. Unknown mask
+ * bits or nonzero reserved fields fail with EINVAL.
+ */
+struct faustus_ctl_state {
+	__u32 mask;		/* FAUSTUS_CTL_* */
+	__u32 failed;		/* out: FAUSTUS_CTL_* */
+	__u8 fan_boost_mode;	/* same values as the sysfs attributes */
+	__u8 throttle_thermal_policy;
+	__u8 kbd_backlight;
+	__u8 charge_control_end_threshold;
+	struct faustus_kbbl_state kbbl;
+	__s32 temp;		/* as struct faustus_telemetry_sample */
+	__u32 fan[2];
+	__u32 telemetry_valid;	/* FAUSTUS_TELEMETRY_* */
+	__u32 deferred;		/* out: FAUSTUS_CTL_* */
+	__u32 reserved[3];	/* zero */
+};
+
+/* Returns FAUSTUS_CTL_VERSION, bumped when the structure changes */
+#define FAUSTUS_CTL_IOC_VERSION		_IOR(FAUSTUS_IOC_MAGIC, 0x20, __u32)
+#define FAUSTUS_CTL_IOC_GET		_IOWR(FAUSTUS_IOC_MAGIC, 0x21, \
+					      struct faustus_ctl_state)
+#define FAUSTUS_CTL_IOC_SET		_IOWR(FAUSTUS_IOC_MAGIC, 0x22, \
+					      struct faustus_ctl_state)
+
+#endif	/* __FAUSTUS_UAPI_H */